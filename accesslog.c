@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include "accesslog.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+/* like the metrics, rings are shared by the threads assigned to them,
+   which keeps memory bounded with one thread per client. */
+#define RINGS 16
+#define RING_SIZE 128 /* records, a power of 2 */
+#define OUTBUF (64*1024)
+#define MAXLINE 2048
+#define FLUSH_POLL_MS 10
+
+enum logevent {
+	LE_MESSAGE,
+	LE_CONNECT,
+	LE_CLOSE,
+	LE_UDP,
+	LE_TIMEOUT,
+};
+
+struct logrec {
+	long long ts; /* usec since the epoch */
+	long long usec;
+	unsigned long long up, down;
+	union sockaddr_union client, target;
+	int fd;
+	unsigned short port;
+	unsigned char event, result;
+	char text[160]; /* host name (truncated) or message */
+};
+
+/* bounded queue after dmitry vyukov: the slot for position pos is free
+   when its seq equals pos, and holds a record once it is pos+1. producers
+   claim positions with a cas on head, the writer is the only consumer. */
+struct slot {
+	unsigned seq;
+	struct logrec r;
+};
+
+struct ring {
+	unsigned head __attribute__((aligned(64)));
+	unsigned tail __attribute__((aligned(64)));
+	struct slot s[RING_SIZE];
+};
+
+static struct ring *rings;
+static unsigned next_ring;
+/* the writer sleeps while all rings are empty. it sets sleeping before
+   it looks at them a last time, producers check it after publishing a
+   record and wake it up if it's set. */
+static int sleeping;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static __thread struct ring *my_ring;
+static unsigned long long dropped;
+static int json, outfd = -1;
+static const char *sockpath;
+
+static const char *event_names[] = {
+	[LE_MESSAGE] = "message", [LE_CONNECT] = "connect",
+	[LE_CLOSE] = "close", [LE_UDP] = "udp", [LE_TIMEOUT] = "timeout",
+};
+
+static long long realtime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static struct slot *claim(unsigned *pos) {
+	struct ring *r;
+	struct slot *s;
+	if(!rings) return 0;
+	if(!my_ring)
+		my_ring = &rings[__atomic_fetch_add(&next_ring, 1, __ATOMIC_RELAXED) % RINGS];
+	r = my_ring;
+	*pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while(1) {
+		s = &r->s[*pos % RING_SIZE];
+		int d = (int) (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - *pos);
+		if(d == 0) {
+			if(__atomic_compare_exchange_n(&r->head, pos, *pos + 1, 1,
+			                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return s;
+		} else if(d < 0) {
+			/* full, the writer can't keep up */
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+			metric_inc(M_LOG_DROPPED);
+			return 0;
+		} else
+			*pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+}
+
+static void wake_writer(void) {
+	pthread_mutex_lock(&lock);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void publish(struct slot *s, unsigned pos) {
+	s->r.ts = realtime_us();
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	/* pairs with the fence in the writer: either it sees the record, or
+	   this sees it sleeping. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) wake_writer();
+}
+
+static struct slot *claim_client(unsigned *pos, int event, const struct client *client) {
+	struct slot *s = claim(pos);
+	if(s) {
+		s->r.event = event;
+		s->r.fd = client->fd;
+		s->r.client = client->addr;
+		s->r.result = 0;
+		s->r.text[0] = 0;
+	}
+	return s;
+}
+
+void alog_msg(const char *fmt, ...) {
+	unsigned pos;
+	struct slot *s = claim(&pos);
+	va_list ap;
+	size_t l;
+	if(!s) return;
+	va_start(ap, fmt);
+	vsnprintf(s->r.text, sizeof s->r.text, fmt, ap);
+	va_end(ap);
+	l = strlen(s->r.text);
+	if(l && s->r.text[l-1] == '\n') s->r.text[l-1] = 0;
+	s->r.event = LE_MESSAGE;
+	publish(s, pos);
+}
+
+void alog_connect(const struct client *client, const char *host, unsigned short port,
+                  const union sockaddr_union *target, int result) {
+	unsigned pos;
+	struct slot *s = claim_client(&pos, LE_CONNECT, client);
+	if(!s) return;
+	if(host) snprintf(s->r.text, sizeof s->r.text, "%s", host);
+	else s->r.target = *target;
+	s->r.port = port;
+	s->r.result = result;
+	publish(s, pos);
+}
+
+void alog_close(const struct client *client, unsigned long long up,
+                unsigned long long down, long long usec, int result) {
+	unsigned pos;
+	struct slot *s = claim_client(&pos, LE_CLOSE, client);
+	if(!s) return;
+	s->r.up = up;
+	s->r.down = down;
+	s->r.usec = usec;
+	s->r.result = result;
+	publish(s, pos);
+}
+
+void alog_udp(const struct client *client) {
+	unsigned pos;
+	struct slot *s = claim_client(&pos, LE_UDP, client);
+	if(s) publish(s, pos);
+}
+
+void alog_timeout(const struct client *client, const char *phase) {
+	unsigned pos;
+	struct slot *s = claim_client(&pos, LE_TIMEOUT, client);
+	if(!s) return;
+	snprintf(s->r.text, sizeof s->r.text, "%s", phase);
+	publish(s, pos);
+}
+
+static struct slot *peek(struct ring *r) {
+	struct slot *s = &r->s[r->tail % RING_SIZE];
+	return __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == r->tail + 1 ? s : 0;
+}
+
+static void release(struct ring *r, struct slot *s) {
+	__atomic_store_n(&s->seq, r->tail + RING_SIZE, __ATOMIC_RELEASE);
+	r->tail++;
+}
+
+static void addr_str(const union sockaddr_union *a, char *buf, size_t n) {
+	if(!inet_ntop(SOCKADDR_UNION_AF(a), SOCKADDR_UNION_ADDRESS(a), buf, n))
+		snprintf(buf, n, "?");
+}
+
+/* host names come from clients and may contain anything, e.g. newlines
+   to forge records. */
+static void text_str(char *out, const char *s) {
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '\\' || c < 0x20 || c == 0x7f)
+			out += sprintf(out, "\\x%02x", c);
+		else
+			*out++ = c;
+	}
+	*out = 0;
+}
+
+static void json_str(char *out, const char *s) {
+	*out++ = '"';
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		} else if(c < 0x20 || c >= 0x7f)
+			out += sprintf(out, "\\u%04x", c);
+		else
+			*out++ = c;
+	}
+	*out++ = '"';
+	*out = 0;
+}
+
+static int format(char *out, const struct logrec *r) {
+	char ts[40], client[INET6_ADDRSTRLEN], target[6*sizeof r->text+2];
+	time_t t = r->ts / 1000000;
+	struct tm tm;
+	int n;
+	gmtime_r(&t, &tm);
+	n = strftime(ts, sizeof ts, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(ts + n, sizeof ts - n, json ? ".%06lldZ" : ".%03lldZ",
+	         json ? r->ts % 1000000 : r->ts % 1000000 / 1000);
+	if(r->event != LE_MESSAGE) addr_str(&r->client, client, sizeof client);
+	if(r->event == LE_CONNECT && !r->text[0]) addr_str(&r->target, target, sizeof target);
+	else if(json) json_str(target, r->text);
+	else text_str(target, r->text);
+
+	if(!json) switch(r->event) {
+	case LE_MESSAGE:
+		return snprintf(out, MAXLINE, "%s %s\n", ts, target);
+	case LE_CONNECT:
+		if(!r->result)
+			return snprintf(out, MAXLINE, "%s client[%d] %s: connected to %s:%u\n",
+			                ts, r->fd, client, target, r->port);
+		return snprintf(out, MAXLINE, "%s client[%d] %s: connecting to %s:%u failed: %s\n",
+		                ts, r->fd, client, target, r->port, ec_names[r->result]);
+	case LE_CLOSE:
+		if(r->result)
+			return snprintf(out, MAXLINE, "%s client[%d] %s: connecting failed: %s\n",
+			                ts, r->fd, client, ec_names[r->result]);
+		return snprintf(out, MAXLINE, "%s client[%d] %s: closed after %lld.%03llds, %llu bytes up, %llu down\n",
+		                ts, r->fd, client, r->usec / 1000000, r->usec % 1000000 / 1000, r->up, r->down);
+	case LE_TIMEOUT:
+		return snprintf(out, MAXLINE, "%s client[%d] %s: %s timeout\n", ts, r->fd, client, r->text);
+	default:
+		return snprintf(out, MAXLINE, "%s client[%d] %s: udp association\n", ts, r->fd, client);
+	}
+
+	if(r->event == LE_MESSAGE)
+		return snprintf(out, MAXLINE, "{\"ts\":\"%s\",\"event\":\"message\",\"message\":%s}\n", ts, target);
+	n = snprintf(out, MAXLINE, "{\"ts\":\"%s\",\"event\":\"%s\",\"fd\":%d,\"client\":\"%s\",\"client_port\":%u",
+	             ts, event_names[r->event], r->fd, client, ntohs(SOCKADDR_UNION_PORT(&r->client)));
+	if(r->event == LE_CONNECT)
+		n += snprintf(out + n, MAXLINE - n, ",\"target\":%s%s%s,\"port\":%u",
+		              r->text[0] ? "" : "\"", target, r->text[0] ? "" : "\"", r->port);
+	if(r->event == LE_TIMEOUT)
+		n += snprintf(out + n, MAXLINE - n, ",\"phase\":\"%s\"", r->text);
+	else if(r->event != LE_UDP)
+		n += snprintf(out + n, MAXLINE - n, ",\"result\":\"%s\"", ec_names[r->result]);
+	if(r->event == LE_CLOSE)
+		n += snprintf(out + n, MAXLINE - n, ",\"bytes_up\":%llu,\"bytes_down\":%llu,\"duration\":%lld.%06lld",
+		              r->up, r->down, r->usec / 1000000, r->usec % 1000000);
+	n += snprintf(out + n, MAXLINE - n, "}\n");
+	return n;
+}
+
+static int connect_sock(void) {
+	struct sockaddr_un sa = {.sun_family = AF_UNIX};
+	int fd;
+	if(strlen(sockpath) >= sizeof sa.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa.sun_path, sockpath);
+	if((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) return -1;
+	if(connect(fd, (void*) &sa, sizeof sa)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void flush(const char *buf, size_t n) {
+	static time_t last_try;
+	while(n) {
+		if(outfd == -1) {
+			/* the log socket went away. reconnects are tried at most
+			   once a second, what's written meanwhile is lost. */
+			time_t now = time(0);
+			if(now == last_try) return;
+			last_try = now;
+			if((outfd = connect_sock()) == -1) return;
+		}
+		ssize_t w = write(outfd, buf, n);
+		if(w < 0 && errno == EINTR) continue;
+		if(w <= 0) {
+			if(sockpath) {
+				close(outfd);
+				outfd = -1;
+			}
+			return;
+		}
+		buf += w;
+		n -= w;
+	}
+}
+
+/* rounds of the writer that found nothing to do */
+static unsigned idle_rounds;
+
+static int rings_empty(void) {
+	unsigned i;
+	for(i=0; i<RINGS; i++) if(peek(&rings[i])) return 0;
+	return 1;
+}
+
+static void *writer(void *arg) {
+	static char out[OUTBUF];
+	struct slot *s;
+	unsigned i, j;
+	(void) arg;
+	while(1) {
+		size_t n = 0;
+		int busy = 0;
+		for(i=0; i<RINGS; i++) {
+			for(j=0; j<RING_SIZE && (s = peek(&rings[i])); j++) {
+				n += format(out + n, &s->r);
+				release(&rings[i], s);
+				if(n > OUTBUF - MAXLINE) {
+					flush(out, n);
+					n = 0;
+				}
+			}
+			busy |= j;
+		}
+		unsigned long long d = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		if(d) {
+			struct logrec r = {.event = LE_MESSAGE, .ts = realtime_us()};
+			snprintf(r.text, sizeof r.text, "%llu log records dropped", d);
+			n += format(out + n, &r);
+		}
+		if(n) flush(out, n);
+		if(!busy) {
+			__atomic_add_fetch(&idle_rounds, 1, __ATOMIC_RELEASE);
+			pthread_mutex_lock(&lock);
+			__atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(rings_empty()) pthread_cond_wait(&cond, &lock);
+			__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return 0;
+}
+
+void alog_flush(void) {
+	struct timespec poll = {.tv_nsec = FLUSH_POLL_MS * 1000000L};
+	unsigned i, start = __atomic_load_n(&idle_rounds, __ATOMIC_ACQUIRE);
+	if(!rings) return;
+	/* the second round after this started found all rings empty, and
+	   wrote out everything before. the writer is woken up for each, as
+	   it may be sleeping already. give up after a second. */
+	for(i=0; i < 1000 / FLUSH_POLL_MS; i++) {
+		if(__atomic_load_n(&idle_rounds, __ATOMIC_ACQUIRE) - start >= 2) return;
+		wake_writer();
+		nanosleep(&poll, 0);
+	}
+}
+
+int alog_init(const char *dest, int as_json) {
+	pthread_t pt;
+	unsigned i, j;
+	void *p;
+	json = as_json;
+	if(!strcmp(dest, "-")) outfd = 2;
+	else if(!strncmp(dest, "unix:", 5)) {
+		sockpath = dest + 5;
+		if((outfd = connect_sock()) == -1) return -1;
+	} else if((outfd = open(dest, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644)) == -1)
+		return -1;
+	if((errno = posix_memalign(&p, 64, RINGS * sizeof *rings))) return -1;
+	rings = p;
+	for(i=0; i<RINGS; i++) {
+		rings[i].head = rings[i].tail = 0;
+		for(j=0; j<RING_SIZE; j++) rings[i].s[j].seq = j;
+	}
+	if((errno = pthread_create(&pt, 0, writer, 0))) {
+		free(rings);
+		rings = 0;
+		return -1;
+	}
+	pthread_detach(pt);
+	metric_inc(M_THREADS);
+	return 0;
+}
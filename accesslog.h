@@ -0,0 +1,33 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "accesslog.c"
+
+/* client threads only copy fixed-size records into ring buffers, a
+   writer thread formats them and writes them out in batches. until
+   alog_init() was called, all of these do nothing. */
+
+/* starts the writer. dest is a file to append to, "unix:path" for a
+   stream socket or "-" for stderr. with json, records are written as
+   json lines, otherwise as text. returns 0, or -1 with errno set. */
+int alog_init(const char *dest, int json);
+
+/* a free-form message, formatted like printf. */
+void alog_msg(const char *fmt, ...);
+/* outcome of a CONNECT request, either to host and port or to the
+   literal address target. */
+void alog_connect(const struct client *client, const char *host, unsigned short port,
+                  const union sockaddr_union *target, int result);
+/* end of a tunnel: bytes relayed in each direction and its lifetime.
+   result is nonzero if connecting failed in the non-blocking modes. */
+void alog_close(const struct client *client, unsigned long long up,
+                unsigned long long down, long long usec, int result);
+void alog_udp(const struct client *client);
+/* a connection was shut down as the timeout of phase expired. */
+void alog_timeout(const struct client *client, const char *phase);
+/* waits for the records logged so far to be written, before exiting. */
+void alog_flush(void);
+
+#endif
@@ -0,0 +1,205 @@
+#include "admit.h"
+#include "metrics.h"
+#include "socks5.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define IP_TABLE_SIZE 4096
+
+/* concurrent clients per ip, entries are dropped when they reach 0. */
+struct ipcount {
+	struct ipcount *next;
+	unsigned char key[16];
+	unsigned n;
+};
+
+static unsigned max_tunnels, max_per_ip, max_handshakes;
+static unsigned tunnels, handshakes;
+/* all admitted clients, limited or not */
+static unsigned clients;
+static struct ipcount *ip_table[IP_TABLE_SIZE];
+static pthread_mutex_t ip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static int spare = -1;
+
+/* ipv4 addresses mapped into ::ffff:0:0/96, as in iplist.c */
+static int make_key(const union sockaddr_union *addr, unsigned char key[16]) {
+	static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+	switch(SOCKADDR_UNION_AF(addr)) {
+		case AF_INET:
+			memcpy(key, v4mapped, 12);
+			memcpy(key+12, &addr->v4.sin_addr, 4);
+			return 0;
+		case AF_INET6:
+			memcpy(key, &addr->v6.sin6_addr, 16);
+			return 0;
+	}
+	return -1;
+}
+
+static unsigned hash_key(const unsigned char key[16]) {
+	unsigned h = 2166136261u, i;
+	for(i=0;i<16;i++) h = (h ^ key[i]) * 16777619u;
+	return h % IP_TABLE_SIZE;
+}
+
+/* counts a client of addr unless there are max_per_ip already, or it
+   can't be counted for lack of memory: admitting it anyway would make
+   its ip_release() take the place of another client. */
+static int ip_acquire(const union sockaddr_union *addr) {
+	unsigned char key[16];
+	struct ipcount *e;
+	int ret = 0;
+	if(make_key(addr, key)) return 0;
+	pthread_mutex_lock(&ip_lock);
+	for(e = ip_table[hash_key(key)]; e; e = e->next)
+		if(!memcmp(e->key, key, 16)) break;
+	if(!e) {
+		if((e = malloc(sizeof *e))) {
+			memcpy(e->key, key, 16);
+			e->n = 1;
+			e->next = ip_table[hash_key(key)];
+			ip_table[hash_key(key)] = e;
+		} else ret = -1;
+	} else if(e->n >= max_per_ip) ret = -1;
+	else e->n++;
+	pthread_mutex_unlock(&ip_lock);
+	return ret;
+}
+
+static void ip_release(const union sockaddr_union *addr) {
+	unsigned char key[16];
+	struct ipcount *e, **pp;
+	if(make_key(addr, key)) return;
+	pthread_mutex_lock(&ip_lock);
+	for(pp = &ip_table[hash_key(key)]; (e = *pp); pp = &e->next)
+		if(!memcmp(e->key, key, 16)) {
+			if(!--e->n) {
+				*pp = e->next;
+				free(e);
+			}
+			break;
+		}
+	pthread_mutex_unlock(&ip_lock);
+}
+
+static void raise_nofile(void) {
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == rl.rlim_max) return;
+	rl.rlim_cur = rl.rlim_max;
+#ifdef OPEN_MAX
+	/* darwin refuses anything above OPEN_MAX */
+	if(rl.rlim_cur > OPEN_MAX) rl.rlim_cur = OPEN_MAX;
+#endif
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static int reserve_spare(void) {
+	pthread_mutex_lock(&spare_lock);
+	if(spare == -1)
+		__atomic_store_n(&spare, open("/dev/null", O_RDONLY|O_CLOEXEC), __ATOMIC_RELAXED);
+	int ret = spare == -1 ? -1 : 0;
+	pthread_mutex_unlock(&spare_lock);
+	return ret;
+}
+
+int admit_init(unsigned tunnels, unsigned per_ip, unsigned handshakes) {
+	max_tunnels = tunnels;
+	max_per_ip = per_ip;
+	max_handshakes = handshakes;
+	raise_nofile();
+	return reserve_spare();
+}
+
+int admit_accept_failed(int err) {
+	int ret = 0;
+	if(err != EMFILE && err != ENFILE) return 0;
+	pthread_mutex_lock(&spare_lock);
+	if(spare != -1) {
+		close(spare);
+		__atomic_store_n(&spare, -1, __ATOMIC_RELAXED);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&spare_lock);
+	return ret;
+}
+
+void admit_reject(int fd) {
+	static const unsigned char refused[] = {5, 0xff}, failed[] = {
+		5, 0, /* method selection */
+		5, 1, 0, 1, 0, 0, 0, 0, 0, 0, /* general failure */
+	};
+	unsigned char buf[512];
+	struct s5greeting g;
+	struct s5request r;
+	int reply = 0;
+	/* take what the client sent already, closing a socket with unread
+	   data resets the connection and the reply may get lost. */
+	ssize_t n = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+	/* a request can only be answered once a method was chosen, which it
+	   may be if the client offered no auth and didn't wait for it. else
+	   all methods are refused, as rfc 1928 wants before a request. */
+	if(n > 0 && s5_greeting(buf, n, &g) == S5_DONE &&
+	   memchr(g.methods, 0, g.n_methods) &&
+	   s5_request(buf + g.len, n - g.len, &r) == S5_DONE)
+		reply = 1;
+	if(reply) send(fd, failed, sizeof failed, MSG_DONTWAIT);
+	else send(fd, refused, sizeof refused, MSG_DONTWAIT);
+	close(fd);
+	metric_inc(M_REJECTED);
+}
+
+int admit_client(struct client *client) {
+	client->tunnel = 0;
+	if(__atomic_load_n(&spare, __ATOMIC_RELAXED) == -1 && reserve_spare()) {
+		/* still out of fds: this one was only accepted to drain the
+		   backlog, closing it makes room to take the spare back. */
+		admit_reject(client->fd);
+		reserve_spare();
+		return -1;
+	}
+	if(max_tunnels && __atomic_load_n(&tunnels, __ATOMIC_RELAXED) >= max_tunnels)
+		goto reject;
+	if(max_handshakes && __atomic_add_fetch(&handshakes, 1, __ATOMIC_RELAXED) > max_handshakes) {
+		__atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+		goto reject;
+	}
+	if(max_per_ip && ip_acquire(&client->addr)) {
+		if(max_handshakes) __atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+		goto reject;
+	}
+	__atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED);
+	return 0;
+reject:
+	admit_reject(client->fd);
+	return -1;
+}
+
+int admit_tunnel(struct client *client) {
+	if(max_tunnels && __atomic_add_fetch(&tunnels, 1, __ATOMIC_RELAXED) > max_tunnels) {
+		__atomic_sub_fetch(&tunnels, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if(max_handshakes) __atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+	client->tunnel = 1;
+	return 0;
+}
+
+void admit_release(struct client *client) {
+	if(client->tunnel) {
+		if(max_tunnels) __atomic_sub_fetch(&tunnels, 1, __ATOMIC_RELAXED);
+	} else if(max_handshakes) __atomic_sub_fetch(&handshakes, 1, __ATOMIC_RELAXED);
+	if(max_per_ip) ip_release(&client->addr);
+	__atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+}
+
+unsigned admit_clients(void) {
+	return __atomic_load_n(&clients, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,35 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "admit.c"
+
+/* admission control: limits on established tunnels, on clients per ip and
+   on clients still in the handshake (0: no limit). also raises the fd
+   limit and reserves a spare fd, which is given up when accept() runs out
+   of fds, so that the next client can be taken off the backlog and
+   rejected instead of the accept loop spinning. */
+int admit_init(unsigned tunnels, unsigned per_ip, unsigned handshakes);
+
+/* to be called when accept() failed with errno err. returns whether it's
+   worth retrying right away. */
+int admit_accept_failed(int err);
+
+/* decides on a newly accepted client. if it's rejected, it gets a socks
+   failure reply as admit_reject() sends, and -1 is returned. */
+int admit_client(struct client *client);
+/* moves an admitted client from the handshake to the tunnel count once
+   it made a request. returns -1 if there are too many tunnels. */
+int admit_tunnel(struct client *client);
+/* to be called once an admitted client is gone. */
+void admit_release(struct client *client);
+/* how many admitted clients aren't gone yet. */
+unsigned admit_clients(void);
+
+/* sends a socks failure reply without blocking and closes fd: a general
+   failure if the client already sent a request along with a greeting
+   that offers no auth, otherwise that no auth method is acceptable. */
+void admit_reject(int fd);
+
+#endif
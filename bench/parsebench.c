@@ -0,0 +1,184 @@
+/*
+   parsebench - microbenchmark of the socks5 message parsers.
+
+   parses a corpus of handshakes as clients send them: a greeting, for
+   some of them username/password auth, and a CONNECT request to an ipv4
+   or ipv6 address or a host name, mixed about 40/20/40. reports
+   messages/s and the time per message for each kind of request, and
+   for all of them together.
+
+   modes:
+   whole: each message is parsed once, as if it arrived in one piece.
+   split: each message is parsed once after its first half arrived,
+          which yields S5_NEED_MORE, and again once it's complete.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../socks5.h"
+
+#define CORPUS 4096 /* handshakes */
+
+enum kind {
+	K_IPV4,
+	K_IPV6,
+	K_NAME,
+	K_ALL,
+};
+static const char *kind_names[] = {
+	[K_IPV4] = "ipv4", [K_IPV6] = "ipv6", [K_NAME] = "name", [K_ALL] = "mixed",
+};
+
+struct handshake {
+	size_t off, len[3]; /* of greeting, auth (0 if none) and request */
+	enum kind kind;
+};
+
+static unsigned char *corpus;
+static struct handshake hs[CORPUS];
+static unsigned duration = 2;
+static int split;
+static volatile unsigned long long sink;
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t put_greeting(unsigned char *p, int auth) {
+	p[0] = 5;
+	p[1] = auth ? 2 : 1;
+	p[2] = 0;
+	p[3] = 2;
+	return 2 + p[1];
+}
+
+static size_t put_auth(unsigned char *p) {
+	unsigned ulen = 4 + rand() % 28, plen = 8 + rand() % 56, i;
+	p[0] = 1;
+	p[1] = ulen;
+	for(i=0;i<ulen;i++) p[2+i] = 'a' + rand() % 26;
+	p[2+ulen] = plen;
+	for(i=0;i<plen;i++) p[3+ulen+i] = 33 + rand() % 94;
+	return 3 + ulen + plen;
+}
+
+static size_t put_request(unsigned char *p, enum kind kind) {
+	static const char *tlds[] = {"com", "net", "org", "io", "example"};
+	size_t l, i;
+	p[0] = 5;
+	p[1] = 1;
+	p[2] = 0;
+	switch(kind) {
+		case K_IPV4:
+			p[3] = 1;
+			for(i=0;i<4;i++) p[4+i] = rand();
+			l = 4 + 4;
+			break;
+		case K_IPV6:
+			p[3] = 4;
+			for(i=0;i<16;i++) p[4+i] = rand();
+			l = 4 + 16;
+			break;
+		default:
+			p[3] = 3;
+			l = 3 + rand() % 40;
+			for(i=0;i<l;i++) p[5+i] = 'a' + rand() % 26;
+			l += sprintf((char*) p + 5 + l, ".%s", tlds[rand() % 5]);
+			p[4] = l;
+			l += 5;
+	}
+	p[l] = rand();
+	p[l+1] = rand();
+	return l + 2;
+}
+
+static void make_corpus(void) {
+	unsigned i;
+	size_t off = 0;
+	if(!(corpus = malloc(CORPUS * (4 + 300 + 300)))) {
+		perror("malloc");
+		exit(1);
+	}
+	srand(1);
+	for(i=0;i<CORPUS;i++) {
+		unsigned r = rand() % 10;
+		int auth = rand() % 2;
+		hs[i].kind = r < 4 ? K_IPV4 : r < 6 ? K_IPV6 : K_NAME;
+		hs[i].off = off;
+		off += hs[i].len[0] = put_greeting(corpus + off, auth);
+		off += hs[i].len[1] = auth ? put_auth(corpus + off) : 0;
+		off += hs[i].len[2] = put_request(corpus + off, hs[i].kind);
+	}
+}
+
+/* parses one handshake, returns the number of messages. */
+static unsigned parse(const struct handshake *h) {
+	const unsigned char *p = corpus + h->off;
+	struct s5greeting g;
+	struct s5auth a;
+	struct s5request r;
+	unsigned long long x = 0;
+	unsigned n = 2;
+	if(split && s5_greeting(p, h->len[0] / 2, &g) != S5_NEED_MORE) abort();
+	if(s5_greeting(p, h->len[0], &g) != S5_DONE) abort();
+	x += g.methods[g.n_methods - 1];
+	p += g.len;
+	if(h->len[1]) {
+		if(split && s5_auth(p, h->len[1] / 2, &a) != S5_NEED_MORE) abort();
+		if(s5_auth(p, h->len[1], &a) != S5_DONE) abort();
+		x += a.ulen + a.plen + a.pass[0];
+		p += a.len;
+		n++;
+	}
+	if(split && s5_request(p, h->len[2] / 2, &r) != S5_NEED_MORE) abort();
+	if(s5_request(p, h->len[2], &r) != S5_DONE) abort();
+	x += r.addr.port + r.addr.p[0];
+	sink += x;
+	return n;
+}
+
+static void bench(enum kind kind) {
+	static unsigned picked[CORPUS];
+	unsigned long long msgs = 0;
+	long long start, end, t;
+	unsigned i, n = 0;
+	for(i=0;i<CORPUS;i++)
+		if(kind == K_ALL || hs[i].kind == kind) picked[n++] = i;
+	start = now_ns();
+	end = start + duration * 1000000000LL;
+	do {
+		for(i=0;i<n;i++) msgs += parse(&hs[picked[i]]);
+	} while((t = now_ns()) < end);
+	printf("%-12s %10.2f M msgs/s  %6.1f ns/msg\n", kind_names[kind],
+	       msgs * 1e3 / (t - start), (double) (t - start) / msgs);
+}
+
+static int usage(void) {
+	fprintf(stderr, "usage: parsebench [-d seconds] [whole|split]\n");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int ch;
+	enum kind k;
+	while((ch = getopt(argc, argv, "d:")) != -1) {
+		switch(ch) {
+			case 'd': duration = atoi(optarg); break;
+			default: return usage();
+		}
+	}
+	if(optind < argc - 1) return usage();
+	if(optind == argc - 1) {
+		if(!strcmp(argv[optind], "split")) split = 1;
+		else if(strcmp(argv[optind], "whole")) return usage();
+	}
+	make_corpus();
+	for(k=0;k<=K_ALL;k++) bench(k);
+	return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# runs the loopback benchmark scenarios against ./microsocks.
+# environment:
+#   MS_ARGS   extra microsocks options to compare backends, e.g. "-e 4"
+#   THREADS   client threads (default 4)
+#   DURATION  seconds per measurement (default 5)
+#   IDLE      number of idle tunnels for the rss measurement (default 1000)
+#   PORT      proxy port (default 18080)
+
+MS=${MS:-./microsocks}
+BENCH=${BENCH:-bench/socksbench}
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-5}
+IDLE=${IDLE:-1000}
+PORT=${PORT:-18080}
+
+pid=
+cleanup() {
+	test -n "$pid" && kill $pid 2>/dev/null && wait $pid 2>/dev/null
+	pid=
+}
+trap cleanup EXIT INT TERM
+
+# start_proxy args...
+start_proxy() {
+	cleanup
+	$MS -q -i 127.0.0.1 -p $PORT $MS_ARGS "$@" &
+	pid=$!
+	sleep 0.3
+	kill -0 $pid 2>/dev/null || { echo "failed to start $MS $MS_ARGS $*" >&2; exit 1; }
+}
+
+# run label mode args...
+run() {
+	label=$1 mode=$2
+	shift 2
+	$BENCH -p $PORT -c $THREADS -d $DURATION -n $IDLE -x $pid -l "$label" "$@" $mode || exit 1
+}
+
+# each proxy keeps up to 2 fds per tunnel
+ulimit -n $(ulimit -Hn) 2>/dev/null
+
+echo "microsocks${MS_ARGS:+ $MS_ARGS}: $THREADS client threads, ${DURATION}s per run"
+
+start_proxy
+run noauth connect
+run bulk bulk
+run idle idle
+
+start_proxy -u bench -P bench
+run userpass connect -u bench -P bench
+
+start_proxy -u bench -P bench -w 127.0.0.1
+run whitelist connect -u bench -P bench
+
+# localhost is resolved from /etc/hosts, no network needed
+start_proxy
+run domain connect -H localhost
+
+start_proxy -d 64
+run domain-cache connect -H localhost
@@ -0,0 +1,418 @@
+/*
+   socksbench - loopback load generator for microsocks.
+
+   contains its own target server (echo, or an endless data source when
+   the first byte received is 'G'), and talks SOCKS5 to a running proxy.
+
+   modes:
+   connect: each thread opens tunnels back to back and verifies them with
+            a 1 byte echo. reports tunnels/s and handshake latency (from
+            connect() to the CONNECT reply) percentiles.
+   bulk:    each thread reads from the data source through one tunnel.
+            reports throughput, and throughput per cpu second the proxy
+            used if its pid is given with -x.
+   idle:    opens -n tunnels and keeps them open. reports the growth of
+            the proxy's RSS, scaled to 1000 tunnels (needs -x).
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BUFSIZE (64*1024)
+
+static unsigned short proxy_port = 1080, target_port;
+static const char *user, *pass, *host;
+static unsigned nthreads = 4, duration = 5, nidle = 1000;
+static int proxy_pid;
+static volatile int stop;
+
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void die(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+/* target server */
+
+struct tconn {
+	int fd, mode;
+	size_t len, off;
+	char buf[4096];
+};
+
+static int target_fd;
+static char source_buf[BUFSIZE];
+
+static void tconn_close(int ep, struct tconn *c) {
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, 0);
+	close(c->fd);
+	free(c);
+}
+
+static void tconn_event(int ep, struct tconn *c) {
+	ssize_t n;
+	if(c->mode == 'G') {
+		while((n = send(c->fd, source_buf, sizeof source_buf, MSG_NOSIGNAL)) > 0);
+		if(n < 0 && errno != EAGAIN) tconn_close(ep, c);
+		return;
+	}
+	while(1) {
+		if(c->len) {
+			n = send(c->fd, c->buf + c->off, c->len, MSG_NOSIGNAL);
+			if(n < 0) {
+				if(errno != EAGAIN) tconn_close(ep, c);
+				return;
+			}
+			c->off += n;
+			c->len -= n;
+			if(c->len) return;
+		}
+		n = recv(c->fd, c->buf, sizeof c->buf, 0);
+		if(n < 0 && errno == EAGAIN) return;
+		if(n <= 0) {
+			tconn_close(ep, c);
+			return;
+		}
+		if(!c->mode && c->buf[0] == 'G') {
+			struct epoll_event ev = {.events = EPOLLOUT|EPOLLET, .data.ptr = c};
+			c->mode = 'G';
+			epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+			tconn_event(ep, c);
+			return;
+		}
+		c->mode = 'E';
+		c->len = n;
+		c->off = 0;
+	}
+}
+
+static void *target_thread(void *arg) {
+	struct epoll_event ev = {.events = EPOLLIN|EPOLLEXCLUSIVE, .data.ptr = 0}, evs[64];
+	int i, n, ep = epoll_create1(0);
+	if(ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, target_fd, &ev)) die("epoll");
+	while(1) {
+		n = epoll_wait(ep, evs, 64, -1);
+		for(i=0;i<n;i++) {
+			struct tconn *c = evs[i].data.ptr;
+			if(c) {
+				tconn_event(ep, c);
+				continue;
+			}
+			int fd = accept4(target_fd, 0, 0, SOCK_NONBLOCK);
+			if(fd == -1) continue;
+			if(!(c = calloc(1, sizeof *c))) {
+				close(fd);
+				continue;
+			}
+			c->fd = fd;
+			ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
+			ev.data.ptr = c;
+			if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) tconn_close(ep, c);
+		}
+	}
+	return 0;
+}
+
+static void target_start(void) {
+	struct sockaddr_in sa = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t l = sizeof sa;
+	unsigned i;
+	pthread_t pt;
+	if((target_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0)) == -1 ||
+	   bind(target_fd, (void*) &sa, sizeof sa) ||
+	   listen(target_fd, SOMAXCONN) ||
+	   getsockname(target_fd, (void*) &sa, &l)) die("target");
+	target_port = ntohs(sa.sin_port);
+	for(i=0;i<nthreads;i++)
+		if(pthread_create(&pt, 0, target_thread, 0)) die("pthread_create");
+}
+
+/* socks client */
+
+static int read_all(int fd, unsigned char *buf, size_t n) {
+	size_t got = 0;
+	while(got < n) {
+		ssize_t m = recv(fd, buf + got, n - got, 0);
+		if(m <= 0) return -1;
+		got += m;
+	}
+	return 0;
+}
+
+/* returns a connected tunnel to the target server, or -1. */
+static int tunnel_open(void) {
+	struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(proxy_port),
+	                         .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	unsigned char buf[600], *p;
+	struct timeval tv = {.tv_sec = 10};
+	int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	if(connect(fd, (void*) &sa, sizeof sa)) goto fail;
+	/* with credentials, both methods are offered so whitelisted
+	   clients can skip auth. */
+	if(user) {
+		if(send(fd, "\5\2\0\2", 4, MSG_NOSIGNAL) != 4) goto fail;
+	} else if(send(fd, "\5\1\0", 3, MSG_NOSIGNAL) != 3) goto fail;
+	if(read_all(fd, buf, 2) || buf[0] != 5) goto fail;
+	if(buf[1] == 2 && user) {
+		size_t ul = strlen(user), pl = strlen(pass);
+		p = buf;
+		*p++ = 1;
+		*p++ = ul;
+		memcpy(p, user, ul), p += ul;
+		*p++ = pl;
+		memcpy(p, pass, pl), p += pl;
+		if(send(fd, buf, p - buf, MSG_NOSIGNAL) != p - buf) goto fail;
+		if(read_all(fd, buf, 2) || buf[1] != 0) goto fail;
+	} else if(buf[1] != 0) goto fail;
+	p = buf;
+	*p++ = 5;
+	*p++ = 1;
+	*p++ = 0;
+	if(host) {
+		size_t hl = strlen(host);
+		*p++ = 3;
+		*p++ = hl;
+		memcpy(p, host, hl), p += hl;
+	} else {
+		*p++ = 1;
+		memcpy(p, &sa.sin_addr, 4), p += 4;
+	}
+	*p++ = target_port >> 8;
+	*p++ = target_port & 0xff;
+	if(send(fd, buf, p - buf, MSG_NOSIGNAL) != p - buf) goto fail;
+	if(read_all(fd, buf, 10) || buf[1] != 0) goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+static int tunnel_check(int fd) {
+	unsigned char c = 'x';
+	if(send(fd, &c, 1, MSG_NOSIGNAL) != 1 || read_all(fd, &c, 1) || c != 'x')
+		return -1;
+	return 0;
+}
+
+struct worker {
+	pthread_t pt;
+	unsigned long long count, errors;
+	unsigned *lat;
+	size_t nlat, caplat;
+};
+
+static void *connect_worker(void *arg) {
+	struct worker *w = arg;
+	while(!stop) {
+		long long t = now_us();
+		int fd = tunnel_open();
+		unsigned us = now_us() - t;
+		if(fd == -1 || tunnel_check(fd)) {
+			w->errors++;
+			if(fd != -1) close(fd);
+			continue;
+		}
+		close(fd);
+		w->count++;
+		if(w->nlat == w->caplat) {
+			w->caplat = w->caplat ? w->caplat * 2 : 4096;
+			if(!(w->lat = realloc(w->lat, w->caplat * sizeof *w->lat))) die("realloc");
+		}
+		w->lat[w->nlat++] = us;
+	}
+	return 0;
+}
+
+static void *bulk_worker(void *arg) {
+	struct worker *w = arg;
+	static char buf[BUFSIZE]; /* contents are discarded */
+	int fd = tunnel_open();
+	ssize_t n;
+	if(fd == -1 || send(fd, "G", 1, MSG_NOSIGNAL) != 1) {
+		w->errors++;
+		return 0;
+	}
+	while(!stop && (n = recv(fd, buf, sizeof buf, 0)) > 0)
+		w->count += n;
+	close(fd);
+	return 0;
+}
+
+/* utime + stime of the proxy in seconds, or -1 */
+static double proc_cpu(void) {
+	char fn[64], buf[1024], *p;
+	unsigned long ut, st;
+	FILE *f;
+	snprintf(fn, sizeof fn, "/proc/%d/stat", proxy_pid);
+	if(!proxy_pid || !(f = fopen(fn, "r"))) return -1;
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	/* the command name may contain spaces, skip to its end */
+	if(!p || !(p = strrchr(buf, ')')) ||
+	   sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2)
+		return -1;
+	return (double)(ut + st) / sysconf(_SC_CLK_TCK);
+}
+
+/* resident set size of the proxy in KiB, or -1 */
+static long proc_rss(void) {
+	char fn[64], line[256];
+	long kb = -1;
+	FILE *f;
+	snprintf(fn, sizeof fn, "/proc/%d/status", proxy_pid);
+	if(!proxy_pid || !(f = fopen(fn, "r"))) return -1;
+	while(fgets(line, sizeof line, f))
+		if(sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+	fclose(f);
+	return kb;
+}
+
+static int cmp_unsigned(const void *a, const void *b) {
+	unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+	return x < y ? -1 : x > y;
+}
+
+static struct worker *run_workers(void *(*func)(void*), long long *elapsed) {
+	struct worker *w = calloc(nthreads, sizeof *w);
+	unsigned i;
+	if(!w) die("calloc");
+	long long t = now_us();
+	for(i=0;i<nthreads;i++)
+		if(pthread_create(&w[i].pt, 0, func, &w[i])) die("pthread_create");
+	sleep(duration);
+	stop = 1;
+	for(i=0;i<nthreads;i++) pthread_join(w[i].pt, 0);
+	*elapsed = now_us() - t;
+	return w;
+}
+
+static int bench_connect(const char *label) {
+	long long elapsed;
+	unsigned long long count = 0, errors = 0;
+	size_t nlat = 0, i;
+	struct worker *w = run_workers(connect_worker, &elapsed);
+	for(i=0;i<nthreads;i++) {
+		count += w[i].count;
+		errors += w[i].errors;
+		nlat += w[i].nlat;
+	}
+	unsigned *lat = malloc((nlat + 1) * sizeof *lat);
+	if(!lat) die("malloc");
+	for(nlat=0, i=0;i<nthreads;i++) {
+		memcpy(lat + nlat, w[i].lat, w[i].nlat * sizeof *lat);
+		nlat += w[i].nlat;
+	}
+	if(!nlat) {
+		fprintf(stderr, "%s: no tunnel could be established\n", label);
+		return 1;
+	}
+	qsort(lat, nlat, sizeof *lat, cmp_unsigned);
+	printf("%-12s %10.0f tunnels/s  p50 %6u us  p99 %6u us  p999 %6u us  errors %llu\n",
+	       label, count * 1e6 / elapsed,
+	       lat[nlat / 2], lat[nlat * 99 / 100], lat[nlat * 999 / 1000], errors);
+	return 0;
+}
+
+static int bench_bulk(const char *label) {
+	long long elapsed;
+	unsigned long long bytes = 0, errors = 0;
+	unsigned i;
+	double cpu = proc_cpu();
+	struct worker *w = run_workers(bulk_worker, &elapsed);
+	if(cpu >= 0) cpu = proc_cpu() - cpu;
+	for(i=0;i<nthreads;i++) {
+		bytes += w[i].count;
+		errors += w[i].errors;
+	}
+	if(errors == nthreads) {
+		fprintf(stderr, "%s: no tunnel could be established\n", label);
+		return 1;
+	}
+	printf("%-12s %10.1f MiB/s", label, bytes / 1048576. * 1e6 / elapsed);
+	if(cpu > 0) printf("  %10.1f MiB/s per proxy cpu", bytes / 1048576. / cpu);
+	printf("  errors %llu\n", errors);
+	return 0;
+}
+
+static int bench_idle(const char *label) {
+	int *fds = malloc(nidle * sizeof *fds);
+	unsigned i, open = 0;
+	if(!fds) die("malloc");
+	long before = proc_rss();
+	for(i=0;i<nidle;i++)
+		if((fds[open] = tunnel_open()) != -1 && !tunnel_check(fds[open])) open++;
+	usleep(200000);
+	long after = proc_rss();
+	for(i=0;i<open;i++) close(fds[i]);
+	if(!open) {
+		fprintf(stderr, "%s: no tunnel could be established\n", label);
+		return 1;
+	}
+	if(before < 0 || after < 0)
+		printf("%-12s %10u tunnels open, rss unknown (use -x pid)\n", label, open);
+	else
+		printf("%-12s %10ld KiB rss per 1k idle tunnels (%u open, %ld KiB total)\n",
+		       label, (after - before) * 1000 / open, open, after);
+	return 0;
+}
+
+static int usage(void) {
+	fprintf(stderr,
+		"usage: socksbench [-p proxyport] [-c threads] [-d seconds] [-n tunnels]\n"
+		"                  [-u user -P pass] [-H hostname] [-x proxypid] [-l label]\n"
+		"                  connect|bulk|idle\n");
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	const char *label = 0;
+	struct rlimit rl;
+	int ch;
+	while((ch = getopt(argc, argv, "c:d:H:l:n:p:P:u:x:")) != -1) {
+		switch(ch) {
+			case 'c': nthreads = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'H': host = optarg; break;
+			case 'l': label = optarg; break;
+			case 'n': nidle = atoi(optarg); break;
+			case 'p': proxy_port = atoi(optarg); break;
+			case 'P': pass = optarg; break;
+			case 'u': user = optarg; break;
+			case 'x': proxy_pid = atoi(optarg); break;
+			default: return usage();
+		}
+	}
+	if(optind != argc - 1 || !nthreads || (user && !pass)) return usage();
+	const char *mode = argv[optind];
+	if(!label) label = mode;
+	/* idle tunnels need two fds each on our side */
+	if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	target_start();
+	if(!strcmp(mode, "connect")) return bench_connect(label);
+	if(!strcmp(mode, "bulk")) return bench_bulk(label);
+	if(!strcmp(mode, "idle")) return bench_idle(label);
+	return usage();
+}
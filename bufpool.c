@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "bufpool.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* buffers are first given back to a small cache of the cpu the thread
+   runs on, so a relay thread usually gets the same, cache-hot buffer again
+   without touching shared state. the caches spill into a global free list,
+   which keeps a few buffers around and frees the rest, so the memory of
+   idle tunnels is released. */
+
+#define CACHE_BUFS 4 /* per cpu */
+#define GLOBAL_KEEP 32
+#define WAIT_MS 10
+
+struct cpucache {
+	int lock;
+	unsigned n;
+	void *buf[CACHE_BUFS];
+} __attribute__((aligned(64)));
+
+static struct cpucache *caches;
+static unsigned ncaches;
+static size_t bufsize, max_bufs;
+
+static pthread_mutex_t gl = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gcond = PTHREAD_COND_INITIALIZER;
+static void **free_list; /* linked through the first word of each buffer */
+static size_t nfree, allocated;
+static int waiting;
+
+static void cache_lock(struct cpucache *c) {
+	while(__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE))
+		while(__atomic_load_n(&c->lock, __ATOMIC_RELAXED));
+}
+
+static void cache_unlock(struct cpucache *c) {
+	__atomic_store_n(&c->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct cpucache *my_cache(void) {
+	int cpu = 0;
+#ifdef __linux__
+	if((cpu = sched_getcpu()) < 0) cpu = 0;
+#endif
+	return &caches[cpu % ncaches];
+}
+
+static void *cache_pop(struct cpucache *c) {
+	void *b = 0;
+	cache_lock(c);
+	if(c->n) b = c->buf[--c->n];
+	cache_unlock(c);
+	return b;
+}
+
+int bufpool_init(size_t size, size_t budget) {
+	long n = sysconf(_SC_NPROCESSORS_CONF);
+	ncaches = n > 0 ? n : 1;
+	if(!(caches = calloc(ncaches, sizeof *caches))) return -1;
+	bufsize = size < sizeof(void*) ? sizeof(void*) : size;
+	max_bufs = budget / bufsize;
+	if(budget && !max_bufs) max_bufs = 1;
+	return 0;
+}
+
+void *buf_get(int wait) {
+	void *b = cache_pop(my_cache());
+	unsigned i;
+	int waited = 0;
+	if(b) return b;
+	pthread_mutex_lock(&gl);
+	while(1) {
+		if(free_list) {
+			b = free_list;
+			free_list = *free_list;
+			nfree--;
+			break;
+		}
+		if(!max_bufs || allocated < max_bufs) {
+			allocated++;
+			pthread_mutex_unlock(&gl);
+			if(!(b = malloc(bufsize))) {
+				pthread_mutex_lock(&gl);
+				allocated--;
+				pthread_mutex_unlock(&gl);
+				return 0;
+			}
+			metric_inc(M_BUFFERS);
+			return b;
+		}
+		/* the budget is used up, but other cpus may have some cached */
+		for(i=0; i<ncaches && !b; i++) b = cache_pop(&caches[i]);
+		if(b || !wait) break;
+		if(!waited) metric_inc(M_BUFFER_WAITS);
+		waited = 1;
+		/* a buffer may also be put into a cache right after we looked,
+		   so the caches are checked again after a short while. */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WAIT_MS * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		__atomic_add_fetch(&waiting, 1, __ATOMIC_RELAXED);
+		pthread_cond_timedwait(&gcond, &gl, &ts);
+		__atomic_sub_fetch(&waiting, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&gl);
+	return b;
+}
+
+void buf_put(void *b) {
+	if(!b) return;
+	/* waiters only look at the global list */
+	if(!__atomic_load_n(&waiting, __ATOMIC_RELAXED)) {
+		struct cpucache *c = my_cache();
+		cache_lock(c);
+		if(c->n < CACHE_BUFS) {
+			c->buf[c->n++] = b;
+			b = 0;
+		}
+		cache_unlock(c);
+		if(!b) return;
+	}
+	pthread_mutex_lock(&gl);
+	if(waiting || nfree < GLOBAL_KEEP) {
+		*(void**)b = free_list;
+		free_list = b;
+		nfree++;
+		if(waiting) pthread_cond_signal(&gcond);
+		b = 0;
+	} else
+		allocated--;
+	pthread_mutex_unlock(&gl);
+	if(b) {
+		free(b);
+		metric_dec(M_BUFFERS);
+	}
+}
+
+int buf_available(void) {
+	unsigned i;
+	if(!max_bufs ||
+	   __atomic_load_n(&nfree, __ATOMIC_RELAXED) ||
+	   __atomic_load_n(&allocated, __ATOMIC_RELAXED) < max_bufs)
+		return 1;
+	for(i=0; i<ncaches; i++)
+		if(__atomic_load_n(&caches[i].n, __ATOMIC_RELAXED)) return 1;
+	return 0;
+}
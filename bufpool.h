@@ -0,0 +1,20 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "bufpool.c"
+
+/* relay buffers of bufsize bytes, which are taken only while data is in
+   flight. at most budget bytes are handed out at any time (0: no limit),
+   once that is reached callers have to wait for one to be given back. */
+int bufpool_init(size_t bufsize, size_t budget);
+/* returns a buffer, or NULL if the budget is exhausted and wait is 0,
+   or on OOM. with wait, blocks until a buffer is available. */
+void *buf_get(int wait);
+/* gives a buffer back, NULL is ignored. */
+void buf_put(void *buf);
+/* whether buf_get(0) is likely to succeed right now. */
+int buf_available(void);
+
+#endif
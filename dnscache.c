@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "dnscache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+/* the cache is split into shards with their own lock, so that lookups of
+   different names rarely contend. each shard is a chained hash table, with
+   the entries additionally linked in insertion order on one list for
+   successful and one for failed lookups. all entries of a list share the
+   same ttl, so each list is in order of expiry as well, and the one of
+   the two oldest entries that expires first is the one evicted once the
+   shard is full. */
+
+#define DNS_SHARDS 16
+#define DNS_BUCKETS 64 /* per shard */
+
+struct dnsentry {
+	struct dnsentry *hnext, *prev, *next;
+	unsigned hash;
+	time_t expires;
+	int err;
+	struct dnsresult res;
+	char name[256];
+};
+
+struct dnslist {
+	struct dnsentry *oldest, *newest;
+};
+
+struct dnsshard {
+	pthread_rwlock_t lock;
+	struct dnsentry *buckets[DNS_BUCKETS];
+	struct dnslist lists[2]; /* indexed by whether the lookup failed */
+	unsigned count;
+};
+
+static struct dnsshard *shards;
+static unsigned shard_max, pos_ttl, neg_ttl;
+
+int dnscache_init(unsigned max_entries, unsigned ttl, unsigned nttl) {
+	unsigned i;
+	if(!max_entries) return 0;
+	if(!(shards = calloc(DNS_SHARDS, sizeof *shards))) return -1;
+	for(i=0;i<DNS_SHARDS;i++)
+		pthread_rwlock_init(&shards[i].lock, 0);
+	shard_max = (max_entries + DNS_SHARDS - 1) / DNS_SHARDS;
+	pos_ttl = ttl;
+	neg_ttl = nttl;
+	return 0;
+}
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned hash_name(const char *s) {
+	unsigned h = 2166136261u;
+	for(; *s; s++) h = (h ^ (unsigned char) *s) * 16777619u;
+	return h;
+}
+
+static void set_port(struct dnsresult *res, unsigned short port) {
+	unsigned i;
+	for(i=0;i<res->n;i++) {
+		if(SOCKADDR_UNION_AF(&res->addr[i]) == AF_INET)
+			res->addr[i].v4.sin_port = htons(port);
+		else
+			res->addr[i].v6.sin6_port = htons(port);
+	}
+}
+
+static int parse_literal(const char *host, struct dnsresult *res) {
+	union sockaddr_union *a = &res->addr[0];
+	memset(a, 0, sizeof *a);
+	if(inet_pton(AF_INET, host, &a->v4.sin_addr) == 1)
+		a->v4.sin_family = AF_INET;
+	else if(inet_pton(AF_INET6, host, &a->v6.sin6_addr) == 1)
+		a->v6.sin6_family = AF_INET6;
+	else
+		return -1;
+	res->n = 1;
+	return 0;
+}
+
+static int do_resolve(const char *host, struct dnsresult *res) {
+	struct addrinfo *ainfo, *p;
+	int ret;
+	res->n = 0;
+	if((ret = resolve(host, 0, &ainfo))) return ret;
+	for(p = ainfo; p && res->n < DNS_MAXADDRS; p = p->ai_next) {
+		if(p->ai_addrlen > sizeof res->addr[0]) continue;
+		memcpy(&res->addr[res->n++], p->ai_addr, p->ai_addrlen);
+	}
+	freeaddrinfo(ainfo);
+	return res->n ? 0 : EAI_NONAME;
+}
+
+static struct dnsentry **find(struct dnsshard *sh, unsigned h, const char *name) {
+	struct dnsentry **e = &sh->buckets[(h / DNS_SHARDS) % DNS_BUCKETS];
+	for(; *e; e = &(*e)->hnext)
+		if((*e)->hash == h && !strcmp((*e)->name, name)) break;
+	return e;
+}
+
+static void unlink_entry(struct dnsshard *sh, struct dnsentry *e) {
+	struct dnsentry **pp = find(sh, e->hash, e->name);
+	struct dnslist *l = &sh->lists[!!e->err];
+	*pp = e->hnext;
+	if(e->prev) e->prev->next = e->next;
+	else l->oldest = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else l->newest = e->prev;
+	sh->count--;
+}
+
+static struct dnsentry *first_to_expire(struct dnsshard *sh) {
+	struct dnsentry *a = sh->lists[0].oldest, *b = sh->lists[1].oldest;
+	if(!a || (b && b->expires < a->expires)) return b;
+	return a;
+}
+
+static void insert(struct dnsshard *sh, unsigned h, const char *name, int err, struct dnsresult *res) {
+	struct dnsentry *e, *old, **pp;
+	struct dnslist *l = &sh->lists[!!err];
+	time_t t = now();
+	if(!(e = malloc(sizeof *e))) return;
+	e->hash = h;
+	e->err = err;
+	e->res = *res;
+	e->expires = t + (err ? neg_ttl : pos_ttl);
+	strcpy(e->name, name);
+	pthread_rwlock_wrlock(&sh->lock);
+	/* a concurrent lookup of the same name may have been faster */
+	if((old = *(pp = find(sh, h, name)))) {
+		unlink_entry(sh, old);
+		free(old);
+	}
+	while((old = first_to_expire(sh)) && (sh->count >= shard_max || old->expires <= t)) {
+		unlink_entry(sh, old);
+		free(old);
+	}
+	pp = find(sh, h, name);
+	e->hnext = 0;
+	*pp = e;
+	e->next = 0;
+	e->prev = l->newest;
+	if(l->newest) l->newest->next = e;
+	else l->oldest = e;
+	l->newest = e;
+	sh->count++;
+	pthread_rwlock_unlock(&sh->lock);
+}
+
+/* looks host up in the cache, sets name to its lowercase form and
+   returns its shard, or 0 if it isn't cached at all. *hit is set if
+   there's a current entry, then *err and res are filled from it. */
+static struct dnsshard *cache_find(const char *host, char name[256], unsigned *hash, struct dnsresult *res, int *err, int *hit) {
+	size_t i, l = strlen(host);
+	*hit = 0;
+	if(!shards || l >= 256) return 0;
+	/* dns names are case insensitive */
+	for(i=0;i<=l;i++) name[i] = host[i] >= 'A' && host[i] <= 'Z' ? host[i] | 32 : host[i];
+	unsigned h = *hash = hash_name(name);
+	struct dnsshard *sh = &shards[h % DNS_SHARDS];
+	struct dnsentry *e;
+	pthread_rwlock_rdlock(&sh->lock);
+	if((e = *find(sh, h, name)) && e->expires > now()) {
+		*err = e->err;
+		*res = e->res;
+		*hit = 1;
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return sh;
+}
+
+int dns_cached(const char *host, unsigned short port, struct dnsresult *res, int *err) {
+	char name[256];
+	unsigned h;
+	int hit;
+	if(parse_literal(host, res)) {
+		cache_find(host, name, &h, res, err, &hit);
+		if(!hit) return 0;
+	} else *err = 0;
+	if(!*err) set_port(res, port);
+	return 1;
+}
+
+int dns_lookup(const char *host, unsigned short port, struct dnsresult *res) {
+	char name[256];
+	unsigned h;
+	int ret, hit;
+	if(!parse_literal(host, res)) goto done;
+	struct dnsshard *sh = cache_find(host, name, &h, res, &ret, &hit);
+	if(!sh) {
+		if((ret = do_resolve(host, res))) return ret;
+		goto done;
+	}
+	if(hit) {
+		if(ret) return ret;
+		goto done;
+	}
+	ret = do_resolve(name, res);
+	switch(ret) {
+		case EAI_AGAIN:
+		case EAI_MEMORY:
+		case EAI_SYSTEM:
+			/* temporary failures are not worth remembering */
+			return ret;
+	}
+	insert(sh, h, name, ret, res);
+	if(ret) return ret;
+done:
+	set_port(res, port);
+	return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "dnscache.c"
+
+#define DNS_MAXADDRS 8
+
+struct dnsresult {
+	unsigned n;
+	union sockaddr_union addr[DNS_MAXADDRS];
+};
+
+/* enables the cache with room for max_entries names. ttl and neg_ttl
+   are in seconds and apply to successful and failed lookups. */
+int dnscache_init(unsigned max_entries, unsigned ttl, unsigned neg_ttl);
+
+/* resolves host and fills res with up to DNS_MAXADDRS addresses using port.
+   literal ip addresses are parsed directly without calling the resolver.
+   returns 0 on success or a getaddrinfo() error code. */
+int dns_lookup(const char *host, unsigned short port, struct dnsresult *res);
+
+/* like dns_lookup(), but only answers literal addresses and names in the
+   cache, without calling the resolver. returns 1 and sets *err to what
+   dns_lookup() would return if it could, 0 otherwise. */
+int dns_cached(const char *host, unsigned short port, struct dnsresult *res, int *err);
+
+#endif
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static int unix_addr(const char *path, struct sockaddr_un *sa) {
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof sa->sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa->sun_path, path);
+	return 0;
+}
+
+int handoff_receive(const char *path, int *fds, unsigned max, int *conn) {
+	struct sockaddr_un sa;
+	unsigned n;
+	char cbuf[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))];
+	struct iovec iov = {.iov_base = &n, .iov_len = sizeof n};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof cbuf,
+	};
+	struct cmsghdr *cm;
+	int fd;
+	if(unix_addr(path, &sa)) return -1;
+	if((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) return -1;
+	if(connect(fd, (void*) &sa, sizeof sa)) {
+		int e = errno;
+		close(fd);
+		/* a socket left over from a process that's gone is refused */
+		if(e == ENOENT || e == ECONNREFUSED) return 0;
+		errno = e;
+		return -1;
+	}
+	if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof n || (msg.msg_flags & MSG_CTRUNC))
+		goto fail;
+	for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) break;
+	if(!cm || !n || n > max || cm->cmsg_len != CMSG_LEN(n * sizeof(int)))
+		goto fail;
+	memcpy(fds, CMSG_DATA(cm), n * sizeof(int));
+	*conn = fd;
+	return n;
+fail:
+	close(fd);
+	errno = EPROTO;
+	return -1;
+}
+
+void handoff_ready(int conn) {
+	char c = 1;
+	send(conn, &c, 1, MSG_NOSIGNAL);
+	close(conn);
+}
+
+int handoff_listen(const char *path) {
+	struct sockaddr_un sa;
+	int fd;
+	if(unix_addr(path, &sa)) return -1;
+	unlink(path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) return -1;
+	/* nobody can connect before listen(), so there's no window in which
+	   others could take over the listening sockets. */
+	if(bind(fd, (void*) &sa, sizeof sa) || chmod(path, 0600) || listen(fd, 1)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int handoff_accept(int lfd) {
+	int fd = accept4(lfd, 0, 0, SOCK_CLOEXEC);
+	if(fd == -1) return -1;
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t l = sizeof cred;
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &l) || cred.uid != geteuid()) {
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+#endif
+	return fd;
+}
+
+int handoff_send(int conn, const int *fds, unsigned n, int timeout_ms) {
+	char cbuf[CMSG_SPACE(HANDOFF_MAXFDS * sizeof(int))] = {0};
+	struct iovec iov = {.iov_base = &n, .iov_len = sizeof n};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = CMSG_SPACE(n * sizeof(int)),
+	};
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	struct pollfd pfd = {.fd = conn, .events = POLLIN};
+	char c;
+	if(!n || n > HANDOFF_MAXFDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+	if(sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof n) return -1;
+	if(poll(&pfd, 1, timeout_ms) != 1 || recv(conn, &c, 1, 0) != 1) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return 0;
+}
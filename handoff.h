@@ -0,0 +1,31 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#pragma RcB2 DEP "handoff.c"
+
+/* passing the listening sockets to a new process, so that it can be
+   restarted without ever closing them. the running process listens on a
+   unix socket; a new one started with the same path connects to it,
+   receives the listening sockets and confirms once it's set up, after
+   which the old one stops accepting. */
+
+#define HANDOFF_MAXFDS 64
+
+/* connects to the process listening on path and receives up to max fds.
+   returns their number, 0 if there's no process to take over from, or
+   -1 with errno set. *conn is the connection for handoff_ready(). */
+int handoff_receive(const char *path, int *fds, unsigned max, int *conn);
+/* tells the previous process that the new one took over, closes conn. */
+void handoff_ready(int conn);
+
+/* creates the unix socket at path, only accessible to the owner,
+   replacing any previous one. returns it, or -1. */
+int handoff_listen(const char *path);
+/* waits for a new process of the same user on lfd. returns the
+   connection to it, or -1. */
+int handoff_accept(int lfd);
+/* sends the n fds over conn, and waits up to timeout_ms for the new
+   process to confirm. returns -1 if it didn't. */
+int handoff_send(int conn, const int *fds, unsigned n, int timeout_ms);
+
+#endif
@@ -0,0 +1,283 @@
+#include "iplist.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* addresses are kept as 16 bytes, ipv4 ones mapped into ::ffff:0:0/96,
+   so both families share the same code. */
+struct ipkey {
+	unsigned char b[16];
+};
+
+static int make_key(union sockaddr_union *addr, struct ipkey *k) {
+	static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+	switch(SOCKADDR_UNION_AF(addr)) {
+		case AF_INET:
+			memcpy(k->b, v4mapped, 12);
+			memcpy(k->b+12, &addr->v4.sin_addr, 4);
+			return 0;
+		case AF_INET6:
+			memcpy(k->b, &addr->v6.sin6_addr, 16);
+			return 0;
+	}
+	return -1;
+}
+
+static unsigned hash_key(struct ipkey *k) {
+	unsigned h = 2166136261u, i;
+	for(i=0;i<16;i++) h = (h ^ k->b[i]) * 16777619u;
+	return h;
+}
+
+/* whitelist: exact addresses go into an open addressing hash set, cidr
+   ranges into a binary trie for a longest prefix match. */
+
+static struct ipkey *wl_set;
+static unsigned wl_count, wl_capa; /* capa is 0 or a power of 2 */
+
+struct trienode {
+	unsigned child[2]; /* index into wl_trie, 0 if none */
+	int terminal;
+};
+static struct trienode *wl_trie;
+static unsigned wl_trie_count, wl_trie_capa;
+
+static int wl_set_insert(struct ipkey *set, unsigned capa, struct ipkey *k) {
+	static const struct ipkey empty;
+	unsigned i = hash_key(k) & (capa - 1);
+	while(memcmp(&set[i], &empty, sizeof empty)) {
+		if(!memcmp(&set[i], k, sizeof *k)) return 0;
+		i = (i + 1) & (capa - 1);
+	}
+	set[i] = *k;
+	return 1;
+}
+
+static int wl_add_exact(struct ipkey *k) {
+	static const struct ipkey empty;
+	if(!memcmp(k, &empty, sizeof empty)) {
+		/* the all-zero address marks free slots, so it goes to the trie */
+		return -1;
+	}
+	if((wl_count + 1) * 2 > wl_capa) {
+		unsigned i, capa = wl_capa ? wl_capa * 2 : 16;
+		struct ipkey *set = calloc(capa, sizeof *set);
+		if(!set) return -1;
+		for(i=0;i<wl_capa;i++)
+			if(memcmp(&wl_set[i], &empty, sizeof empty))
+				wl_set_insert(set, capa, &wl_set[i]);
+		free(wl_set);
+		wl_set = set;
+		wl_capa = capa;
+	}
+	wl_count += wl_set_insert(wl_set, wl_capa, k);
+	return 0;
+}
+
+/* returns index of a new node, or 0 on OOM */
+static unsigned trie_node(void) {
+	if(wl_trie_count == wl_trie_capa) {
+		unsigned capa = wl_trie_capa ? wl_trie_capa * 2 : 64;
+		struct trienode *t = realloc(wl_trie, capa * sizeof *t);
+		if(!t) return 0;
+		wl_trie = t;
+		wl_trie_capa = capa;
+	}
+	memset(&wl_trie[wl_trie_count], 0, sizeof *wl_trie);
+	return wl_trie_count++;
+}
+
+#define KEYBIT(K, I) (((K)->b[(I)/8] >> (7 - (I)%8)) & 1)
+
+static int wl_add_prefix(struct ipkey *k, unsigned bits) {
+	unsigned i, n;
+	if(!wl_trie_count) {
+		trie_node(); /* root, index 0 */
+		if(!wl_trie_count) return -1;
+	}
+	for(i=0, n=0; i<bits; i++) {
+		unsigned b = KEYBIT(k, i);
+		if(!wl_trie[n].child[b]) {
+			unsigned c = trie_node();
+			if(!c) return -1;
+			wl_trie[n].child[b] = c;
+		}
+		n = wl_trie[n].child[b];
+	}
+	wl_trie[n].terminal = 1;
+	return 0;
+}
+
+int whitelist_add(union sockaddr_union *addr, int prefix) {
+	struct ipkey k;
+	int af = SOCKADDR_UNION_AF(addr), max = af == AF_INET ? 32 : 128;
+	if(make_key(addr, &k)) return -1;
+	if(prefix > max) return -1;
+	if(prefix < 0) prefix = max;
+	if(prefix == max && !wl_add_exact(&k)) return 0;
+	return wl_add_prefix(&k, prefix + (af == AF_INET ? 96 : 0));
+}
+
+int whitelist_match(union sockaddr_union *addr) {
+	static const struct ipkey empty;
+	struct ipkey k;
+	unsigned i, n;
+	if(make_key(addr, &k)) return 0;
+	if(wl_capa) {
+		i = hash_key(&k) & (wl_capa - 1);
+		while(memcmp(&wl_set[i], &empty, sizeof empty)) {
+			if(!memcmp(&wl_set[i], &k, sizeof k)) return 1;
+			i = (i + 1) & (wl_capa - 1);
+		}
+	}
+	if(!wl_trie_count) return 0;
+	for(i=0, n=0; ; i++) {
+		if(wl_trie[n].terminal) return 1;
+		if(i == 128 || !(n = wl_trie[n].child[KEYBIT(&k, i)])) return 0;
+	}
+}
+
+/* auth_once set: a fixed size open addressing table with linear probing.
+   writers are serialized by a mutex and bump a sequence counter before
+   and after each change. readers don't take the mutex: they copy what
+   they need and retry if the counter was odd or changed meanwhile. as the
+   table never gets reallocated, a racing reader only ever sees stale data,
+   which the sequence check catches. after AO_READ_TRIES failed tries a
+   reader waits for the mutex instead of spinning on.
+   the entries are also linked by slot index in the order they last
+   authed, so the one to evict is always at the head, and so are expired
+   ones, as they all share the same ttl. */
+
+#define AO_NONE ((unsigned) -1)
+/* expired entries removed at most per add, they don't match anyway */
+#define AO_SWEEP 4
+#define AO_READ_TRIES 64
+
+struct aoentry {
+	struct ipkey k;
+	time_t last; /* 0: free slot */
+	unsigned prev, next; /* towards the oldest and the newest */
+};
+
+static struct aoentry *ao_tab;
+static unsigned ao_capa, ao_count, ao_max, ao_ttl;
+static unsigned ao_oldest = AO_NONE, ao_newest = AO_NONE;
+static unsigned ao_seq;
+static pthread_mutex_t ao_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1; /* never 0 */
+}
+
+int authonce_init(unsigned max, unsigned ttl) {
+	unsigned capa = 16;
+	if(!max) max = 1;
+	while(capa < max * 2) capa *= 2;
+	if(!(ao_tab = calloc(capa, sizeof *ao_tab))) return -1;
+	ao_capa = capa;
+	ao_max = max;
+	ao_ttl = ttl;
+	return 0;
+}
+
+static int ao_expired(struct aoentry *e, time_t t) {
+	return ao_ttl && e->last + ao_ttl <= t;
+}
+
+/* returns slot of k or of the free slot where it would go */
+static unsigned ao_find(struct ipkey *k) {
+	unsigned i = hash_key(k) & (ao_capa - 1);
+	while(ao_tab[i].last && memcmp(&ao_tab[i].k, k, sizeof *k))
+		i = (i + 1) & (ao_capa - 1);
+	return i;
+}
+
+int authonce_match(union sockaddr_union *addr) {
+	struct ipkey k;
+	struct aoentry e;
+	unsigned s1, s2, i;
+	if(!ao_tab || make_key(addr, &k)) return 0;
+	time_t t = now();
+	for(i=0; i<AO_READ_TRIES; i++) {
+		if((s1 = __atomic_load_n(&ao_seq, __ATOMIC_ACQUIRE)) & 1) continue;
+		e = ao_tab[ao_find(&k)];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&ao_seq, __ATOMIC_RELAXED);
+		if(s1 == s2) return e.last && !ao_expired(&e, t);
+	}
+	pthread_mutex_lock(&ao_lock);
+	e = ao_tab[ao_find(&k)];
+	pthread_mutex_unlock(&ao_lock);
+	return e.last && !ao_expired(&e, t);
+}
+
+static void ao_unlink(unsigned i) {
+	struct aoentry *e = &ao_tab[i];
+	if(e->prev != AO_NONE) ao_tab[e->prev].next = e->next;
+	else ao_oldest = e->next;
+	if(e->next != AO_NONE) ao_tab[e->next].prev = e->prev;
+	else ao_newest = e->prev;
+}
+
+static void ao_append(unsigned i) {
+	struct aoentry *e = &ao_tab[i];
+	e->prev = ao_newest;
+	e->next = AO_NONE;
+	if(ao_newest != AO_NONE) ao_tab[ao_newest].next = i;
+	else ao_oldest = i;
+	ao_newest = i;
+}
+
+/* backward shift deletion, keeps probe chains intact without tombstones */
+static void ao_delete(unsigned i) {
+	unsigned j = i;
+	ao_unlink(i);
+	while(1) {
+		j = (j + 1) & (ao_capa - 1);
+		if(!ao_tab[j].last) break;
+		unsigned h = hash_key(&ao_tab[j].k) & (ao_capa - 1);
+		/* move j into the hole at i unless its home lies in (i, j] */
+		if((j > i && (h <= i || h > j)) || (j < i && (h <= i && h > j))) {
+			struct aoentry *e = &ao_tab[i];
+			*e = ao_tab[j];
+			/* the neighbours in the list follow it */
+			if(e->prev != AO_NONE) ao_tab[e->prev].next = i;
+			else ao_oldest = i;
+			if(e->next != AO_NONE) ao_tab[e->next].prev = i;
+			else ao_newest = i;
+			i = j;
+		}
+	}
+	ao_tab[i].last = 0;
+	ao_count--;
+}
+
+void authonce_add(union sockaddr_union *addr) {
+	struct ipkey k;
+	unsigned i, n;
+	if(!ao_tab || make_key(addr, &k)) return;
+	time_t t = now();
+	pthread_mutex_lock(&ao_lock);
+	__atomic_store_n(&ao_seq, ao_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for(n=0; n<AO_SWEEP && ao_oldest != AO_NONE && ao_expired(&ao_tab[ao_oldest], t); n++)
+		ao_delete(ao_oldest);
+	i = ao_find(&k);
+	if(ao_tab[i].last) ao_unlink(i);
+	else {
+		/* evict the least recently authed */
+		if(ao_count >= ao_max) {
+			ao_delete(ao_oldest);
+			i = ao_find(&k);
+		}
+		ao_tab[i].k = k;
+		ao_count++;
+	}
+	ao_tab[i].last = t;
+	ao_append(i);
+	__atomic_store_n(&ao_seq, ao_seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ao_lock);
+}
@@ -0,0 +1,22 @@
+#ifndef IPLIST_H
+#define IPLIST_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "iplist.c"
+
+/* static whitelist given with -w. it's filled during startup and never
+   changes afterwards, so lookups don't need any locking.
+   prefix is the cidr prefix length, or -1 for a single address. */
+int whitelist_add(union sockaddr_union *addr, int prefix);
+int whitelist_match(union sockaddr_union *addr);
+
+/* set of addresses that authed successfully in auth_once mode. it holds
+   at most max entries, evicting the one that authed least recently, and
+   entries expire ttl seconds after their last auth (0: never). adding an
+   address takes O(1), eviction included. */
+int authonce_init(unsigned max, unsigned ttl);
+int authonce_match(union sockaddr_union *addr);
+void authonce_add(union sockaddr_union *addr);
+
+#endif
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "server.h"
+#include "srcpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/un.h>
+
+#define SHARDS 32
+#define NBUCKETS 10
+
+static const long long bucket_usec[NBUCKETS] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000,
+};
+static const char *bucket_le[NBUCKETS] = {
+	"0.0001", "0.0005", "0.001", "0.005", "0.01", "0.05", "0.1", "0.5", "1", "5",
+};
+
+struct hist {
+	long long bucket[NBUCKETS + 1]; /* last one is +Inf */
+	long long sum_usec;
+};
+
+/* one cache line aligned block per shard, so threads on different
+   shards don't bounce cache lines between cpus. */
+struct shard {
+	long long v[M_COUNT];
+	struct hist h[H_COUNT];
+} __attribute__((aligned(64)));
+
+static struct shard shards[SHARDS];
+static unsigned next_shard;
+static __thread struct shard *my_shard;
+
+static struct shard *get_shard(void) {
+	if(!my_shard)
+		my_shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % SHARDS];
+	return my_shard;
+}
+
+#define ADD(X, V) __atomic_fetch_add(&(X), (V), __ATOMIC_RELAXED)
+#define GET(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+
+void metric_add(enum metric m, long long v) {
+	ADD(get_shard()->v[m], v);
+}
+
+void metric_observe(enum histogram h, long long usec) {
+	struct hist *hp = &get_shard()->h[h];
+	unsigned i;
+	for(i=0; i<NBUCKETS && usec > bucket_usec[i]; i++);
+	ADD(hp->bucket[i], 1);
+	ADD(hp->sum_usec, usec);
+}
+
+static long long total(enum metric m) {
+	long long r = 0;
+	unsigned i;
+	for(i=0;i<SHARDS;i++) r += GET(shards[i].v[m]);
+	return r;
+}
+
+const char *ec_names[9] = {
+	"success", "general_failure", "not_allowed", "net_unreachable",
+	"host_unreachable", "conn_refused", "ttl_expired",
+	"command_not_supported", "addresstype_not_supported",
+};
+
+static void dump_hist(int fd, const char *name, const char *help, enum histogram h) {
+	long long cum = 0, sum = 0;
+	unsigned i, s;
+	dprintf(fd, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for(i=0;i<=NBUCKETS;i++) {
+		for(s=0;s<SHARDS;s++) cum += GET(shards[s].h[h].bucket[i]);
+		dprintf(fd, "%s_bucket{le=\"%s\"} %lld\n", name, i < NBUCKETS ? bucket_le[i] : "+Inf", cum);
+	}
+	for(s=0;s<SHARDS;s++) sum += GET(shards[s].h[h].sum_usec);
+	dprintf(fd, "%s_sum %lld.%06lld\n%s_count %lld\n", name, sum / 1000000, sum % 1000000, name, cum);
+}
+
+#define COUNTER(NAME, HELP, M) \
+	dprintf(fd, "# HELP " NAME " " HELP "\n# TYPE " NAME " counter\n" NAME " %lld\n", total(M))
+#define GAUGE(NAME, HELP, M) \
+	dprintf(fd, "# HELP " NAME " " HELP "\n# TYPE " NAME " gauge\n" NAME " %lld\n", total(M))
+
+void metrics_dump(int fd) {
+	unsigned i;
+	COUNTER("microsocks_connections_accepted_total", "Accepted client connections.", M_ACCEPTED);
+	COUNTER("microsocks_connections_rejected_total", "Failed or rejected accepts.", M_REJECTED);
+	dprintf(fd, "# HELP microsocks_handshake_failures_total Failed handshakes by socks error.\n"
+		"# TYPE microsocks_handshake_failures_total counter\n");
+	for(i=1;i<9;i++)
+		dprintf(fd, "microsocks_handshake_failures_total{code=\"%s\"} %lld\n", ec_names[i], total(M_HS_FAILURE + i));
+	dprintf(fd, "microsocks_handshake_failures_total{code=\"malformed_auth\"} %lld\n", total(M_HS_MALFORMED_AUTH));
+	dprintf(fd, "# HELP microsocks_auth_method_total Authentication methods chosen.\n"
+		"# TYPE microsocks_auth_method_total counter\n"
+		"microsocks_auth_method_total{method=\"none\"} %lld\n"
+		"microsocks_auth_method_total{method=\"username\"} %lld\n"
+		"microsocks_auth_method_total{method=\"invalid\"} %lld\n",
+		total(M_AUTH_NONE), total(M_AUTH_USERNAME), total(M_AUTH_INVALID));
+	dprintf(fd, "# HELP microsocks_relayed_bytes_total Bytes relayed.\n"
+		"# TYPE microsocks_relayed_bytes_total counter\n"
+		"microsocks_relayed_bytes_total{direction=\"upstream\"} %lld\n"
+		"microsocks_relayed_bytes_total{direction=\"downstream\"} %lld\n",
+		total(M_BYTES_UP), total(M_BYTES_DOWN));
+	COUNTER("microsocks_tunnels_total", "Established tunnels.", M_TUNNELS);
+	GAUGE("microsocks_tunnels_active", "Currently open tunnels.", M_TUNNELS_ACTIVE);
+	GAUGE("microsocks_threads", "Threads alive.", M_THREADS);
+	COUNTER("microsocks_tfo_accepted_total", "Client connections with accepted TCP fast open data.", M_TFO_ACCEPTED);
+	COUNTER("microsocks_tfo_used_total", "Target connections that sent data in the SYN.", M_TFO_USED);
+	GAUGE("microsocks_relay_buffers", "Relay buffers allocated.", M_BUFFERS);
+	COUNTER("microsocks_relay_buffer_waits_total", "Times relaying waited for the buffer budget.", M_BUFFER_WAITS);
+	COUNTER("microsocks_udp_associations_total", "UDP associations.", M_UDP_ASSOCIATIONS);
+	dprintf(fd, "# HELP microsocks_udp_datagrams_total Datagrams relayed.\n"
+		"# TYPE microsocks_udp_datagrams_total counter\n"
+		"microsocks_udp_datagrams_total{direction=\"upstream\"} %lld\n"
+		"microsocks_udp_datagrams_total{direction=\"downstream\"} %lld\n",
+		total(M_UDP_DATAGRAMS_UP), total(M_UDP_DATAGRAMS_DOWN));
+	COUNTER("microsocks_udp_dropped_total", "Datagrams dropped.", M_UDP_DROPPED);
+	COUNTER("microsocks_log_dropped_total", "Access log records dropped because the writer fell behind.", M_LOG_DROPPED);
+	COUNTER("microsocks_upstream_pool_hits_total", "Connections to the parent proxy taken from the spare pool.", M_UPSTREAM_HITS);
+	COUNTER("microsocks_upstream_pool_misses_total", "Connections to the parent proxy made on demand.", M_UPSTREAM_MISSES);
+	COUNTER("microsocks_upstream_spares_expired_total", "Spare connections to the parent proxy closed unused.", M_UPSTREAM_EXPIRED);
+	GAUGE("microsocks_upstream_spares", "Spare connections to the parent proxy.", M_UPSTREAM_SPARES);
+	COUNTER("microsocks_sockmap_tunnels_total", "Tunnels relayed by the kernel through the sockmap.", M_OFFLOADED);
+	COUNTER("microsocks_sockmap_failures_total", "Tunnels relayed in userspace as moving them into the sockmap failed.", M_OFFLOAD_FAILED);
+	dprintf(fd, "# HELP microsocks_timeouts_total Connections closed by a timeout.\n"
+		"# TYPE microsocks_timeouts_total counter\n"
+		"microsocks_timeouts_total{phase=\"handshake\"} %lld\n"
+		"microsocks_timeouts_total{phase=\"connect\"} %lld\n"
+		"microsocks_timeouts_total{phase=\"idle\"} %lld\n",
+		total(M_TIMEOUTS), total(M_TIMEOUTS + 1), total(M_TIMEOUTS + 2));
+	dump_hist(fd, "microsocks_dns_latency_seconds", "Duration of dns lookups.", H_DNS);
+	dump_hist(fd, "microsocks_connect_latency_seconds", "Duration of connecting to targets.", H_CONNECT);
+	srcpool_dump(fd);
+}
+
+int metrics_listen(const char *spec) {
+	int fd;
+	if(strchr(spec, '/')) {
+		struct sockaddr_un sa = {.sun_family = AF_UNIX};
+		if(strlen(spec) >= sizeof sa.sun_path) return -1;
+		strcpy(sa.sun_path, spec);
+		unlink(spec);
+		if((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1) return -1;
+		if(bind(fd, (void*) &sa, sizeof sa) || listen(fd, 8)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	struct server s;
+	char host[256] = "127.0.0.1";
+	const char *port = strrchr(spec, ':');
+	if(port) {
+		size_t l = port - spec;
+		if(l >= sizeof host) return -1;
+		memcpy(host, spec, l);
+		host[l] = 0;
+		port++;
+	} else
+		port = spec;
+	if(server_setup(&s, host, atoi(port), 0, 0)) return -1;
+	return s.fd;
+}
+
+void metrics_serve(int lfd) {
+	while(1) {
+		char buf[512];
+		int fd = accept(lfd, 0, 0);
+		if(fd == -1) {
+			/* shut down when handing over to a new process */
+			if(errno == EINVAL) return;
+			usleep(1000);
+			continue;
+		}
+		/* clients on the unix socket usually don't send anything, http
+		   clients get a response header. */
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		ssize_t n = 0;
+		if(poll(&pfd, 1, 100) == 1) n = recv(fd, buf, sizeof buf, 0);
+		if(n >= 4 && !memcmp(buf, "GET ", 4))
+			dprintf(fd, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Connection: close\r\n\r\n");
+		metrics_dump(fd);
+		close(fd);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#pragma RcB2 DEP "metrics.c"
+
+enum metric {
+	M_ACCEPTED,
+	M_REJECTED,
+	/* handshake failures, indexed by socks error code */
+	M_HS_FAILURE,
+	M_AUTH_NONE = M_HS_FAILURE + 9,
+	M_AUTH_USERNAME,
+	M_AUTH_INVALID,
+	M_HS_MALFORMED_AUTH, /* handshake failures on unparseable user/pass messages */
+	M_BYTES_UP, /* client to target */
+	M_BYTES_DOWN, /* target to client */
+	M_TUNNELS,
+	M_TUNNELS_ACTIVE,
+	M_THREADS,
+	M_TFO_ACCEPTED,
+	M_TFO_USED,
+	M_BUFFERS, /* relay buffers allocated */
+	M_BUFFER_WAITS, /* times the buffer budget was exhausted */
+	M_UDP_ASSOCIATIONS,
+	M_UDP_DATAGRAMS_UP,
+	M_UDP_DATAGRAMS_DOWN,
+	M_UDP_DROPPED,
+	M_LOG_DROPPED, /* access log records lost */
+	M_UPSTREAM_HITS, /* parent connections taken from the spare pool */
+	M_UPSTREAM_MISSES, /* or made on demand */
+	M_UPSTREAM_EXPIRED,
+	M_UPSTREAM_SPARES,
+	M_OFFLOADED, /* tunnels relayed by the kernel with -S sockmap */
+	M_OFFLOAD_FAILED, /* or relayed in userspace as that failed */
+	/* expired timeouts, indexed by enum ctkind */
+	M_TIMEOUTS,
+	M_COUNT = M_TIMEOUTS + 3,
+};
+
+enum histogram {
+	H_DNS,
+	H_CONNECT,
+	H_COUNT,
+};
+
+/* names of the socks error codes, as used in labels and logs */
+extern const char *ec_names[9];
+
+/* updates only touch a shard picked per thread, with relaxed atomics,
+   so the hot path never takes a lock. */
+void metric_add(enum metric m, long long v);
+#define metric_inc(M) metric_add(M, 1)
+#define metric_dec(M) metric_add(M, -1)
+/* records a latency sample, in microseconds */
+void metric_observe(enum histogram h, long long usec);
+
+/* writes all metrics aggregated over all shards to fd, in the
+   prometheus text format. */
+void metrics_dump(int fd);
+
+/* opens the stats endpoint: a unix socket if spec contains a slash,
+   otherwise a tcp listener on ip:port (or just port, on loopback).
+   returns the listening fd or -1. */
+int metrics_listen(const char *spec);
+/* serves the endpoint on fd forever, one request at a time. */
+void metrics_serve(int fd);
+
+#endif
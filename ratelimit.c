@@ -0,0 +1,203 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* the buckets use the generic cell rate algorithm: instead of a token
+   count that needs refilling, each keeps the theoretical arrival time
+   (tat) of the next byte, which every charge moves forward by the time
+   the bytes take at the bucket's rate. the limit is exceeded while tat is
+   more than TAU ahead of the clock. so charging is a single cas and idle
+   buckets need no maintenance at all. */
+
+#define TAU 100000000LL /* ns, the burst allowed */
+#define SLICE_NS 10000000LL
+#define MIN_QUANTUM 1024
+#define TABLE_SIZE 1024
+
+struct bucket {
+	long long tat[2]; /* ns, per direction */
+	unsigned long long rate;
+	unsigned active; /* tunnels charging it */
+};
+
+/* bucket of a client ip or user, shared by its tunnels */
+struct entry {
+	struct entry *next;
+	struct bucket b;
+	size_t keylen;
+	unsigned char key[];
+};
+
+struct rltunnel {
+	struct bucket own;
+	struct bucket *shared[3]; /* ip, user, global, as far as limited */
+	long long fair_tat[2];
+	struct entry *ip, *user;
+};
+
+static unsigned long long rate_tunnel, rate_ip, rate_user;
+static struct bucket global;
+static int enabled;
+static struct entry *table[TABLE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void ratelimit_init(unsigned long long tunnel, unsigned long long ip,
+                   unsigned long long user, unsigned long long all) {
+	rate_tunnel = tunnel;
+	rate_ip = ip;
+	rate_user = user;
+	global.rate = all;
+	enabled = tunnel || ip || user || all;
+}
+
+static unsigned hash(const unsigned char *k, size_t n) {
+	unsigned h = 2166136261u;
+	while(n--) h = (h ^ *k++) * 16777619u;
+	return h % TABLE_SIZE;
+}
+
+static int drained(struct bucket *b, long long now) {
+	return __atomic_load_n(&b->tat[0], __ATOMIC_RELAXED) <= now &&
+	       __atomic_load_n(&b->tat[1], __ATOMIC_RELAXED) <= now;
+}
+
+/* entries outlive their last tunnel until their bucket drained, so a
+   client can't reset its bucket by reconnecting. they're collected when
+   their chain is walked. */
+static struct entry *entry_get(const unsigned char *key, size_t n, unsigned long long rate) {
+	struct entry *e, **pp;
+	long long now = now_ns();
+	pthread_mutex_lock(&table_lock);
+	for(pp = &table[hash(key, n)]; (e = *pp); ) {
+		if(e->keylen == n && !memcmp(e->key, key, n)) break;
+		if(!e->b.active && drained(&e->b, now)) {
+			*pp = e->next;
+			free(e);
+		} else
+			pp = &e->next;
+	}
+	if(!e && (e = calloc(1, sizeof *e + n))) {
+		e->b.rate = rate;
+		e->keylen = n;
+		memcpy(e->key, key, n);
+		e->next = table[hash(key, n)];
+		table[hash(key, n)] = e;
+	}
+	if(e) __atomic_add_fetch(&e->b.active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&table_lock);
+	return e;
+}
+
+static void entry_put(struct entry *e) {
+	if(!e) return;
+	pthread_mutex_lock(&table_lock);
+	__atomic_sub_fetch(&e->b.active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&table_lock);
+}
+
+int rl_attach(const struct client *client, struct rltunnel **rl) {
+	static const unsigned char v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+	unsigned char key[1+256];
+	struct rltunnel *t;
+	int n = 0;
+	*rl = 0;
+	if(!enabled) return 0;
+	if(!(t = calloc(1, sizeof *t))) return -1;
+	t->own.rate = rate_tunnel;
+	t->own.active = 1;
+	if(rate_ip) {
+		/* ipv4 addresses mapped into ::ffff:0:0/96, as in iplist.c */
+		key[0] = 'i';
+		if(SOCKADDR_UNION_AF(&client->addr) == AF_INET) {
+			memcpy(key+1, v4mapped, 12);
+			memcpy(key+13, &client->addr.v4.sin_addr, 4);
+		} else
+			memcpy(key+1, &client->addr.v6.sin6_addr, 16);
+		if(!(t->ip = entry_get(key, 17, rate_ip))) goto oom;
+		t->shared[n++] = &t->ip->b;
+	}
+	if(rate_user && client->user) {
+		size_t l = strlen(client->user);
+		key[0] = 'u';
+		memcpy(key+1, client->user, l);
+		if(!(t->user = entry_get(key, 1+l, rate_user))) goto oom;
+		t->shared[n++] = &t->user->b;
+	}
+	if(global.rate) {
+		__atomic_add_fetch(&global.active, 1, __ATOMIC_RELAXED);
+		t->shared[n++] = &global;
+	}
+	*rl = t;
+	return 0;
+oom:
+	entry_put(t->ip);
+	free(t);
+	return -1;
+}
+
+void rl_detach(struct rltunnel *t) {
+	if(!t) return;
+	entry_put(t->ip);
+	entry_put(t->user);
+	if(global.rate) __atomic_sub_fetch(&global.active, 1, __ATOMIC_RELAXED);
+	free(t);
+}
+
+/* the smallest share of the shared limits each of their tunnels gets */
+static unsigned long long fair_rate(struct rltunnel *t) {
+	unsigned long long r = 0, s;
+	unsigned a;
+	int i;
+	for(i=0; i<3 && t->shared[i]; i++) {
+		a = __atomic_load_n(&t->shared[i]->active, __ATOMIC_RELAXED);
+		s = t->shared[i]->rate / (a ? a : 1);
+		if(!s) s = 1;
+		if(!r || s < r) r = s;
+	}
+	return r;
+}
+
+size_t rl_quantum(struct rltunnel *t, size_t max) {
+	unsigned long long r = fair_rate(t), q;
+	if(t->own.rate && (!r || t->own.rate < r)) r = t->own.rate;
+	if(!r) return max;
+	q = r * SLICE_NS / 1000000000LL;
+	if(q < MIN_QUANTUM) q = MIN_QUANTUM;
+	return q < max ? q : max;
+}
+
+/* returns how far the bucket is over its limit, in ns */
+static long long charge(struct bucket *b, long long *tatp, size_t n, long long now) {
+	long long cost = n * 1000000000ULL / b->rate, old, tat;
+	old = __atomic_load_n(tatp, __ATOMIC_RELAXED);
+	do tat = (old > now ? old : now) + cost;
+	while(!__atomic_compare_exchange_n(tatp, &old, tat, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return tat - TAU - now;
+}
+
+long long rl_charge(struct rltunnel *t, int side, size_t n) {
+	long long now = now_ns(), wait = 0, shared = 0, w;
+	unsigned long long fair = fair_rate(t);
+	int i;
+	if(t->own.rate) wait = charge(&t->own, &t->own.tat[side], n, now);
+	for(i=0; i<3 && t->shared[i]; i++)
+		if((w = charge(t->shared[i], &t->shared[i]->tat[side], n, now)) > shared)
+			shared = w;
+	/* a tunnel below its fair share doesn't wait for the shared limits,
+	   the ones above it pay for its traffic. so small, interactive flows
+	   get through first and bulk transfers split the rest evenly. */
+	if(fair) {
+		struct bucket b = {.rate = fair};
+		if(charge(&b, &t->fair_tat[side], n, now) <= 0) shared = 0;
+	}
+	if(shared > wait) wait = shared;
+	return wait > 0 ? (wait + 999) / 1000 : 0;
+}
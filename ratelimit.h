@@ -0,0 +1,29 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include "server.h"
+
+#pragma RcB2 DEP "ratelimit.c"
+
+/* bandwidth limits in bytes per second and direction, 0 for none: for
+   each tunnel, for all tunnels of a client ip, of an authenticated user,
+   and for all tunnels together. without any, rl_attach() always yields
+   NULL and the relays skip rate limiting entirely. */
+void ratelimit_init(unsigned long long tunnel, unsigned long long ip,
+                   unsigned long long user, unsigned long long global);
+
+struct rltunnel;
+
+/* sets *rl to the limiter state of a new tunnel of client, or NULL if
+   there are no limits. returns -1 on OOM. */
+int rl_attach(const struct client *client, struct rltunnel **rl);
+void rl_detach(struct rltunnel *rl);
+/* how much to move at once, at most max. it's the fair share of a
+   short time slice, so tunnels sharing a limit take turns. */
+size_t rl_quantum(struct rltunnel *rl, size_t max);
+/* charges n bytes moved from side (0: client, 1: target). returns the
+   microseconds to wait before reading from side again, or 0. */
+long long rl_charge(struct rltunnel *rl, int side, size_t n);
+
+#endif
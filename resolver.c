@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include "resolver.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* jobs waiting for a thread, in the order they came in */
+static struct dnsjob *head, **tail = &head;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned running;
+
+static void finish(struct dnsjob *j) {
+	struct dnsqueue *q = j->q;
+	int was_empty;
+	pthread_mutex_lock(&q->lock);
+	was_empty = !q->done;
+	j->next = q->done;
+	q->done = j;
+	pthread_mutex_unlock(&q->lock);
+	/* the worker empties the pipe before it takes the queue, so a byte
+	   for each time it became non-empty is enough. */
+	if(was_empty) write(q->fd[1], "", 1);
+}
+
+static void* resolver_thread(void *data) {
+	struct dnsjob *j;
+	while(1) {
+		pthread_mutex_lock(&lock);
+		while(!head) pthread_cond_wait(&cond, &lock);
+		j = head;
+		if(!(head = j->next)) tail = &head;
+		pthread_mutex_unlock(&lock);
+		j->err = dns_lookup(j->host, j->port, &j->res);
+		finish(j);
+	}
+	return 0;
+}
+
+int resolver_init(unsigned n) {
+	pthread_t pt;
+	int ret = 0;
+	/* udp relays start the pool when they first need it */
+	pthread_mutex_lock(&lock);
+	for(; running < n; running++) {
+		if((errno = pthread_create(&pt, 0, resolver_thread, 0))) {
+			ret = -1;
+			break;
+		}
+		pthread_detach(pt);
+		metric_inc(M_THREADS);
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int dnsqueue_init(struct dnsqueue *q) {
+	int i;
+	pthread_mutex_init(&q->lock, 0);
+	q->done = 0;
+	if(pipe(q->fd)) return -1;
+	for(i=0; i<2; i++) {
+		fcntl(q->fd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(q->fd[i], F_SETFL, O_NONBLOCK);
+	}
+	return 0;
+}
+
+void dnsqueue_free(struct dnsqueue *q) {
+	close(q->fd[0]);
+	close(q->fd[1]);
+	pthread_mutex_destroy(&q->lock);
+}
+
+void resolver_submit(struct dnsqueue *q, struct dnsjob *j) {
+	j->q = q;
+	j->next = 0;
+	pthread_mutex_lock(&lock);
+	*tail = j;
+	tail = &j->next;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+struct dnsjob *dnsqueue_take(struct dnsqueue *q) {
+	char buf[64];
+	struct dnsjob *j;
+	while(read(q->fd[0], buf, sizeof buf) > 0);
+	pthread_mutex_lock(&q->lock);
+	j = q->done;
+	q->done = 0;
+	pthread_mutex_unlock(&q->lock);
+	return j;
+}
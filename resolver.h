@@ -0,0 +1,45 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <pthread.h>
+#include "dnscache.h"
+
+#pragma RcB2 DEP "resolver.c"
+
+/* name lookups on a pool of threads, for the workers of the event driven
+   modes, which must not wait for the resolver. a worker submits jobs and
+   gets them back through a queue of its own, which makes a pipe readable
+   that the worker watches along with its connections. */
+
+#ifndef RESOLVER_THREADS
+#define RESOLVER_THREADS 8
+#endif
+
+struct dnsqueue {
+	pthread_mutex_t lock;
+	struct dnsjob *done;
+	int fd[2]; /* fd[0] is readable while done isn't empty */
+};
+
+struct dnsjob {
+	struct dnsjob *next;
+	struct dnsqueue *q; /* where it goes once done */
+	void *arg; /* the submitter's, which may clear it to lose interest */
+	unsigned short port;
+	int err; /* as returned by dns_lookup() */
+	struct dnsresult res;
+	char host[256];
+};
+
+/* starts threads until n are running. returns 0, or -1 with errno set. */
+int resolver_init(unsigned n);
+/* returns 0, or -1 with errno set. */
+int dnsqueue_init(struct dnsqueue *q);
+/* no job may be pending on q. */
+void dnsqueue_free(struct dnsqueue *q);
+/* runs dns_lookup() for j, which is put on q once done. */
+void resolver_submit(struct dnsqueue *q, struct dnsjob *j);
+/* takes all jobs done so far, in no particular order. */
+struct dnsjob *dnsqueue_take(struct dnsqueue *q);
+
+#endif
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include "server.h"
+#include <errno.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -31,12 +34,77 @@ int bindtoip(int fd, union sockaddr_union *bindaddr) {
 	return 0;
 }
 
+ssize_t fastopen_connect(int fd, union sockaddr_union *addr, const void *data, size_t n) {
+#ifdef MSG_FASTOPEN
+	/* unlike TCP_FASTOPEN_CONNECT, this sends the SYN right away, so the
+	   outcome of the connect is known as usual and not only after the
+	   first write. without a cookie the data waits for the handshake. */
+	if(n) {
+		ssize_t r = sendto(fd, data, n, MSG_FASTOPEN, (void*) addr, SOCKADDR_UNION_LENGTH(addr));
+		if(r != -1 || errno != EOPNOTSUPP) return r;
+		/* disabled in the net.ipv4.tcp_fastopen sysctl */
+	}
+#endif
+	return connect(fd, (void*) addr, SOCKADDR_UNION_LENGTH(addr));
+}
+
+int fastopen_used(int fd) {
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+	struct tcp_info ti;
+	socklen_t l = sizeof ti;
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &l)) return 0;
+	return !!(ti.tcpi_options & TCPI_OPT_SYN_DATA);
+#else
+	return 0;
+#endif
+}
+
+void socktune_apply(int fd, const struct socktune *t) {
+	int yes = 1;
+	if(t->rcvbuf) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf, sizeof(int));
+	if(t->sndbuf) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &t->sndbuf, sizeof(int));
+	if(t->nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+#ifdef TCP_NOTSENT_LOWAT
+	if(t->notsent_lowat) setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->notsent_lowat, sizeof(int));
+#endif
+#ifdef TCP_QUICKACK
+	/* not sticky, linux may go back to delayed acks later on */
+	if(t->quickack) setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(int));
+#endif
+	if(!t->keepidle) return;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(int));
+#if defined(TCP_KEEPIDLE)
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &t->keepidle, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &t->keepidle, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+	if(t->keepintvl) setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &t->keepintvl, sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+	if(t->keepcnt) setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &t->keepcnt, sizeof(int));
+#endif
+}
+
 int server_waitclient(struct server *server, struct client* client) {
 	socklen_t clen = sizeof client->addr;
+	client->user = 0;
 	return ((client->fd = accept(server->fd, (void*)&client->addr, &clen)) == -1)*-1;
 }
 
-int server_setup(struct server *server, const char* listenip, unsigned short port) {
+int server_setup(struct server *server, const char* listenip, unsigned short port, int flags, const struct socktune *tune) {
+#ifndef SO_REUSEPORT
+	if(flags & SERVER_REUSEPORT) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+#endif
+#ifndef TCP_FASTOPEN
+	if(flags & SERVER_FASTOPEN) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+#endif
 	struct addrinfo *ainfo = 0;
 	if(resolve(listenip, port, &ainfo)) return -1;
 	struct addrinfo* p;
@@ -46,6 +114,14 @@ int server_setup(struct server *server, const char* listenip, unsigned short por
 			continue;
 		int yes = 1;
 		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#ifdef SO_REUSEPORT
+		if((flags & SERVER_REUSEPORT) &&
+		   setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0) {
+			close(listenfd);
+			listenfd = -1;
+			continue;
+		}
+#endif
 		if(bind(listenfd, p->ai_addr, p->ai_addrlen) < 0) {
 			close(listenfd);
 			listenfd = -1;
@@ -55,6 +131,15 @@ int server_setup(struct server *server, const char* listenip, unsigned short por
 	}
 	freeaddrinfo(ainfo);
 	if(listenfd < 0) return -2;
+	if(tune) socktune_apply(listenfd, tune);
+#ifdef TCP_FASTOPEN
+	int qlen = SOMAXCONN;
+	if((flags & SERVER_FASTOPEN) &&
+	   setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(int)) < 0) {
+		close(listenfd);
+		return -4;
+	}
+#endif
 	if(listen(listenfd, SOMAXCONN) < 0) {
 		close(listenfd);
 		return -3;
@@ -32,18 +32,43 @@ union sockaddr_union {
 struct client {
 	union sockaddr_union addr;
 	int fd;
+	const char *user; /* once authenticated with user/pass */
+	int tunnel; /* counted as a tunnel by admission control */
 };
 
 struct server {
 	int fd;
 };
 
+/* socket options set with -S, 0 leaves the os default. buffer sizes are
+   in bytes, keepalive times in seconds. */
+struct socktune {
+	int rcvbuf, sndbuf, notsent_lowat;
+	int nodelay, quickack;
+	int keepidle, keepintvl, keepcnt; /* keepalive is enabled by keepidle */
+};
+
+/* flags for server_setup() */
+#define SERVER_REUSEPORT 1
+#define SERVER_FASTOPEN 2
+
 int resolve(const char *host, unsigned short port, struct addrinfo** addr);
 int resolve_sa(const char *host, unsigned short port, union sockaddr_union *res);
 int bindtoip(int fd, union sockaddr_union *bindaddr);
+/* connect() that sends up to n bytes of data along with the SYN if the
+   kernel has a fast open cookie for addr. returns how many it sent,
+   which may be 0, or -1 like connect(). */
+ssize_t fastopen_connect(int fd, union sockaddr_union *addr, const void *data, size_t n);
+/* whether data in the SYN was acked on fd, either direction */
+int fastopen_used(int fd);
+/* applies t to fd, before connect() or listen() for the buffer sizes to
+   be taken into account for the window scale. sockets accepted from a
+   listening socket inherit its options, except for quickack. options not
+   supported by the platform are skipped. */
+void socktune_apply(int fd, const struct socktune *t);
 
 int server_waitclient(struct server *server, struct client* client);
-int server_setup(struct server *server, const char* listenip, unsigned short port);
+int server_setup(struct server *server, const char* listenip, unsigned short port, int flags, const struct socktune *tune);
 
 #endif
 
@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include "sockmap.h"
+#if CONFIG_SOCKMAP
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+
+/* what the map holds for each socket, keyed by its cookie */
+struct peer {
+	unsigned long long cookie; /* of the other socket of the tunnel */
+	unsigned long long bytes; /* relayed to it */
+	unsigned long long passed; /* left to userspace, see below */
+};
+
+static int socks_fd = -1, peers_fd = -1, prog_fd = -1;
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+static int map_create(unsigned type, unsigned value_size, unsigned max, unsigned flags) {
+	union bpf_attr a;
+	memset(&a, 0, sizeof a);
+	a.map_type = type;
+	a.key_size = sizeof(unsigned long long);
+	a.value_size = value_size;
+	a.max_entries = max;
+	a.map_flags = flags;
+	return sys_bpf(BPF_MAP_CREATE, &a);
+}
+
+static int map_op(int cmd, int fd, const void *key, void *value, unsigned long long flags) {
+	union bpf_attr a;
+	memset(&a, 0, sizeof a);
+	a.map_fd = fd;
+	a.key = (unsigned long) key;
+	a.value = (unsigned long) value;
+	a.flags = flags;
+	return sys_bpf(cmd, &a);
+}
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+	{.code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM)}
+#define MOV(DST, SRC) INSN(BPF_ALU64|BPF_MOV|BPF_X, DST, SRC, 0, 0)
+#define MOVI(DST, IMM) INSN(BPF_ALU64|BPF_MOV|BPF_K, DST, 0, 0, IMM)
+#define ADDI(DST, IMM) INSN(BPF_ALU64|BPF_ADD|BPF_K, DST, 0, 0, IMM)
+#define LDX(SIZE, DST, SRC, OFF) INSN(BPF_LDX|BPF_MEM|SIZE, DST, SRC, OFF, 0)
+#define STX(SIZE, DST, SRC, OFF) INSN(BPF_STX|BPF_MEM|SIZE, DST, SRC, OFF, 0)
+#define XADD(DST, SRC, OFF) INSN(BPF_STX|BPF_ATOMIC|BPF_DW, DST, SRC, OFF, BPF_ADD)
+#define LDMAP(DST, FD) INSN(BPF_LD|BPF_DW|BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD), INSN(0, 0, 0, 0, 0)
+#define JEQI(DST, IMM, OFF) INSN(BPF_JMP|BPF_JEQ|BPF_K, DST, 0, OFF, IMM)
+#define JNEI(DST, IMM, OFF) INSN(BPF_JMP|BPF_JNE|BPF_K, DST, 0, OFF, IMM)
+#define CALL(FUNC) INSN(BPF_JMP|BPF_CALL, 0, 0, 0, FUNC)
+#define EXIT() INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+
+/* the verdict program, as it would read in c:
+
+	struct peer *p = bpf_map_lookup_elem(&peers, &(u64){bpf_get_socket_cookie(skb)});
+	if(!p || p->passed) return SK_PASS;
+	if(bpf_sk_redirect_hash(skb, &socks, &(u64){p->cookie}, 0) == SK_PASS)
+		__sync_fetch_and_add(&p->bytes, skb->len);
+	else
+		__sync_fetch_and_add(&p->passed, skb->len);
+	return SK_PASS;
+
+   if the other socket isn't in the map (yet), the data is passed on to
+   the socket's own receive queue, and so is all that comes after it, to
+   keep the order. whoever serves the tunnel then has to relay it. */
+static int load_prog(void) {
+	struct bpf_insn prog[] = {
+		MOV(BPF_REG_6, BPF_REG_1),
+		CALL(BPF_FUNC_get_socket_cookie),
+		STX(BPF_DW, BPF_REG_10, BPF_REG_0, -8),
+		MOV(BPF_REG_2, BPF_REG_10),
+		ADDI(BPF_REG_2, -8),
+		LDMAP(BPF_REG_1, peers_fd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQI(BPF_REG_0, 0, 17),
+		MOV(BPF_REG_7, BPF_REG_0),
+		LDX(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(struct peer, passed)),
+		JNEI(BPF_REG_1, 0, 14),
+		LDX(BPF_DW, BPF_REG_1, BPF_REG_7, offsetof(struct peer, cookie)),
+		STX(BPF_DW, BPF_REG_10, BPF_REG_1, -16),
+		MOV(BPF_REG_1, BPF_REG_6),
+		LDMAP(BPF_REG_2, socks_fd),
+		MOV(BPF_REG_3, BPF_REG_10),
+		ADDI(BPF_REG_3, -16),
+		MOVI(BPF_REG_4, 0),
+		CALL(BPF_FUNC_sk_redirect_hash),
+		LDX(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len)),
+		JNEI(BPF_REG_0, SK_PASS, 2),
+		XADD(BPF_REG_7, BPF_REG_1, offsetof(struct peer, bytes)),
+		INSN(BPF_JMP|BPF_JA, 0, 0, 1, 0),
+		XADD(BPF_REG_7, BPF_REG_1, offsetof(struct peer, passed)),
+		MOVI(BPF_REG_0, SK_PASS),
+		EXIT(),
+	};
+	union bpf_attr a;
+	memset(&a, 0, sizeof a);
+	a.prog_type = BPF_PROG_TYPE_SK_SKB;
+	a.insns = (unsigned long) prog;
+	a.insn_cnt = sizeof prog / sizeof *prog;
+	a.license = (unsigned long) "Dual MIT/GPL";
+	return sys_bpf(BPF_PROG_LOAD, &a);
+}
+
+int sockmap_init(unsigned max) {
+	union bpf_attr a;
+	int err;
+	if((socks_fd = map_create(BPF_MAP_TYPE_SOCKHASH, sizeof(int), max, 0)) == -1 ||
+	   (peers_fd = map_create(BPF_MAP_TYPE_HASH, sizeof(struct peer), max, BPF_F_NO_PREALLOC)) == -1 ||
+	   (prog_fd = load_prog()) == -1)
+		goto fail;
+	memset(&a, 0, sizeof a);
+	a.target_fd = socks_fd;
+	a.attach_bpf_fd = prog_fd;
+	a.attach_type = BPF_SK_SKB_VERDICT;
+	if(!sys_bpf(BPF_PROG_ATTACH, &a)) return 0;
+fail:
+	err = errno;
+	if(prog_fd != -1) close(prog_fd);
+	if(peers_fd != -1) close(peers_fd);
+	if(socks_fd != -1) close(socks_fd);
+	socks_fd = peers_fd = prog_fd = -1;
+	errno = err;
+	return -1;
+}
+
+/* bytes ever written to a tcp socket: those acked plus those still
+   in its send queue. the program passes data on through the socket's
+   send queue as well, so this grows by what it relayed. */
+static int written(int fd, unsigned long long *n) {
+	struct tcp_info ti;
+	socklen_t l = sizeof ti;
+	int q;
+	/* acked first, so acks in between can't make it count twice */
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &l) ||
+	   l < offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof ti.tcpi_bytes_acked ||
+	   ioctl(fd, SIOCOUTQ, &q))
+		return -1;
+	*n = ti.tcpi_bytes_acked + q;
+	return 0;
+}
+
+int sockmap_add(struct smtunnel *t, int fd1, int fd2) {
+	struct peer p = {0};
+	socklen_t l;
+	int i, one = 1;
+	t->fd[0] = fd1;
+	t->fd[1] = fd2;
+	for(i=0; i<2; i++) {
+		l = sizeof t->cookie[i];
+		if(getsockopt(t->fd[i], SOL_SOCKET, SO_COOKIE, &t->cookie[i], &l) ||
+		   written(t->fd[i], &t->base[i]))
+			return -1;
+	}
+	for(i=0; i<2; i++) {
+		p.cookie = t->cookie[!i];
+		if(map_op(BPF_MAP_UPDATE_ELEM, peers_fd, &t->cookie[i], &p, BPF_NOEXIST)) {
+			if(i) map_op(BPF_MAP_DELETE_ELEM, peers_fd, &t->cookie[0], 0, 0);
+			return -1;
+		}
+	}
+	if(map_op(BPF_MAP_UPDATE_ELEM, socks_fd, &t->cookie[0], &fd1, BPF_NOEXIST))
+		goto fail;
+	if(map_op(BPF_MAP_UPDATE_ELEM, socks_fd, &t->cookie[1], &fd2, BPF_NOEXIST)) {
+		/* fd1 stays in the map until it's closed. anything that
+		   arrived on it meanwhile was passed to it, and so is what
+		   comes after once the peers are gone. */
+		goto fail;
+	}
+	/* the program only runs when data arrives. raising the low water
+	   mark signals data already there, so the program takes that as
+	   well, ahead of anything newer. */
+	for(i=0; i<2; i++)
+		setsockopt(t->fd[i], SOL_SOCKET, SO_RCVLOWAT, &one, sizeof one);
+	return 0;
+fail:
+	for(i=0; i<2; i++)
+		map_op(BPF_MAP_DELETE_ELEM, peers_fd, &t->cookie[i], 0, 0);
+	return -1;
+}
+
+void sockmap_bytes(const struct smtunnel *t, unsigned long long bytes[2]) {
+	struct peer p;
+	int i;
+	for(i=0; i<2; i++)
+		bytes[i] = map_op(BPF_MAP_LOOKUP_ELEM, peers_fd, &t->cookie[i], &p, 0) ? 0 : p.bytes;
+}
+
+int sockmap_flushed(const struct smtunnel *t, const unsigned long long bytes[2]) {
+	unsigned long long n;
+	int i;
+	for(i=0; i<2; i++) {
+		/* nothing can be relied on then, don't wait for it */
+		if(written(t->fd[!i], &n)) return 1;
+		if(n - t->base[!i] < bytes[i]) return 0;
+	}
+	return 1;
+}
+
+void sockmap_del(struct smtunnel *t) {
+	int i;
+	for(i=0; i<2; i++) {
+		map_op(BPF_MAP_DELETE_ELEM, socks_fd, &t->cookie[i], 0, 0);
+		map_op(BPF_MAP_DELETE_ELEM, peers_fd, &t->cookie[i], 0, 0);
+	}
+}
+
+#endif
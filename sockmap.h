@@ -0,0 +1,59 @@
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+/* relays tunnels inside the kernel: both sockets of a tunnel go into a
+   bpf sockhash, whose sk_skb verdict program hands whatever arrives on
+   one socket straight to the other and counts the bytes in a map. uses
+   the raw bpf syscall with a hand-assembled program, so neither libbpf
+   nor a bpf compiler is needed. requires kernel headers of linux 5.13 or
+   newer at build time (BPF_SK_SKB_VERDICT); at runtime sockmap_init()
+   simply fails without CAP_BPF/CAP_NET_ADMIN or kernel support. */
+
+#ifndef CONFIG_SOCKMAP
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+/* came along with BPF_SK_SKB_VERDICT in 5.13 */
+#ifdef BPF_PSEUDO_FUNC
+#define CONFIG_SOCKMAP 1
+#endif
+#endif
+#endif
+#ifndef CONFIG_SOCKMAP
+#define CONFIG_SOCKMAP 0
+#endif
+#endif
+
+#if CONFIG_SOCKMAP
+
+#pragma RcB2 DEP "sockmap.c"
+
+struct smtunnel {
+	int fd[2];
+	unsigned long long cookie[2];
+	/* what was written to each socket before, see sockmap_flushed() */
+	unsigned long long base[2];
+};
+
+/* creates the maps for up to max sockets and loads the program.
+   returns 0, or -1 with errno set. */
+int sockmap_init(unsigned max);
+
+/* moves the tunnel between fd1 and fd2 into the kernel. data that
+   arrived on either before is relayed as well. returns -1 if that isn't
+   possible, the tunnel is then left as it was. if the relay fails later
+   on, e.g. as one side was closed, what arrives on the other is left to
+   be read from it as usual. */
+int sockmap_add(struct smtunnel *t, int fd1, int fd2);
+/* sets bytes[0] and [1] to what was relayed from fd1 and fd2. */
+void sockmap_bytes(const struct smtunnel *t, unsigned long long bytes[2]);
+/* whether the bytes[0] and [1] moved from fd1 and fd2 since
+   sockmap_add(), in the kernel or not, have all been passed to the send
+   queue of the other socket, so that closing it doesn't lose any. */
+int sockmap_flushed(const struct smtunnel *t, const unsigned long long bytes[2]);
+/* takes the tunnel out of the kernel again, before its fds are closed. */
+void sockmap_del(struct smtunnel *t);
+
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+#include "socks5.h"
+
+/* reply codes for malformed requests */
+#define GENERAL_FAILURE 1
+#define COMMAND_NOT_SUPPORTED 7
+#define ADDRESSTYPE_NOT_SUPPORTED 8
+
+/* the address type at buf[3] and what follows it, which is the same in
+   requests, replies and udp headers. */
+static enum s5status parse_addr(const unsigned char *buf, size_t n, struct s5addr *a, size_t *len, unsigned char *error) {
+	size_t off = 4;
+	/* a name of length 0 is the shortest */
+	*len = 4 + 1 + 2;
+	if(n < 4) return S5_NEED_MORE;
+	a->type = buf[3];
+	switch(a->type) {
+		case S5_IPV4:
+			a->len = 4;
+			break;
+		case S5_IPV6:
+			a->len = 16;
+			break;
+		case S5_NAME:
+			if(n < 5) return S5_NEED_MORE;
+			a->len = buf[4];
+			off = 5;
+			break;
+		default:
+			*error = ADDRESSTYPE_NOT_SUPPORTED;
+			return S5_ERROR;
+	}
+	*len = off + a->len + 2;
+	if(n < *len) return S5_NEED_MORE;
+	a->p = buf + off;
+	a->port = (buf[off + a->len] << 8) | buf[off + a->len + 1];
+	return S5_DONE;
+}
+
+enum s5status s5_greeting(const unsigned char *buf, size_t n, struct s5greeting *g) {
+	g->len = 2;
+	if(n >= 1 && buf[0] != 5) return S5_ERROR;
+	if(n < 2) return S5_NEED_MORE;
+	g->n_methods = buf[1];
+	g->methods = buf + 2;
+	g->len += g->n_methods;
+	return n < g->len ? S5_NEED_MORE : S5_DONE;
+}
+
+enum s5status s5_auth(const unsigned char *buf, size_t n, struct s5auth *a) {
+	a->len = 3;
+	if(n >= 1 && buf[0] != 1) return S5_ERROR;
+	if(n < 2) return S5_NEED_MORE;
+	a->ulen = buf[1];
+	a->user = buf + 2;
+	a->len += a->ulen;
+	if(n < a->len) return S5_NEED_MORE;
+	a->plen = buf[a->len - 1];
+	a->pass = buf + a->len;
+	a->len += a->plen;
+	return n < a->len ? S5_NEED_MORE : S5_DONE;
+}
+
+static enum s5status parse_request(const unsigned char *buf, size_t n, struct s5request *r, int request) {
+	r->len = 4 + 1 + 2;
+	r->error = GENERAL_FAILURE;
+	if(n >= 1 && buf[0] != 5) return S5_ERROR;
+	if(n < 2) return S5_NEED_MORE;
+	r->cmd = buf[1];
+	if(request && (r->cmd < S5_CONNECT || r->cmd > S5_UDP_ASSOCIATE)) {
+		r->error = COMMAND_NOT_SUPPORTED;
+		return S5_ERROR;
+	}
+	if(n >= 3 && buf[2] != 0) return S5_ERROR;
+	return parse_addr(buf, n, &r->addr, &r->len, &r->error);
+}
+
+enum s5status s5_request(const unsigned char *buf, size_t n, struct s5request *r) {
+	return parse_request(buf, n, r, 1);
+}
+
+enum s5status s5_reply(const unsigned char *buf, size_t n, struct s5request *r) {
+	return parse_request(buf, n, r, 0);
+}
+
+enum s5status s5_udp(const unsigned char *buf, size_t n, struct s5udp *u) {
+	unsigned char error;
+	u->len = 4 + 1 + 2;
+	if(n < 3) return S5_NEED_MORE;
+	u->frag = buf[2];
+	return parse_addr(buf, n, &u->addr, &u->len, &error);
+}
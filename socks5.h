@@ -0,0 +1,71 @@
+#ifndef SOCKS5_H
+#define SOCKS5_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "socks5.c"
+
+/* parsers for the messages of rfc 1928 and rfc 1929. they do no i/o,
+   keep no state and copy nothing: the results point into the buffer,
+   which has to stay around as long as they're used. a message can be
+   fed as it trickles in, each call looks at what arrived so far. */
+
+enum s5status {
+	S5_NEED_MORE, /* incomplete, len is the least it can take */
+	S5_DONE, /* len is the length of the message */
+	S5_ERROR, /* malformed, no matter what follows */
+};
+
+/* commands */
+#define S5_CONNECT 1
+#define S5_BIND 2
+#define S5_UDP_ASSOCIATE 3
+
+/* address types */
+#define S5_IPV4 1
+#define S5_NAME 3
+#define S5_IPV6 4
+
+struct s5addr {
+	const unsigned char *p; /* 4 or 16 bytes, or the name, not 0-terminated */
+	unsigned char type, len; /* of p */
+	unsigned short port; /* in host byte order */
+};
+
+/* method selection */
+struct s5greeting {
+	size_t len;
+	const unsigned char *methods;
+	unsigned char n_methods;
+};
+
+/* username/password authentication */
+struct s5auth {
+	size_t len;
+	const unsigned char *user, *pass;
+	unsigned char ulen, plen;
+};
+
+/* a request, or a reply to one, which has the same layout */
+struct s5request {
+	size_t len;
+	unsigned char cmd; /* or the reply code */
+	unsigned char error; /* the reply code for it if malformed */
+	struct s5addr addr;
+};
+
+/* the header of a udp datagram, which must be complete */
+struct s5udp {
+	size_t len;
+	unsigned char frag;
+	struct s5addr addr;
+};
+
+enum s5status s5_greeting(const unsigned char *buf, size_t n, struct s5greeting *g);
+enum s5status s5_auth(const unsigned char *buf, size_t n, struct s5auth *a);
+/* unknown commands are an error, all of the rfc are accepted. */
+enum s5status s5_request(const unsigned char *buf, size_t n, struct s5request *r);
+enum s5status s5_reply(const unsigned char *buf, size_t n, struct s5request *r);
+enum s5status s5_udp(const unsigned char *buf, size_t n, struct s5udp *u);
+
+#endif
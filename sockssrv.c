@@ -33,8 +33,27 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
 #include "server.h"
-#include "sblist.h"
+#include "dnscache.h"
+#include "resolver.h"
+#include "uring.h"
+#include "iplist.h"
+#include "metrics.h"
+#include "bufpool.h"
+#include "udprelay.h"
+#include "accesslog.h"
+#include "ratelimit.h"
+#include "admit.h"
+#include "timeout.h"
+#include "srcpool.h"
+#include "userdb.h"
+#include "handoff.h"
+#include "upstream.h"
+#include "sockmap.h"
+#include "socks5.h"
 
 /* timeout in microseconds on resource exhaustion to prevent excessive
    cpu usage. */
@@ -42,6 +61,39 @@
 #define FAILURE_TIMEOUT 64
 #endif
 
+/* how long to stop accepting when out of fds or memory even after
+   giving up the spare fd, in microseconds. */
+#ifndef ACCEPT_BACKOFF
+#define ACCEPT_BACKOFF 10000
+#endif
+
+#ifndef CONFIG_EPOLL
+#ifdef __linux__
+#define CONFIG_EPOLL 1
+#else
+#define CONFIG_EPOLL 0
+#endif
+#endif
+#if CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifndef CONFIG_SPLICE
+#ifdef __linux__
+#define CONFIG_SPLICE 1
+#else
+#define CONFIG_SPLICE 0
+#endif
+#endif
+/* the default pipe capacity, relay pipes are enlarged for bigger -B sizes. */
+#define SPLICE_SIZE (64*1024)
+
+/* delay in milliseconds between connection attempts to the addresses of
+   a target, rfc 8305 recommends 250. */
+#ifndef HE_DELAY
+#define HE_DELAY 250
+#endif
+
 #ifndef MAX
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -67,15 +119,38 @@
 static int quiet;
 static const char* auth_user;
 static const char* auth_pass;
-static sblist* auth_ips;
-static pthread_rwlock_t auth_ips_lock = PTHREAD_RWLOCK_INITIALIZER;
+static const char* auth_file;
+static int need_auth;
+static int auth_ips, auth_once;
 static const struct server* server;
-static union sockaddr_union bind_addr = {.v4.sin_family = AF_UNSPEC};
+static unsigned connect_timeout; /* ms, 0: os default */
+static int fastopen;
+static int optimistic; /* report CONNECT success before connecting */
+static struct socktune tune;
+static int adaptive; /* adapt the relay read size to each tunnel */
+static int upstream; /* CONNECTs are forwarded to a parent proxy */
+static int offload; /* the kernel relays tunnels, see sockmap.h */
+/* size of relay buffers, and the most data moved per syscall */
+static size_t relay_bufsize = 16*1024;
+static size_t relay_budget; /* bytes for all relay buffers, 0: unlimited */
+
+enum relayengine {
+	RE_READWRITE,
+	RE_SPLICE,
+};
+static const char* relay_engine_names[] = {
+	[RE_READWRITE] = "read/write",
+	[RE_SPLICE] = "splice",
+};
+static volatile enum relayengine relay_engine = CONFIG_SPLICE ? RE_SPLICE : RE_READWRITE;
 
 enum socksstate {
 	SS_1_CONNECTED,
 	SS_2_NEED_AUTH, /* skipped if NO_AUTH method supported */
 	SS_3_AUTHED,
+	SS_4_CONNECTING, /* event mode only */
+	SS_5_RELAYING, /* event mode only */
+	SS_6_UDP_ASSOCIATED, /* relayed by a thread in all modes */
 };
 
 enum authmethod {
@@ -97,417 +172,2750 @@ enum errorcode {
 	EC_ADDRESSTYPE_NOT_SUPPORTED = 8,
 };
 
+/* handshake data of a client. messages are parsed out of buf as they
+   complete, so a client may send greeting, auth and request at once.
+   the replies are collected in out and written together. */
+#define HS_BUFSIZE 2048
+struct hsbuf {
+	size_t len, outlen;
+	unsigned char buf[HS_BUFSIZE];
+	unsigned char out[64];
+	/* how much of the early data in buf went out with the SYN */
+	size_t synlen;
+	/* addresses not tried yet, used by the non-blocking modes */
+	struct dnsresult pending;
+	/* the lookup of the target, while it's in progress in those */
+	struct dnsjob *job;
+};
+
 struct thread {
 	pthread_t pt;
 	struct client client;
 	enum socksstate state;
-	volatile int  done;
+	struct thread *next_done;
+};
+
+/* finished client threads push themselves onto this lock-free stack,
+   the accept loop takes the whole stack at once and joins them. */
+static struct thread *done_threads;
+
+/* pool of pre-spawned client threads that are reused for new clients.
+   idle workers are kept on a lock-free stack of pool indices; the head
+   carries a tag in the upper 32 bits that is bumped on every change,
+   which rules out ABA issues with concurrent pops from several accept
+   threads. */
+struct poolworker {
+	struct thread t;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int busy;
+	unsigned next; /* index+1 of next idle worker, 0 terminates */
 };
 
+static struct poolworker *pool;
+static unsigned pool_size;
+static unsigned long long pool_idle;
+
 #ifndef CONFIG_LOG
 #define CONFIG_LOG 1
 #endif
 #if CONFIG_LOG
-/* we log to stderr because it's not using line buffering, i.e. malloc which would need
-   locking when called from different threads. for the same reason we use dprintf,
-   which writes directly to an fd. */
-#define dolog(...) do { if(!quiet) dprintf(2, __VA_ARGS__); } while(0)
+/* messages go through the access log, so client threads never block on
+   stderr. nothing is logged with -q, as the log is never initialized. */
+#define dolog(...) alog_msg(__VA_ARGS__)
 #else
 static void dolog(const char* fmt, ...) { }
 #endif
 
-static struct addrinfo* addr_choose(struct addrinfo* list, union sockaddr_union* bindaddr) {
-	int af = SOCKADDR_UNION_AF(bindaddr);
-	if(af == AF_UNSPEC) return list;
-	struct addrinfo* p;
-	for(p=list; p; p=p->ai_next)
-		if(p->ai_family == af) return p;
-	return list;
+static int set_nonblock(int fd) {
+	int fl = fcntl(fd, F_GETFL);
+	if(fl == -1) return -1;
+	return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
 }
 
-static int connect_socks_target(unsigned char *buf, size_t n, struct client *client) {
-	if(n < 5) return -EC_GENERAL_FAILURE;
-	if(buf[0] != 5) return -EC_GENERAL_FAILURE;
-	if(buf[1] != 1) return -EC_COMMAND_NOT_SUPPORTED; /* we support only CONNECT method */
-	if(buf[2] != 0) return -EC_GENERAL_FAILURE; /* malformed packet */
+static long long now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-	int af = AF_INET;
-	size_t minlen = 4 + 4 + 2, l;
-	char namebuf[256];
-	struct addrinfo* remote;
-
-	switch(buf[3]) {
-		case 4: /* ipv6 */
-			af = AF_INET6;
-			minlen = 4 + 2 + 16;
-			/* fall through */
-		case 1: /* ipv4 */
-			if(n < minlen) return -EC_GENERAL_FAILURE;
-			if(namebuf != inet_ntop(af, buf+4, namebuf, sizeof namebuf))
-				return -EC_GENERAL_FAILURE; /* malformed or too long addr */
+static long long now_ms(void) {
+	return now_us() / 1000;
+}
+
+/* sort addresses for connection attempts as suggested by rfc 8305:
+   the preferred family first, i.e. the one of the first -b address or
+   else the one the resolver returned first, then alternating. */
+static void addr_order(struct dnsresult *list, int af) {
+	union sockaddr_union pref[DNS_MAXADDRS], other[DNS_MAXADDRS];
+	unsigned i, np = 0, no = 0, n = 0;
+	if(!list->n) return;
+	if(af == AF_UNSPEC) af = SOCKADDR_UNION_AF(&list->addr[0]);
+	for(i=0; i<list->n; i++) {
+		if(SOCKADDR_UNION_AF(&list->addr[i]) == af) pref[np++] = list->addr[i];
+		else other[no++] = list->addr[i];
+	}
+	for(i=0; i<np || i<no; i++) {
+		if(i<np) list->addr[n++] = pref[i];
+		if(i<no) list->addr[n++] = other[i];
+	}
+}
+
+/* starts a non-blocking connect to addr. with -f, the *early bytes at
+   data are offered to fast open, *early is set to how many it sent.
+   returns the fd, or -1. */
+static int connect_start(union sockaddr_union *addr, const void *data, size_t *early) {
+	size_t n = fastopen && early ? *early : 0;
+	ssize_t sent;
+	if(early) *early = 0;
+	int fd = socket(SOCKADDR_UNION_AF(addr), SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	socktune_apply(fd, &tune);
+	if(srcpool_bind(fd, addr) == -1 ||
+	   set_nonblock(fd) == -1 ||
+	   ((sent = fastopen_connect(fd, addr, data, n)) == -1 &&
+	    errno != EINPROGRESS)) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	if(early && sent > 0) *early = sent;
+	return fd;
+}
+
+/* removes addresses from the front of the list until a connect could be
+   started, passing data and early on to connect_start(). returns the fd,
+   or -1 with errno of the last failure. */
+static int connect_next(struct dnsresult *list, const void *data, size_t *early) {
+	int fd = -1;
+	while(fd == -1 && list->n) {
+		union sockaddr_union addr = list->addr[0];
+		memmove(&list->addr[0], &list->addr[1], --list->n * sizeof addr);
+		fd = connect_start(&addr, data, early);
+	}
+	return fd;
+}
+
+/* happy eyeballs: a new connection attempt to the next address is
+   started every HE_DELAY ms, or right away when all pending ones failed.
+   the first attempt to succeed wins. returns the connected, blocking fd
+   or -1 with errno set. data and early are as for connect_start(). */
+static int connect_race(struct dnsresult *list, const void *data, size_t *early) {
+	struct pollfd fds[DNS_MAXADDRS];
+	unsigned i, nfds = 0;
+	int fd = -1, err = EHOSTUNREACH;
+	long long t = now_ms(), next_start = t;
+	long long deadline = connect_timeout ? t + connect_timeout : 0;
+	while(1) {
+		int timeout;
+		t = now_ms();
+		if(list->n && (!nfds || t >= next_start)) {
+			if((fd = connect_next(list, data, early)) == -1) err = errno;
+			else {
+				fds[nfds++] = (struct pollfd) {.fd = fd, .events = POLLOUT};
+				next_start = t + HE_DELAY;
+			}
+			continue;
+		}
+		if(!nfds) break;
+		if(deadline && t >= deadline) {
+			err = ETIMEDOUT;
 			break;
-		case 3: /* dns name */
-			l = buf[4];
-			minlen = 4 + 2 + l + 1;
-			if(n < 4 + 2 + l + 1) return -EC_GENERAL_FAILURE;
-			memcpy(namebuf, buf+4+1, l);
-			namebuf[l] = 0;
+		}
+		timeout = list->n ? next_start - t : -1;
+		if(deadline && (timeout == -1 || deadline - t < timeout))
+			timeout = deadline - t;
+		if(poll(fds, nfds, timeout) == -1) {
+			if(errno == EINTR) continue;
+			err = errno;
 			break;
-		default:
-			return -EC_ADDRESSTYPE_NOT_SUPPORTED;
-	}
-	unsigned short port;
-	port = (buf[minlen-2] << 8) | buf[minlen-1];
-	/* there's no suitable errorcode in rfc1928 for dns lookup failure */
-	if(resolve(namebuf, port, &remote)) return -EC_GENERAL_FAILURE;
-	struct addrinfo* raddr = addr_choose(remote, &bind_addr);
-	int fd = socket(raddr->ai_family, SOCK_STREAM, 0);
-	if(fd == -1) {
-		eval_errno:
-		if(fd != -1) close(fd);
-		freeaddrinfo(remote);
-		switch(errno) {
-			case ETIMEDOUT:
-				return -EC_TTL_EXPIRED;
-			case EPROTOTYPE:
-			case EPROTONOSUPPORT:
-			case EAFNOSUPPORT:
-				return -EC_ADDRESSTYPE_NOT_SUPPORTED;
-			case ECONNREFUSED:
-				return -EC_CONN_REFUSED;
-			case ENETDOWN:
-			case ENETUNREACH:
-				return -EC_NET_UNREACHABLE;
-			case EHOSTUNREACH:
-				return -EC_HOST_UNREACHABLE;
-			case EBADF:
-			default:
-			perror("socket/connect");
-			return -EC_GENERAL_FAILURE;
+		}
+		for(i=0; i<nfds; ) {
+			if(!fds[i].revents) {
+				i++;
+				continue;
+			}
+			int e = 0;
+			socklen_t l = sizeof e;
+			if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &e, &l)) e = errno;
+			if(!e) goto won;
+			err = e;
+			close(fds[i].fd);
+			fds[i] = fds[--nfds];
+			next_start = t; /* don't wait for the delay to pass */
 		}
 	}
-	if(SOCKADDR_UNION_AF(&bind_addr) == raddr->ai_family &&
-	   bindtoip(fd, &bind_addr) == -1)
-		goto eval_errno;
-	if(connect(fd, raddr->ai_addr, raddr->ai_addrlen) == -1)
-		goto eval_errno;
-
-	freeaddrinfo(remote);
-	if(CONFIG_LOG) {
-		char clientname[256];
-		af = SOCKADDR_UNION_AF(&client->addr);
-		void *ipdata = SOCKADDR_UNION_ADDRESS(&client->addr);
-		inet_ntop(af, ipdata, clientname, sizeof clientname);
-		dolog("client[%d] %s: connected to %s:%d\n", client->fd, clientname, namebuf, port);
-	}
+	for(i=0; i<nfds; i++) close(fds[i].fd);
+	errno = err;
+	return -1;
+won:
+	fd = fds[i].fd;
+	fds[i] = fds[--nfds];
+	for(i=0; i<nfds; i++) close(fds[i].fd);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 	return fd;
 }
 
-static int is_authed(union sockaddr_union *client, union sockaddr_union *authedip) {
-	int af = SOCKADDR_UNION_AF(authedip);
-	if(af == SOCKADDR_UNION_AF(client)) {
-		size_t cmpbytes = af == AF_INET ? 4 : 16;
-		void *cmp1 = SOCKADDR_UNION_ADDRESS(client);
-		void *cmp2 = SOCKADDR_UNION_ADDRESS(authedip);
-		if(!memcmp(cmp1, cmp2, cmpbytes)) return 1;
+static enum errorcode errno_to_ec(int err) {
+	switch(err) {
+		case ETIMEDOUT:
+			return EC_TTL_EXPIRED;
+		case EPROTOTYPE:
+		case EPROTONOSUPPORT:
+		case EAFNOSUPPORT:
+			return EC_ADDRESSTYPE_NOT_SUPPORTED;
+		case ECONNREFUSED:
+			return EC_CONN_REFUSED;
+		case ENETDOWN:
+		case ENETUNREACH:
+			return EC_NET_UNREACHABLE;
+		case EHOSTUNREACH:
+			return EC_HOST_UNREACHABLE;
+		case EBADF:
+		default:
+			errno = err;
+			perror("socket/connect");
+			return EC_GENERAL_FAILURE;
 	}
-	return 0;
 }
 
-static int is_in_authed_list(union sockaddr_union *caddr) {
-	size_t i;
-	for(i=0;i<sblist_getsize(auth_ips);i++)
-		if(is_authed(caddr, sblist_get(auth_ips, i)))
-			return 1;
-	return 0;
+/* connects to one of the addresses of remote, or reports the failed
+   lookup of name, the rest as for connect_socks_target(). name is 0 for
+   literal addresses. */
+static int connect_resolved(struct client *client, const char *name, unsigned short port, int err, struct dnsresult *remote, struct dnsresult *pending, const unsigned char *data, size_t *early) {
+	size_t avail = *early;
+	int fd;
+	*early = 0;
+	if(err) {
+		/* there's no suitable errorcode in rfc1928 for dns lookup failure */
+		if(CONFIG_LOG) alog_connect(client, name, port, 0, EC_GENERAL_FAILURE);
+		return -EC_GENERAL_FAILURE;
+	}
+	/* formatting the target is left to the log writer */
+	union sockaddr_union literal = remote->addr[0];
+	addr_order(remote, srcpool_family());
+	/* data in a SYN can't be taken back. with several addresses to race
+	   it could end up at more than one target, so it's only sent to one. */
+	if(remote->n == 1) *early = avail;
+	if(pending) {
+		*pending = *remote;
+		fd = connect_next(pending, data, early);
+	} else {
+		long long t = now_us();
+		fd = connect_race(remote, data, early);
+		if(fd != -1) metric_observe(H_CONNECT, now_us() - t);
+	}
+	int ec = fd == -1 ? errno_to_ec(errno) : EC_SUCCESS;
+	if(CONFIG_LOG) alog_connect(client, name, port, &literal, ec);
+	return fd == -1 ? -ec : fd;
 }
 
-static void add_auth_ip(union sockaddr_union *caddr) {
-	sblist_add(auth_ips, caddr);
+/* returned by connect_socks_target() when the target is being looked up */
+#define CONNECT_RESOLVING (-256)
+
+/* if pending is set, the returned fd is in non-blocking mode and the
+   connect() may still be in progress; the caller has to wait for it to
+   become writable and check SO_ERROR. the addresses not tried yet are
+   left in pending, to continue with connect_next() on failure.
+   *early bytes of data the client sent after buf may go out with the
+   SYN, *early is set to how many did.
+   if job is set, names that aren't cached aren't looked up here. a job
+   for the resolver is put in *job and CONNECT_RESOLVING returned, the
+   caller goes on with connect_resolved() once it's done. */
+static int connect_socks_target(const unsigned char *buf, const struct s5request *req, struct client *client, struct dnsresult *pending, size_t *early, struct dnsjob **job) {
+	const struct s5addr *a = &req->addr;
+	unsigned short port = a->port;
+	char namebuf[256];
+	struct dnsresult remote;
+
+	if(a->type == S5_NAME) {
+		memcpy(namebuf, a->p, a->len);
+		namebuf[a->len] = 0;
+	} else {
+		/* literal addresses don't need to go through the resolver */
+		memset(&remote, 0, sizeof remote);
+		remote.n = 1;
+		if(a->type == S5_IPV4) {
+			remote.addr[0].v4.sin_family = AF_INET;
+			remote.addr[0].v4.sin_port = htons(port);
+			memcpy(&remote.addr[0].v4.sin_addr, a->p, 4);
+		} else {
+			remote.addr[0].v6.sin6_family = AF_INET6;
+			remote.addr[0].v6.sin6_port = htons(port);
+			memcpy(&remote.addr[0].v6.sin6_addr, a->p, 16);
+		}
+	}
+	int fd, err = 0;
+	if(upstream) {
+		/* the request goes to the parent as is, names included */
+		long long t = now_us();
+		*early = 0;
+		fd = upstream_connect(buf, req->len);
+		if(fd >= 0) metric_observe(H_CONNECT, now_us() - t);
+		if(CONFIG_LOG) alog_connect(client, a->type == S5_NAME ? namebuf : 0, port, &remote.addr[0], fd < 0 ? -fd : EC_SUCCESS);
+		return fd;
+	}
+	if(a->type == S5_NAME && !(job && dns_cached(namebuf, port, &remote, &err))) {
+		if(job) {
+			if(!(*job = malloc(sizeof **job))) {
+				*early = 0;
+				return -EC_GENERAL_FAILURE;
+			}
+			memcpy((*job)->host, namebuf, a->len + 1);
+			(*job)->port = port;
+			return CONNECT_RESOLVING;
+		}
+		long long t = now_us();
+		err = dns_lookup(namebuf, port, &remote);
+		metric_observe(H_DNS, now_us() - t);
+	}
+	return connect_resolved(client, a->type == S5_NAME ? namebuf : 0, port, err, &remote, pending, buf + req->len, early);
 }
 
-static enum authmethod check_auth_method(unsigned char *buf, size_t n, struct client*client) {
-	if(buf[0] != 5) return AM_INVALID;
-	size_t idx = 1;
-	if(idx >= n ) return AM_INVALID;
-	int n_methods = buf[idx];
-	idx++;
-	while(idx < n && n_methods > 0) {
-		if(buf[idx] == AM_NO_AUTH) {
-			if(!auth_user) return AM_NO_AUTH;
+static enum authmethod check_auth_method(const struct s5greeting *g, struct client *client) {
+	unsigned i;
+	for(i=0; i<g->n_methods; i++) {
+		if(g->methods[i] == AM_NO_AUTH) {
+			if(!need_auth) return AM_NO_AUTH;
 			else if(auth_ips) {
-				int authed = 0;
-				if(pthread_rwlock_rdlock(&auth_ips_lock) == 0) {
-					authed = is_in_authed_list(&client->addr);
-					pthread_rwlock_unlock(&auth_ips_lock);
-				}
-				if(authed) return AM_NO_AUTH;
+				if(whitelist_match(&client->addr) ||
+				   authonce_match(&client->addr))
+					return AM_NO_AUTH;
 			}
-		} else if(buf[idx] == AM_USERNAME) {
-			if(auth_user) return AM_USERNAME;
+		} else if(g->methods[i] == AM_USERNAME) {
+			if(need_auth) return AM_USERNAME;
 		}
-		idx++;
-		n_methods--;
 	}
 	return AM_INVALID;
 }
 
-static void send_auth_response(int fd, int version, enum authmethod meth) {
+static void hs_reply(struct hsbuf *hs, const void *data, size_t n) {
+	if(hs->outlen + n > sizeof hs->out) return;
+	memcpy(hs->out + hs->outlen, data, n);
+	hs->outlen += n;
+}
+
+/* sends all queued replies with a single write. */
+static void hs_flush(int fd, struct hsbuf *hs) {
+	if(hs->outlen) write(fd, hs->out, hs->outlen);
+	hs->outlen = 0;
+}
+
+static void send_auth_response(struct hsbuf *hs, int version, enum authmethod meth) {
 	unsigned char buf[2];
 	buf[0] = version;
 	buf[1] = meth;
-	write(fd, buf, 2);
+	hs_reply(hs, buf, 2);
 }
 
-static void send_error(int fd, enum errorcode ec) {
+static void queue_error(struct hsbuf *hs, enum errorcode ec) {
 	/* position 4 contains ATYP, the address type, which is the same as used in the connect
 	   request. we're lazy and return always IPV4 address type in errors. */
+	unsigned char buf[10] = { 5, ec, 0, 1 /*AT_IPV4*/, 0,0,0,0, 0,0 };
+	hs_reply(hs, buf, 10);
+}
+
+static void send_error(int fd, enum errorcode ec) {
 	char buf[10] = { 5, ec, 0, 1 /*AT_IPV4*/, 0,0,0,0, 0,0 };
 	write(fd, buf, 10);
 }
 
-static void copyloop(int fd1, int fd2) {
+/* reports the connect timeout expiring during the lookup of job */
+static void lookup_timedout(struct client *client, const struct dnsjob *job) {
+	metric_inc(M_HS_FAILURE + EC_TTL_EXPIRED);
+	if(CONFIG_LOG) alog_connect(client, job->host, job->port, 0, EC_TTL_EXPIRED);
+	if(!optimistic) send_error(client->fd, EC_TTL_EXPIRED);
+}
+
+#if CONFIG_UDP
+/* reply with the address of the relay socket */
+static void send_reply(struct hsbuf *hs, union sockaddr_union *addr) {
+	unsigned char buf[4+16+2] = {5, EC_SUCCESS, 0};
+	unsigned short port = SOCKADDR_UNION_PORT(addr);
+	size_t n;
+	if(SOCKADDR_UNION_AF(addr) == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&addr->v6.sin6_addr)) {
+		/* dual-stack listener, the client talks ipv4 */
+		buf[3] = 1;
+		memcpy(buf+4, addr->v6.sin6_addr.s6_addr+12, 4);
+		n = 8;
+	} else if(SOCKADDR_UNION_AF(addr) == AF_INET) {
+		buf[3] = 1;
+		memcpy(buf+4, &addr->v4.sin_addr, 4);
+		n = 8;
+	} else {
+		buf[3] = 4;
+		memcpy(buf+4, &addr->v6.sin6_addr, 16);
+		n = 20;
+	}
+	memcpy(buf+n, &port, 2);
+	hs_reply(hs, buf, n+2);
+}
+
+/* handles a UDP ASSOCIATE request: opens the relay socket and tells the
+   client its address. returns the socket or -errorcode. */
+static int udp_socks_associate(const struct s5request *req, struct client *client, struct hsbuf *hs) {
+	union sockaddr_union declared = {.v4.sin_family = AF_UNSPEC}, relay;
+	/* the address the client will send from. names don't help with
+	   that, so they're treated like an unspecified address. */
+	if(req->addr.type == S5_IPV4) {
+		declared.v4.sin_family = AF_INET;
+		memcpy(&declared.v4.sin_addr, req->addr.p, 4);
+		declared.v4.sin_port = htons(req->addr.port);
+	} else if(req->addr.type == S5_IPV6) {
+		declared.v6.sin6_family = AF_INET6;
+		memcpy(&declared.v6.sin6_addr, req->addr.p, 16);
+		declared.v6.sin6_port = htons(req->addr.port);
+	}
+	int fd = udp_open(client->fd, &client->addr, &declared, &relay);
+	if(fd == -1) return -EC_GENERAL_FAILURE;
+	send_reply(hs, &relay);
+	return fd;
+}
+
+static void udp_serve(struct client *client, int udpfd) {
+	struct conntimer to = {0};
+	metric_inc(M_UDP_ASSOCIATIONS);
+	if(CONFIG_LOG) alog_udp(client);
+	/* shuts down the tcp connection, which ends the association */
+	ct_arm(&to, CT_IDLE, client, -1);
+	udp_relay(client->fd, udpfd, &client->addr, &to);
+	ct_cancel(&to);
+}
+#endif
+
+#if CONFIG_SPLICE
+/* creates a pipe for splice_relay(), large enough for relay_bufsize. */
+static int relay_pipe(int p[2], int flags) {
+	if(pipe2(p, O_CLOEXEC|flags)) return -1;
+	/* may exceed /proc/sys/fs/pipe-max-size, the default size works too */
+	if(relay_bufsize > SPLICE_SIZE) fcntl(p[1], F_SETPIPE_SZ, (int) relay_bufsize);
+	return 0;
+}
+
+/* moves data from infd to outfd through the pipe p using splice(2), so
+   it never gets copied to userspace. returns the number of bytes moved,
+   0 on EOF, -1 on error, -2 if splice isn't supported for these fds,
+   or -3 if there was nothing to move. at most max bytes are moved. */
+static ssize_t splice_relay(int infd, int outfd, int p[2], size_t max) {
+	ssize_t sent = 0, n;
+	n = splice(infd, 0, p[1], 0, max, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if(n < 0) switch(errno) {
+		case EINVAL: case ENOSYS:
+			return -2;
+		case EAGAIN: case EINTR:
+			return -3; /* spurious wakeup, nothing moved yet */
+		default:
+			return -1;
+	}
+	while(sent < n) {
+		/* the pipe has data, so this blocks only on outfd, like write() */
+		ssize_t m = splice(p[0], 0, outfd, 0, n-sent, SPLICE_F_MOVE);
+		if(m <= 0) return -1;
+		sent += m;
+	}
+	return n;
+}
+
+static void splice_unsupported(void) {
+	if(relay_engine == RE_SPLICE) {
+		relay_engine = RE_READWRITE;
+		dolog("splice() not supported, falling back to read/write relay\n");
+	}
+}
+#endif
+
+/* adaptive relay sizing: each side of a tunnel starts out moving
+   ADAPT_MIN bytes at once. every read that fills what was asked for
+   doubles that, up to the maximum, and a run of reads that only get a
+   fraction of it halves it again. bulk transfers soon move the most per
+   syscall, interactive flows are passed on in the small pieces they come
+   in. without -S adaptive the maximum is always used. */
+#define ADAPT_MIN 2048
+#define ADAPT_SHORT_READS 4
+struct adapt {
+	unsigned size, shorts;
+};
+
+/* how much to read from a side, at most max, also going by the rate limit. */
+static size_t read_size(struct adapt *a, struct rltunnel *rl, size_t max) {
+	if(adaptive) {
+		if(!a->size) a->size = ADAPT_MIN;
+		max = MIN(max, a->size);
+	}
+	return rl ? rl_quantum(rl, max) : max;
+}
+
+/* n bytes were read after asking for asked. */
+static void adapt_update(struct adapt *a, size_t n, size_t asked, size_t max) {
+	if(!adaptive) return;
+	if(n >= asked && asked == a->size) {
+		a->shorts = 0;
+		if(a->size < max) a->size = MIN(a->size * 2, max);
+	} else if(n >= a->size / 4)
+		a->shorts = 0;
+	else if(++a->shorts == ADAPT_SHORT_READS) {
+		a->shorts = 0;
+		if(a->size > ADAPT_MIN) a->size /= 2;
+	}
+}
+
+/* a side over its rate limit isn't polled until it may read again */
+static void cl_charge(struct rltunnel *rl, struct pollfd *fds, long long resume[2], int side, size_t n) {
+	long long d = rl_charge(rl, side, n);
+	if(d) {
+		resume[side] = now_us() + d;
+		fds[side].fd = -1;
+	}
+}
+
+/* bytes[0] and [1] count what was relayed from fd1 and fd2 respectively.
+   inactive tunnels are shut down by the idle timeout of to. */
+static void copyloop(int fd1, int fd2, unsigned long long bytes[2], struct rltunnel *rl, struct conntimer *to) {
 	struct pollfd fds[2] = {
 		[0] = {.fd = fd1, .events = POLLIN},
 		[1] = {.fd = fd2, .events = POLLIN},
 	};
+	int p[2] = {-1, -1}, i;
+	long long resume[2] = {0, 0};
+	struct adapt ad[2] = {{0}};
+#if CONFIG_SPLICE
+	if(relay_engine == RE_SPLICE && relay_pipe(p, 0))
+		p[0] = p[1] = -1;
+#endif
 
 	while(1) {
-		/* inactive connections are reaped after 15 min to free resources.
-		   usually programs send keep-alive packets so this should only happen
-		   when a connection is really unused. */
-		switch(poll(fds, 2, 60*15*1000)) {
+		int timeout = -1;
+		for(i=0; i<2; i++) if(resume[i]) {
+			long long d = resume[i] - now_us();
+			if(d <= 0) {
+				resume[i] = 0;
+				fds[i].fd = i ? fd2 : fd1;
+			} else if(timeout == -1 || d / 1000 + 1 < timeout)
+				timeout = d / 1000 + 1;
+		}
+		switch(poll(fds, 2, timeout)) {
 			case 0:
-				return;
+				continue;
 			case -1:
 				if(errno == EINTR || errno == EAGAIN) continue;
 				else perror("poll");
-				return;
+				goto out;
+		}
+		int side = (fds[0].revents & POLLIN) || !fds[1].revents ? 0 : 1;
+		int infd = side ? fd2 : fd1;
+		int outfd = side ? fd1 : fd2;
+#if CONFIG_SPLICE
+		if(p[0] != -1) {
+			size_t max = MAX(relay_bufsize, SPLICE_SIZE), want = read_size(&ad[side], rl, max);
+			ssize_t n = splice_relay(infd, outfd, p, want);
+			if(n > 0) {
+				adapt_update(&ad[side], n, want, max);
+				metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, n);
+				bytes[side] += n;
+				ct_touch(to);
+				if(rl) cl_charge(rl, fds, resume, side, n);
+				continue;
+			}
+			if(n == -3) continue;
+			if(n != -2) goto out;
+			splice_unsupported();
+			close(p[0]);
+			close(p[1]);
+			p[0] = p[1] = -1;
 		}
-		int infd = (fds[0].revents & POLLIN) ? fd1 : fd2;
-		int outfd = infd == fd2 ? fd1 : fd2;
-		/* since the biggest stack consumer in the entire code is
-		   libc's getaddrinfo(), we can safely use at least half the
-		   available stacksize to improve throughput. */
-		char buf[MIN(16*1024, THREAD_STACK_SIZE/2)];
-		ssize_t sent = 0, n = read(infd, buf, sizeof buf);
-		if(n <= 0) return;
-		while(sent < n) {
+#endif
+		/* the buffer is only taken while data is in flight, so idle
+		   tunnels don't hold any. when the budget is exhausted this
+		   waits, and the kernel pushes back on the sender meanwhile. */
+		char *buf = buf_get(1);
+		if(!buf) goto out;
+		size_t want = read_size(&ad[side], rl, relay_bufsize);
+		ssize_t sent = 0, n = read(infd, buf, want);
+		if(n > 0) {
+			adapt_update(&ad[side], n, want, relay_bufsize);
+			metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, n);
+			bytes[side] += n;
+			ct_touch(to);
+			if(rl) cl_charge(rl, fds, resume, side, n);
+		}
+		while(n > 0 && sent < n) {
 			ssize_t m = write(outfd, buf+sent, n-sent);
-			if(m < 0) return;
+			if(m < 0) break;
 			sent += m;
 		}
+		buf_put(buf);
+		if(n <= 0 || sent < n) goto out;
+	}
+out:
+	if(p[0] != -1) {
+		close(p[0]);
+		close(p[1]);
+	}
+}
+
+#if CONFIG_SOCKMAP
+/* sockets in the sockmap without -L */
+#ifndef SOCKMAP_SIZE
+#define SOCKMAP_SIZE 65536
+#endif
+/* how often the byte counts of an offloaded tunnel are taken, in ms */
+#define OFFLOAD_TICK_MS 1000
+/* how long to wait at most for the kernel to pass on what it relayed
+   before a tunnel is closed, in ms */
+#define OFFLOAD_FLUSH_MS 1000
+
+/* takes the bytes the kernel relayed since the last call into account. */
+static void offload_count(struct smtunnel *t, unsigned long long seen[2], unsigned long long bytes[2], struct conntimer *to) {
+	unsigned long long now[2];
+	int side;
+	sockmap_bytes(t, now);
+	for(side=0; side<2; side++) if(now[side] != seen[side]) {
+		metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, now[side] - seen[side]);
+		bytes[side] += now[side] - seen[side];
+		seen[side] = now[side];
+		ct_touch(to);
+	}
+}
+
+/* like copyloop(), but the tunnel is relayed by the kernel, so this
+   only waits for either side to hang up and takes the byte counts from
+   the sockmap now and then. what the kernel leaves to userspace is still
+   relayed here. returns -1 if the tunnel couldn't be offloaded. */
+static int offloadloop(int fd1, int fd2, unsigned long long bytes[2], struct conntimer *to) {
+	struct pollfd fds[2] = {
+		[0] = {.fd = fd1, .events = POLLIN},
+		[1] = {.fd = fd2, .events = POLLIN},
+	};
+	unsigned long long start[2] = {bytes[0], bytes[1]}, seen[2] = {0, 0};
+	struct smtunnel t;
+	int i, eof = 0;
+	if(sockmap_add(&t, fd1, fd2)) {
+		metric_inc(M_OFFLOAD_FAILED);
+		return -1;
+	}
+	metric_inc(M_OFFLOADED);
+	while(1) {
+		int n = poll(fds, 2, OFFLOAD_TICK_MS);
+		offload_count(&t, seen, bytes, to);
+		if(n == -1 && errno != EINTR && errno != EAGAIN) break;
+		if(n <= 0) continue;
+		int side = fds[0].revents ? 0 : 1;
+		int outfd = side ? fd1 : fd2;
+		char *buf = buf_get(1);
+		if(!buf) break;
+		ssize_t sent = 0, m = recv(side ? fd2 : fd1, buf, relay_bufsize, MSG_DONTWAIT);
+		if(m > 0) {
+			metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, m);
+			bytes[side] += m;
+			ct_touch(to);
+		}
+		while(m > 0 && sent < m) {
+			ssize_t w = write(outfd, buf+sent, m-sent);
+			if(w < 0) break;
+			sent += w;
+		}
+		buf_put(buf);
+		if(m < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+		eof = !m;
+		if(m <= 0 || sent < m) break;
+	}
+	/* the kernel may still be passing on data it took before the eof,
+	   which would be lost when the sockets are closed. */
+	for(i=0; eof && !ct_fired(to) && i<OFFLOAD_FLUSH_MS; i++) {
+		unsigned long long moved[2];
+		offload_count(&t, seen, bytes, to);
+		moved[0] = bytes[0] - start[0];
+		moved[1] = bytes[1] - start[1];
+		if(sockmap_flushed(&t, moved)) break;
+		usleep(1000);
 	}
+	sockmap_del(&t);
+	return 0;
 }
+#endif
 
-static enum errorcode check_credentials(unsigned char* buf, size_t n) {
-	if(n < 5) return EC_GENERAL_FAILURE;
-	if(buf[0] != 1) return EC_GENERAL_FAILURE;
-	unsigned ulen, plen;
-	ulen=buf[1];
-	if(n < 2 + ulen + 2) return EC_GENERAL_FAILURE;
-	plen=buf[2+ulen];
-	if(n < 2 + ulen + 1 + plen) return EC_GENERAL_FAILURE;
-	char user[256], pass[256];
-	memcpy(user, buf+2, ulen);
-	memcpy(pass, buf+2+ulen+1, plen);
-	user[ulen] = 0;
-	pass[plen] = 0;
-	if(!strcmp(user, auth_user) && !strcmp(pass, auth_pass)) return EC_SUCCESS;
+static enum errorcode check_credentials(const struct s5auth *a, const char **user) {
+	if(!userdb_check(a->user, a->ulen, a->pass, a->plen, user)) return EC_SUCCESS;
 	return EC_NOT_ALLOWED;
 }
 
-static int handshake(struct thread *t) {
-	unsigned char buf[1024];
-	ssize_t n;
+/* the messages of the handshake, as parsed from hsbuf */
+union s5msg {
+	struct s5greeting greeting;
+	struct s5auth auth;
+	struct s5request request;
+};
+
+/* processes a single handshake message received from the client, m
+   as parsed from buf with status st. returns the fd of the target
+   connection when done, -1 on error, -2 if more messages are expected,
+   or -3 if the target is looked up by hs->job, in the non-blocking modes. */
+static int handshake_step(struct client *client, enum socksstate *state, struct hsbuf *hs, const unsigned char *buf, enum s5status st, const union s5msg *m, struct dnsresult *pending) {
 	int ret;
 	enum authmethod am;
-	t->state = SS_1_CONNECTED;
-	while((n = recv(t->client.fd, buf, sizeof buf, 0)) > 0) {
-		switch(t->state) {
-			case SS_1_CONNECTED:
-				am = check_auth_method(buf, n, &t->client);
-				if(am == AM_NO_AUTH) t->state = SS_3_AUTHED;
-				else if (am == AM_USERNAME) t->state = SS_2_NEED_AUTH;
-				send_auth_response(t->client.fd, 5, am);
-				if(am == AM_INVALID) return -1;
-				break;
-			case SS_2_NEED_AUTH:
-				ret = check_credentials(buf, n);
-				send_auth_response(t->client.fd, 1, ret);
-				if(ret != EC_SUCCESS)
-					return -1;
-				t->state = SS_3_AUTHED;
-				if(auth_ips && !pthread_rwlock_wrlock(&auth_ips_lock)) {
-					if(!is_in_authed_list(&t->client.addr))
-						add_auth_ip(&t->client.addr);
-					pthread_rwlock_unlock(&auth_ips_lock);
-				}
-				break;
-			case SS_3_AUTHED:
-				ret = connect_socks_target(buf, n, &t->client);
+	switch(*state) {
+		case SS_1_CONNECTED:
+			am = st == S5_DONE ? check_auth_method(&m->greeting, client) : AM_INVALID;
+			metric_inc(am == AM_NO_AUTH ? M_AUTH_NONE : am == AM_USERNAME ? M_AUTH_USERNAME : M_AUTH_INVALID);
+			if(am == AM_NO_AUTH) *state = SS_3_AUTHED;
+			else if (am == AM_USERNAME) *state = SS_2_NEED_AUTH;
+			send_auth_response(hs, 5, am);
+			if(am == AM_INVALID) return -1;
+			break;
+		case SS_2_NEED_AUTH:
+			ret = st == S5_DONE ? check_credentials(&m->auth, &client->user) : EC_GENERAL_FAILURE;
+			send_auth_response(hs, 1, ret);
+			if(ret != EC_SUCCESS) {
+				/* wrong credentials are not_allowed, garbage is told apart */
+				metric_inc(st == S5_DONE ? M_HS_FAILURE + EC_NOT_ALLOWED : M_HS_MALFORMED_AUTH);
+				return -1;
+			}
+			*state = SS_3_AUTHED;
+			if(auth_once) authonce_add(&client->addr);
+			break;
+		case SS_3_AUTHED:
+			ret = st == S5_DONE ? EC_SUCCESS : m->request.error;
+			if(!ret && admit_tunnel(client)) ret = EC_GENERAL_FAILURE;
+			/* we support only CONNECT, and UDP ASSOCIATE */
+			if(!ret && m->request.cmd != S5_CONNECT &&
+			   (!CONFIG_UDP || m->request.cmd != S5_UDP_ASSOCIATE))
+				ret = EC_COMMAND_NOT_SUPPORTED;
+			if(ret) {
+				metric_inc(M_HS_FAILURE + ret);
+				queue_error(hs, ret);
+				return -1;
+			}
+#if CONFIG_UDP
+			if(m->request.cmd == S5_UDP_ASSOCIATE) {
+				ret = udp_socks_associate(&m->request, client, hs);
 				if(ret < 0) {
-					send_error(t->client.fd, ret*-1);
+					metric_inc(M_HS_FAILURE - ret);
+					queue_error(hs, -ret);
 					return -1;
 				}
-				send_error(t->client.fd, EC_SUCCESS);
+				*state = SS_6_UDP_ASSOCIATED;
 				return ret;
-		}
+			}
+#endif
+			if(optimistic) {
+				/* report success before connecting, which saves the client
+				   a round trip. if it fails, the client is just closed. */
+				queue_error(hs, EC_SUCCESS);
+				hs_flush(client->fd, hs);
+			}
+			hs->synlen = hs->buf + hs->len - (buf + m->request.len);
+			ret = connect_socks_target(buf, &m->request, client, pending, &hs->synlen, pending ? &hs->job : 0);
+			if(ret == CONNECT_RESOLVING) return -3;
+			if(ret < 0) {
+				metric_inc(M_HS_FAILURE - ret);
+				if(!optimistic) queue_error(hs, ret*-1);
+				return -1;
+			}
+			/* in non-blocking mode, success is reported once connect() finished */
+			if(!pending && !optimistic) queue_error(hs, EC_SUCCESS);
+			return ret;
+		default:
+			return -1;
+	}
+	return -2;
+}
+
+/* parses the message expected in state at the start of buf, setting
+   its length in *len. */
+static enum s5status parse_msg(enum socksstate state, const unsigned char *buf, size_t n, union s5msg *m, size_t *len) {
+	enum s5status st;
+	switch(state) {
+		case SS_1_CONNECTED:
+			st = s5_greeting(buf, n, &m->greeting);
+			*len = m->greeting.len;
+			return st;
+		case SS_2_NEED_AUTH:
+			st = s5_auth(buf, n, &m->auth);
+			*len = m->auth.len;
+			return st;
+		case SS_3_AUTHED:
+			st = s5_request(buf, n, &m->request);
+			*len = m->request.len;
+			return st;
+		default:
+			*len = n;
+			return S5_ERROR;
+	}
+}
+
+/* runs all complete messages in hs->buf through handshake_step() and
+   sends the replies. whatever follows the last message stays in hs->buf,
+   after a CONNECT that's early data for the target. the handshake timeout
+   to ends once the request arrived. returns like handshake_step(). */
+static int handshake_feed(struct client *client, enum socksstate *state, struct hsbuf *hs, struct dnsresult *pending, struct conntimer *to) {
+	size_t off = 0, l;
+	union s5msg m;
+	enum s5status st;
+	int ret = -2;
+	while(ret == -2 && (st = parse_msg(*state, hs->buf + off, hs->len - off, &m, &l)) != S5_NEED_MORE) {
+		if(*state == SS_3_AUTHED) ct_cancel(to);
+		ret = handshake_step(client, state, hs, hs->buf + off, st, &m, pending);
+		off += st == S5_DONE ? l : hs->len - off;
+	}
+	hs->len -= off;
+	memmove(hs->buf, hs->buf + off, hs->len);
+	if(ret == -2 && hs->len == sizeof hs->buf) ret = -1;
+	hs_flush(client->fd, hs);
+	return ret;
+}
+
+/* sends the data the client pipelined behind its request to the target,
+   except what went out with the SYN. it's at most HS_BUFSIZE, which the
+   send buffer of a new connection always takes at once. */
+static int send_early_data(int fd, struct hsbuf *hs, unsigned long long *up) {
+	size_t n = hs->len - hs->synlen;
+	if(!hs->len) return 0;
+	metric_add(M_BYTES_UP, hs->len);
+	*up += hs->len;
+	if(n && send(fd, hs->buf + hs->synlen, n, 0) != (ssize_t) n) return -1;
+	hs->len = hs->synlen = 0;
+	return 0;
+}
+
+static int handshake(struct thread *t, struct hsbuf *hs, struct conntimer *to) {
+	ssize_t n;
+	int ret;
+	t->state = SS_1_CONNECTED;
+	hs->len = hs->outlen = 0;
+	ct_arm(to, CT_HANDSHAKE, &t->client, -1);
+	while((n = recv(t->client.fd, hs->buf + hs->len, sizeof hs->buf - hs->len, 0)) > 0) {
+		hs->len += n;
+		ret = handshake_feed(&t->client, &t->state, hs, 0, to);
+		if(ret != -2) return ret;
 	}
 	return -1;
 }
 
-static void* clientthread(void *data) {
-	struct thread *t = data;
-	int remotefd = handshake(t);
+static int start_thread(pthread_t *pt, void* (*func)(void*), void *arg) {
+	pthread_attr_t *a = 0, attr;
+	int ret;
+	if(pthread_attr_init(&attr) == 0) {
+		a = &attr;
+		pthread_attr_setstacksize(a, THREAD_STACK_SIZE);
+	}
+	metric_inc(M_THREADS);
+	ret = pthread_create(pt, a, func, arg);
+	if(ret) metric_dec(M_THREADS);
+	if(a) pthread_attr_destroy(&attr);
+	return ret;
+}
+
+static void count_fastopen(int clientfd, int remotefd) {
+	if(!fastopen) return;
+	if(fastopen_used(clientfd)) metric_inc(M_TFO_ACCEPTED);
+	if(fastopen_used(remotefd)) metric_inc(M_TFO_USED);
+}
+
+static void serve_client(struct thread *t) {
+	struct hsbuf hs;
+	struct conntimer to = {0};
+	/* a blocking connect is bounded by connect_race() itself */
+	int remotefd = handshake(t, &hs, &to);
+#if CONFIG_UDP
+	if(remotefd != -1 && t->state == SS_6_UDP_ASSOCIATED)
+		udp_serve(&t->client, remotefd);
+	else
+#endif
 	if(remotefd != -1) {
-		copyloop(t->client.fd, remotefd);
+		unsigned long long bytes[2] = {0};
+		long long start = now_us();
+		struct rltunnel *rl;
+		if(!rl_attach(&t->client, &rl) && !send_early_data(remotefd, &hs, &bytes[0])) {
+			metric_inc(M_TUNNELS);
+			metric_inc(M_TUNNELS_ACTIVE);
+			ct_arm(&to, CT_IDLE, &t->client, remotefd);
+#if CONFIG_SOCKMAP
+			/* rate limits need every transfer to go through userspace */
+			if(!offload || rl || offloadloop(t->client.fd, remotefd, bytes, &to))
+#endif
+			copyloop(t->client.fd, remotefd, bytes, rl, &to);
+			metric_dec(M_TUNNELS_ACTIVE);
+			count_fastopen(t->client.fd, remotefd);
+		}
+		rl_detach(rl);
+		ct_cancel(&to);
 		close(remotefd);
+		if(CONFIG_LOG) alog_close(&t->client, bytes[0], bytes[1], now_us() - start, EC_SUCCESS);
 	}
+	ct_cancel(&to);
+	admit_release(&t->client);
 	close(t->client.fd);
-	t->done = 1;
+}
+
+static void* clientthread(void *data) {
+	struct thread *t = data;
+	serve_client(t);
+	metric_dec(M_THREADS);
+	t->next_done = __atomic_load_n(&done_threads, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&done_threads, &t->next_done, t, 1,
+	                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return 0;
+}
+
+#if CONFIG_UDP
+/* event and io_uring mode hand udp associations to a thread of their own */
+struct udpthread {
+	struct client client;
+	int fd;
+};
+
+static void* udpthread(void *data) {
+	struct udpthread *u = data;
+	udp_serve(&u->client, u->fd);
+	admit_release(&u->client);
+	close(u->client.fd);
+	free(u);
+	metric_dec(M_THREADS);
 	return 0;
 }
 
-static void collect(sblist *threads) {
-	size_t i;
-	for(i=0;i<sblist_getsize(threads);) {
-		struct thread* thread = *((struct thread**)sblist_get(threads, i));
-		if(thread->done) {
-			pthread_join(thread->pt, 0);
-			sblist_delete(threads, i);
-			free(thread);
-		} else
-			i++;
+static int udp_handoff(struct client *client, int fd) {
+	pthread_t pt;
+	struct udpthread *u = malloc(sizeof *u);
+	if(!u) return -1;
+	u->client = *client;
+	u->fd = fd;
+	if(start_thread(&pt, udpthread, u)) {
+		free(u);
+		return -1;
 	}
+	pthread_detach(pt);
+	return 0;
 }
+#endif
 
-static int usage(void) {
-	dprintf(2,
-		"MicroSocks SOCKS5 Server\n"
-		"------------------------\n"
-		"usage: microsocks -1 -q -i listenip -p port -u user -P pass -b bindaddr -w ips\n"
-		"all arguments are optional.\n"
-		"by default listenip is 0.0.0.0 and port 1080.\n\n"
-		"option -q disables logging.\n"
-		"option -b specifies which ip outgoing connections are bound to\n"
-		"option -w allows to specify a comma-separated whitelist of ip addresses,\n"
-		" that may use the proxy without user/pass authentication.\n"
-		" e.g. -w 127.0.0.1,192.168.1.1.1,::1 or just -w 10.0.0.1\n"
-		" to allow access ONLY to those ips, choose an impossible to guess user/pw combo.\n"
-		"option -1 activates auth_once mode: once a specific ip address\n"
-		" authed successfully with user/pass, it is added to a whitelist\n"
-		" and may use the proxy without auth.\n"
-		" this is handy for programs like firefox that don't support\n"
-		" user/pass auth. for it to work you'd basically make one connection\n"
-		" with another program that supports it, and then you can use firefox too.\n"
-	);
-	return 1;
+/* accepted sockets inherit the other options from the listener */
+static void tune_accepted(int fd) {
+	static const struct socktune quickack = {.quickack = 1};
+	if(tune.quickack) socktune_apply(fd, &quickack);
 }
 
-/* prevent username and password from showing up in top. */
-static void zero_arg(char *s) {
-	size_t i, l = strlen(s);
-	for(i=0;i<l;i++) s[i] = 0;
+/* set once the listeners were handed over to a new process with -G */
+static int draining;
+/* accept loops, or io_uring workers, that haven't stopped yet */
+static unsigned accepting;
+
+/* parks an accept loop once it's stopped. the thread is kept around, so
+   the handoff thread can keep signalling all of them until each one is. */
+static void accept_stopped(void) {
+	__atomic_sub_fetch(&accepting, 1, __ATOMIC_SEQ_CST);
+	while(1) pause();
 }
 
-int main(int argc, char** argv) {
-	int ch;
-	const char *listenip = "0.0.0.0";
-	char *p, *q;
-	unsigned port = 1080;
-	while((ch = getopt(argc, argv, ":1qb:i:p:u:P:w:")) != -1) {
-		switch(ch) {
-			case 'w': /* fall-through */
-			case '1':
-				if(!auth_ips)
-					auth_ips = sblist_new(sizeof(union sockaddr_union), 8);
-				if(ch == '1') break;
-				p = optarg;
-				while(1) {
-					union sockaddr_union ca;
-					if((q = strchr(p, ','))) *q = 0;
-					if(resolve_sa(p, 0, &ca)) {
-						dprintf(2, "error: failed to resolve %s\n", p);
-						return 1;
-					}
-					add_auth_ip(&ca);
-					if(q) *(q++) = ',', p = q;
-					else break;
-				}
-				break;
-			case 'q':
-				quiet = 1;
-				break;
-			case 'b':
-				resolve_sa(optarg, 0, &bind_addr);
-				break;
-			case 'u':
-				auth_user = strdup(optarg);
-				zero_arg(optarg);
-				break;
-			case 'P':
-				auth_pass = strdup(optarg);
-				zero_arg(optarg);
-				break;
-			case 'i':
-				listenip = optarg;
-				break;
-			case 'p':
-				port = atoi(optarg);
-				break;
-			case ':':
-				dprintf(2, "error: option -%c requires an operand\n", optopt);
-				/* fall through */
-			case '?':
-				return usage();
+static void accept_failed(void) {
+	int err = errno;
+	metric_inc(M_REJECTED);
+	if(admit_accept_failed(err)) return;
+	dolog("failed to accept connection\n");
+	if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+		usleep(ACCEPT_BACKOFF);
+}
+
+static void collect(void) {
+	struct thread *t = __atomic_exchange_n(&done_threads, 0, __ATOMIC_ACQUIRE);
+	while(t) {
+		struct thread *next = t->next_done;
+		pthread_join(t->pt, 0);
+		free(t);
+		t = next;
+	}
+}
+
+static void pool_push(unsigned i) {
+	unsigned long long old = __atomic_load_n(&pool_idle, __ATOMIC_RELAXED), new;
+	do {
+		__atomic_store_n(&pool[i].next, (unsigned) old, __ATOMIC_RELAXED);
+		new = ((old >> 32) + 1) << 32 | (i + 1);
+	} while(!__atomic_compare_exchange_n(&pool_idle, &old, new, 1,
+	                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* returns index of an idle pool worker, or -1 if all are busy. */
+static int pool_pop(void) {
+	unsigned long long old = __atomic_load_n(&pool_idle, __ATOMIC_ACQUIRE), new;
+	do {
+		unsigned i = old;
+		if(!i) return -1;
+		new = ((old >> 32) + 1) << 32 | __atomic_load_n(&pool[i-1].next, __ATOMIC_RELAXED);
+	} while(!__atomic_compare_exchange_n(&pool_idle, &old, new, 1,
+	                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return (int)(unsigned) old - 1;
+}
+
+static void* poolthread(void *data) {
+	struct poolworker *w = data;
+	while(1) {
+		pthread_mutex_lock(&w->mtx);
+		while(!w->busy) pthread_cond_wait(&w->cond, &w->mtx);
+		pthread_mutex_unlock(&w->mtx);
+		serve_client(&w->t);
+		/* nobody touches w until it's back on the idle stack */
+		w->busy = 0;
+		pool_push(w - pool);
+	}
+	return 0;
+}
+
+static void pool_handoff(struct poolworker *w, struct client *c) {
+	pthread_mutex_lock(&w->mtx);
+	w->t.client = *c;
+	w->busy = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static int pool_start(unsigned n) {
+	unsigned i;
+	if(!(pool = calloc(n, sizeof *pool))) return -1;
+	for(i=0;i<n;i++) {
+		pthread_mutex_init(&pool[i].mtx, 0);
+		pthread_cond_init(&pool[i].cond, 0);
+		if((errno = start_thread(&pool[i].t.pt, poolthread, &pool[i])))
+			return -1;
+		pool_size = i + 1;
+		pool_push(i);
+	}
+	return 0;
+}
+
+#if CONFIG_EPOLL
+/* event mode: instead of spawning a thread per client, a fixed number of
+   workers each drive many non-blocking connections through their own
+   epoll instance. the main thread accepts and hands clients over by adding
+   them to a worker's epoll set, which is safe to do from another thread. */
+
+#define EV_MAXEVENTS 64
+/* how often connections waiting for the buffer budget are retried */
+#define EV_STARVED_MS 10
+
+struct evconn;
+struct evref {
+	struct evconn *c;
+	int side;
+};
+
+struct evconn {
+	struct client client;
+	enum socksstate state;
+	int fd[2]; /* 0: client, 1: remote */
+	/* data read from fd[i] that could not yet be written to fd[!i].
+	   with the splice engine it is kept in pipe[i], otherwise in the
+	   relay buffer pend[i]. */
+	char *pend[2];
+	size_t pendlen[2], pendoff[2];
+	int pipe[2][2];
+	/* until relaying */
+	struct hsbuf *hs;
+	/* when connect() started, once relaying when the tunnel was up */
+	long long t_start;
+	unsigned long long bytes[2]; /* relayed from fd[i] */
+	struct evref ref[2];
+	struct evconn *next_dead;
+	int dead;
+	/* bit i set: reading fd[i] waits for a relay buffer, or until
+	   resume[i] if that's set, as the rate limit was exceeded */
+	int starved;
+	long long resume[2];
+	struct evconn *next_starved;
+	struct rltunnel *rl;
+	struct conntimer to;
+	struct adapt ad[2];
+};
+
+struct evworker {
+	pthread_t pt;
+	int epfd;
+	struct evconn *dead, *starved;
+	struct dnsqueue dnsq; /* lookups done for this worker */
+};
+
+static struct evworker *evworkers;
+static unsigned n_evworkers;
+
+static int ev_ctl(struct evworker *w, int op, struct evconn *c, int side, unsigned events) {
+	struct epoll_event ev = {.events = events, .data.ptr = &c->ref[side]};
+	return epoll_ctl(w->epfd, op, c->fd[side], &ev);
+}
+
+/* recompute the interest set of one side from the pending buffers:
+   we stop reading from a side while its data is still queued, and
+   want writability of a side while data for it is queued. */
+static int ev_update(struct evworker *w, struct evconn *c, int side) {
+	unsigned events = 0;
+	if(c->state == SS_5_RELAYING) {
+		if(!c->pendlen[side] && !(c->starved & (1 << side))) events |= EPOLLIN;
+		if(c->pendlen[!side]) events |= EPOLLOUT;
+	}
+	return ev_ctl(w, EPOLL_CTL_MOD, c, side, events);
+}
+
+static void ev_close_pipes(struct evconn *c) {
+	int i;
+	for(i=0;i<2;i++) if(c->pipe[i][0] != -1) {
+		close(c->pipe[i][0]);
+		close(c->pipe[i][1]);
+		c->pipe[i][0] = c->pipe[i][1] = -1;
+	}
+}
+
+static void ev_close(struct evworker *w, struct evconn *c) {
+	int i;
+	if(c->dead) return;
+	ct_cancel(&c->to);
+	if(c->state == SS_5_RELAYING) {
+		metric_dec(M_TUNNELS_ACTIVE);
+		count_fastopen(c->fd[0], c->fd[1]);
+		if(CONFIG_LOG) alog_close(&c->client, c->bytes[0], c->bytes[1], now_us() - c->t_start, EC_SUCCESS);
+	}
+	for(i=0;i<2;i++) {
+		if(c->fd[i] != -1) close(c->fd[i]);
+		buf_put(c->pend[i]);
+	}
+	/* a handed-off udp client is released by its thread */
+	if(c->fd[0] != -1) admit_release(&c->client);
+	/* a lookup in progress is freed once it's done */
+	if(c->hs && c->hs->job) c->hs->job->arg = 0;
+	free(c->hs);
+	rl_detach(c->rl);
+	ev_close_pipes(c);
+	/* other events for this connection may still be queued in the
+	   current batch, so freeing is deferred until it's processed. */
+	c->dead = 1;
+	c->next_dead = w->dead;
+	w->dead = c;
+}
+
+/* waits for the connect() of fd to the target to finish. */
+static void ev_connecting(struct evworker *w, struct evconn *c, int fd) {
+	c->fd[1] = fd;
+	/* after a lookup, the connect timeout has been running since */
+	if(c->state == SS_4_CONNECTING) {
+		ct_set_remote(&c->to, fd);
+		if(ct_fired(&c->to)) shutdown(fd, SHUT_RDWR);
+	} else ct_arm(&c->to, CT_CONNECT, &c->client, fd);
+	c->state = SS_4_CONNECTING;
+	c->t_start = now_us();
+	/* ignore the client until the outcome of connect() is known */
+	if(ev_ctl(w, EPOLL_CTL_MOD, c, 0, 0) ||
+	   ev_ctl(w, EPOLL_CTL_ADD, c, 1, EPOLLOUT)) {
+		if(!optimistic) send_error(c->fd[0], EC_GENERAL_FAILURE);
+		ev_close(w, c);
+	}
+}
+
+static void ev_handshake(struct evworker *w, struct evconn *c) {
+	struct hsbuf *hs = c->hs;
+	ssize_t n = recv(c->fd[0], hs->buf + hs->len, sizeof hs->buf - hs->len, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if(n <= 0) goto fail;
+	hs->len += n;
+	int ret = handshake_feed(&c->client, &c->state, hs, &hs->pending, &c->to);
+	if(ret == -2) return;
+	if(ret == -3) {
+		/* only a hangup or the connect timeout, which shuts down the
+		   reading side, end the wait for the lookup. */
+		c->state = SS_4_CONNECTING;
+		c->t_start = now_us();
+		ct_arm(&c->to, CT_CONNECT, &c->client, -1);
+		hs->job->arg = c;
+		resolver_submit(&w->dnsq, hs->job);
+		if(ev_ctl(w, EPOLL_CTL_MOD, c, 0, EPOLLRDHUP)) goto fail;
+		return;
+	}
+	if(ret < 0) goto fail;
+#if CONFIG_UDP
+	if(c->state == SS_6_UDP_ASSOCIATED) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd[0], 0);
+		if(udp_handoff(&c->client, ret)) close(ret);
+		else c->fd[0] = -1; /* owned by the udp thread now */
+		goto fail;
+	}
+#endif
+	ev_connecting(w, c, ret);
+	return;
+fail:
+	ev_close(w, c);
+}
+
+/* resumes the connections whose lookups are done. */
+static void ev_resolved(struct evworker *w) {
+	struct dnsjob *j, *next;
+	for(j = dnsqueue_take(&w->dnsq); j; j = next) {
+		struct evconn *c = j->arg;
+		next = j->next;
+		if(c) {
+			struct hsbuf *hs = c->hs;
+			hs->job = 0;
+			metric_observe(H_DNS, now_us() - c->t_start);
+			hs->synlen = hs->len;
+			int ret = connect_resolved(&c->client, j->host, j->port, j->err, &j->res, &hs->pending, hs->buf, &hs->synlen);
+			if(ret < 0) {
+				metric_inc(M_HS_FAILURE - ret);
+				if(!optimistic) send_error(c->fd[0], -ret);
+				ev_close(w, c);
+			} else
+				ev_connecting(w, c, ret);
 		}
+		free(j);
 	}
-	if((auth_user && !auth_pass) || (!auth_user && auth_pass)) {
-		dprintf(2, "error: user and pass must be used together\n");
-		return 1;
+}
+
+static void ev_connected(struct evworker *w, struct evconn *c) {
+	int err = 0;
+	socklen_t l = sizeof err;
+	if(getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &err, &l)) err = errno;
+	if(err) {
+		/* try the remaining addresses one after another, unless the
+		   connect timeout shut this one down */
+		ct_set_remote(&c->to, -1);
+		close(c->fd[1]);
+		errno = ct_fired(&c->to) ? ETIMEDOUT : err;
+		if(!ct_fired(&c->to) && (c->fd[1] = connect_next(&c->hs->pending, 0, 0)) != -1) {
+			ct_set_remote(&c->to, c->fd[1]);
+			/* it may have expired in between, without a target to shut down */
+			if(ct_fired(&c->to)) shutdown(c->fd[1], SHUT_RDWR);
+			if(ev_ctl(w, EPOLL_CTL_ADD, c, 1, EPOLLOUT)) goto fail;
+			return;
+		}
+		err = errno_to_ec(errno);
+		metric_inc(M_HS_FAILURE + err);
+		if(CONFIG_LOG) alog_close(&c->client, 0, 0, now_us() - c->t_start, err);
+		if(!optimistic) send_error(c->fd[0], err);
+		goto fail;
 	}
-	if(auth_ips && !auth_pass) {
-		dprintf(2, "error: -1/-w options must be used together with user/pass\n");
-		return 1;
+	if(!optimistic) send_error(c->fd[0], EC_SUCCESS);
+	long long t = now_us();
+	metric_observe(H_CONNECT, t - c->t_start);
+	c->t_start = t;
+	if(send_early_data(c->fd[1], c->hs, &c->bytes[0]) ||
+	   rl_attach(&c->client, &c->rl)) goto fail;
+	metric_inc(M_TUNNELS);
+	metric_inc(M_TUNNELS_ACTIVE);
+	c->state = SS_5_RELAYING;
+	free(c->hs);
+	c->hs = 0;
+	ct_arm(&c->to, CT_IDLE, &c->client, c->fd[1]);
+#if CONFIG_SPLICE
+	if(relay_engine == RE_SPLICE &&
+	   (relay_pipe(c->pipe[0], O_NONBLOCK) ||
+	    relay_pipe(c->pipe[1], O_NONBLOCK)))
+		ev_close_pipes(c); /* probably out of fds, use buffers instead */
+#endif
+	if(ev_update(w, c, 0) || ev_update(w, c, 1)) goto fail;
+	return;
+fail:
+	ev_close(w, c);
+}
+
+/* write as much as possible of buf to fd. returns bytes written or -1. */
+static ssize_t ev_write(int fd, const char *buf, size_t n) {
+	size_t sent = 0;
+	while(sent < n) {
+		ssize_t m = write(fd, buf+sent, n-sent);
+		if(m < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		sent += m;
 	}
-	signal(SIGPIPE, SIG_IGN);
-	struct server s;
-	sblist *threads = sblist_new(sizeof (struct thread*), 8);
-	if(server_setup(&s, listenip, port)) {
-		perror("server_setup");
-		return 1;
+	return sent;
+}
+
+/* pass data queued from side src on to its peer. returns -1 on error. */
+static int ev_flush(struct evconn *c, int src) {
+	int dst = !src;
+	ssize_t m;
+#if CONFIG_SPLICE
+	if(c->pipe[src][0] != -1) {
+		m = splice(c->pipe[src][0], 0, c->fd[dst], 0, c->pendlen[src], SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if(m < 0 && (errno == EAGAIN || errno == EINTR)) m = 0;
+	} else
+#endif
+	m = ev_write(c->fd[dst], c->pend[src] + c->pendoff[src], c->pendlen[src]);
+	if(m < 0) return -1;
+	c->pendoff[src] += m;
+	c->pendlen[src] -= m;
+	if(!c->pendlen[src]) {
+		buf_put(c->pend[src]);
+		c->pend[src] = 0;
+		c->pendoff[src] = 0;
+	}
+	return 0;
+}
+
+static void ev_starve(struct evworker *w, struct evconn *c, int side) {
+	if(!c->starved) {
+		c->next_starved = w->starved;
+		w->starved = c;
+	}
+	c->starved |= 1 << side;
+}
+
+/* stops reading from side for a while if it exceeded its rate limit */
+static int ev_charge(struct evworker *w, struct evconn *c, int side, size_t n) {
+	long long d = rl_charge(c->rl, side, n);
+	if(!d) return 0;
+	c->resume[side] = now_us() + d;
+	ev_starve(w, c, side);
+	return ev_update(w, c, side);
+}
+
+static void ev_relay(struct evworker *w, struct evconn *c, int side, unsigned events) {
+	int out = !side;
+	ssize_t n, m;
+	char *buf;
+	if((events & (EPOLLERR|EPOLLHUP)) && c->pendlen[side]) goto fail;
+	if((events & EPOLLOUT) && c->pendlen[out]) {
+		/* flush data that was queued for this side */
+		if(ev_flush(c, out)) goto fail;
+		if(c->pendlen[out]) return;
+		if(ev_update(w, c, side) || ev_update(w, c, out)) goto fail;
+	}
+	if(!(events & (EPOLLIN|EPOLLERR|EPOLLHUP)) || c->pendlen[side]) return;
+#if CONFIG_SPLICE
+	if(c->pipe[side][0] != -1) {
+		size_t max = MAX(relay_bufsize, SPLICE_SIZE), want = read_size(&c->ad[side], c->rl, max);
+		n = splice(c->fd[side], 0, c->pipe[side][1], 0, want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if(n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+		   !c->pendlen[out]) {
+			/* nothing was consumed yet, so we can still switch engines */
+			splice_unsupported();
+			ev_close_pipes(c);
+			goto rw;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if(n <= 0) goto fail;
+		adapt_update(&c->ad[side], n, want, max);
+		metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, n);
+		c->bytes[side] += n;
+		ct_touch(&c->to);
+		if(c->rl && ev_charge(w, c, side, n)) goto fail;
+		c->pendlen[side] = n;
+		if(ev_flush(c, side)) goto fail;
+		goto queued;
+	}
+	rw:
+#endif
+	if(!(buf = buf_get(0))) {
+		if(events & EPOLLERR) goto fail;
+		/* stop reading until the budget allows it again */
+		ev_starve(w, c, side);
+		if(ev_update(w, c, side)) goto fail;
+		return;
+	}
+	size_t want = read_size(&c->ad[side], c->rl, relay_bufsize);
+	n = read(c->fd[side], buf, want);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		buf_put(buf);
+		return;
+	}
+	if(n <= 0) {
+		buf_put(buf);
+		goto fail;
+	}
+	adapt_update(&c->ad[side], n, want, relay_bufsize);
+	metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, n);
+	c->bytes[side] += n;
+	ct_touch(&c->to);
+	if(c->rl && ev_charge(w, c, side, n)) {
+		buf_put(buf);
+		goto fail;
+	}
+	m = ev_write(c->fd[out], buf, n);
+	if(m < 0 || m == n) {
+		buf_put(buf);
+		if(m < 0) goto fail;
+		return;
+	}
+	/* keep the rest in the buffer until fd[out] is writable */
+	c->pend[side] = buf;
+	c->pendoff[side] = m;
+	c->pendlen[side] = n - m;
+#if CONFIG_SPLICE
+	queued:
+#endif
+	if(c->pendlen[side] && (ev_update(w, c, side) || ev_update(w, c, out)))
+		goto fail;
+	return;
+fail:
+	ev_close(w, c);
+}
+
+/* lets starved connections read again once buffers are available, or
+   their rate limit allows it. this also drops closed ones from the list
+   before they're freed. */
+static void ev_retry_starved(struct evworker *w) {
+	struct evconn *c, **pp = &w->starved;
+	int avail = buf_available(), side, ready;
+	long long now = now_us();
+	while((c = *pp)) {
+		ready = 0;
+		for(side=0; side<2 && !c->dead; side++) {
+			if(!(c->starved & (1 << side))) continue;
+			if(c->resume[side] ? now >= c->resume[side] : avail) {
+				c->starved &= ~(1 << side);
+				c->resume[side] = 0;
+				ready = 1;
+			}
+		}
+		if(ready && !c->dead && (ev_update(w, c, 0) || ev_update(w, c, 1)))
+			ev_close(w, c);
+		if(c->starved && !c->dead) pp = &c->next_starved;
+		else *pp = c->next_starved;
 	}
-	server = &s;
+}
 
+static void* evworker_thread(void *data) {
+	struct evworker *w = data;
+	struct epoll_event ev[EV_MAXEVENTS];
 	while(1) {
-		collect(threads);
+		int i, n = epoll_wait(w->epfd, ev, EV_MAXEVENTS, w->starved ? EV_STARVED_MS : -1);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait");
+			usleep(FAILURE_TIMEOUT);
+			continue;
+		}
+		for(i=0;i<n;i++) {
+			struct evref *r = ev[i].data.ptr;
+			if(!r) {
+				ev_resolved(w);
+				continue;
+			}
+			struct evconn *c = r->c;
+			if(c->dead) continue;
+			switch(c->state) {
+				case SS_1_CONNECTED:
+				case SS_2_NEED_AUTH:
+				case SS_3_AUTHED:
+					ev_handshake(w, c);
+					break;
+				case SS_4_CONNECTING:
+					if(r->side == 1) ev_connected(w, c);
+					else {
+						/* client hung up, or the lookup timed out */
+						if(c->hs->job && ct_fired(&c->to))
+							lookup_timedout(&c->client, c->hs->job);
+						ev_close(w, c);
+					}
+					break;
+				case SS_5_RELAYING:
+					ev_relay(w, c, r->side, ev[i].events);
+					break;
+				case SS_6_UDP_ASSOCIATED:
+					break; /* handed off, never in the epoll set */
+			}
+		}
+		ev_retry_starved(w);
+		while(w->dead) {
+			struct evconn *c = w->dead;
+			w->dead = c->next_dead;
+			free(c);
+		}
+	}
+	return 0;
+}
+
+static int evworkers_start(unsigned n) {
+	unsigned i;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = 0};
+	if(!(evworkers = calloc(n, sizeof *evworkers)) ||
+	   resolver_init(RESOLVER_THREADS)) return -1;
+	for(i=0;i<n;i++) {
+		if((evworkers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+		   dnsqueue_init(&evworkers[i].dnsq) ||
+		   epoll_ctl(evworkers[i].epfd, EPOLL_CTL_ADD, evworkers[i].dnsq.fd[0], &ev))
+			return -1;
+		if((errno = start_thread(&evworkers[i].pt, evworker_thread, &evworkers[i])))
+			return -1;
+	}
+	n_evworkers = n;
+	return 0;
+}
+
+static void evserve(struct server *s) {
+	unsigned next = 0;
+	while(!__atomic_load_n(&draining, __ATOMIC_SEQ_CST)) {
 		struct client c;
-		struct thread *curr = malloc(sizeof (struct thread));
-		if(!curr) goto oom;
-		curr->done = 0;
-		if(server_waitclient(&s, &c)) {
-			dolog("failed to accept connection\n");
+		struct evconn *curr;
+		if(server_waitclient(s, &c)) {
+			if(errno != EINTR) accept_failed();
+			continue;
+		}
+		metric_inc(M_ACCEPTED);
+		if(admit_client(&c)) continue;
+		tune_accepted(c.fd);
+		curr = 0;
+		if(set_nonblock(c.fd) || !(curr = calloc(1, sizeof *curr)) ||
+		   !(curr->hs = malloc(sizeof *curr->hs))) {
 			free(curr);
-			usleep(FAILURE_TIMEOUT);
+			admit_release(&c);
+			admit_reject(c.fd);
+			dolog("rejecting connection due to OOM\n");
 			continue;
 		}
+		curr->hs->len = curr->hs->outlen = 0;
+		curr->hs->job = 0;
 		curr->client = c;
-		if(!sblist_add(threads, &curr)) {
-			close(curr->client.fd);
+		curr->state = SS_1_CONNECTED;
+		curr->fd[0] = c.fd;
+		curr->fd[1] = -1;
+		curr->pipe[0][0] = curr->pipe[0][1] = -1;
+		curr->pipe[1][0] = curr->pipe[1][1] = -1;
+		curr->ref[0] = (struct evref) {.c = curr, .side = 0};
+		curr->ref[1] = (struct evref) {.c = curr, .side = 1};
+		ct_arm(&curr->to, CT_HANDSHAKE, &curr->client, -1);
+		struct evworker *w = &evworkers[next++ % n_evworkers];
+		if(ev_ctl(w, EPOLL_CTL_ADD, curr, 0, EPOLLIN)) {
+			ct_cancel(&curr->to);
+			free(curr->hs);
 			free(curr);
-			oom:
-			dolog("rejecting connection due to OOM\n");
-			usleep(FAILURE_TIMEOUT); /* prevent 100% CPU usage in OOM situation */
+			admit_release(&c);
+			admit_reject(c.fd);
+			dolog("epoll_ctl failed\n");
+		}
+	}
+	accept_stopped();
+}
+#endif
+
+static void threadserve(struct server *s) {
+	while(!__atomic_load_n(&draining, __ATOMIC_SEQ_CST)) {
+		collect();
+		struct client c;
+		if(server_waitclient(s, &c)) {
+			if(errno != EINTR) accept_failed();
 			continue;
 		}
-		pthread_attr_t *a = 0, attr;
-		if(pthread_attr_init(&attr) == 0) {
-			a = &attr;
-			pthread_attr_setstacksize(a, THREAD_STACK_SIZE);
+		metric_inc(M_ACCEPTED);
+		if(admit_client(&c)) continue;
+		tune_accepted(c.fd);
+		int i = pool_size ? pool_pop() : -1;
+		if(i != -1) {
+			pool_handoff(&pool[i], &c);
+			continue;
 		}
-		if(pthread_create(&curr->pt, a, clientthread, curr) != 0)
+		/* all pooled threads are busy, spawn a dedicated one */
+		struct thread *curr = malloc(sizeof (struct thread));
+		if(!curr) {
+			admit_release(&c);
+			admit_reject(c.fd);
+			dolog("rejecting connection due to OOM\n");
+			continue;
+		}
+		curr->client = c;
+		if(start_thread(&curr->pt, clientthread, curr) != 0) {
+			free(curr);
+			admit_release(&c);
+			admit_reject(c.fd);
 			dolog("pthread_create failed. OOM?\n");
-		if(a) pthread_attr_destroy(&attr);
+		}
+	}
+	accept_stopped();
+}
+
+static const char *handoff_path;
+static unsigned drain_timeout = 300; /* seconds */
+static char **restart_argv; /* argv before options were zeroed */
+
+/* starts the binary again with the same options. it takes over the
+   listeners from this process through the -G socket. */
+/* looks name up in PATH like execvp() does. */
+static int find_program(const char *name, char *path, size_t size) {
+	const char *dir = getenv("PATH"), *end;
+	if(strchr(name, '/'))
+		return snprintf(path, size, "%s", name) < (int) size ? 0 : -1;
+	if(!dir) dir = "/bin:/usr/bin";
+	for(;; dir = end + 1) {
+		int l = (end = strchrnul(dir, ':')) - dir;
+		/* an empty element is the current directory */
+		if(snprintf(path, size, "%.*s%s%s", l, dir, l ? "/" : "", name) < (int) size &&
+		   !access(path, X_OK))
+			return 0;
+		if(!*end) return -1;
+	}
+}
+
+static void spawn_successor(void) {
+	static char path[PATH_MAX];
+	sigset_t none;
+	long fd, max = sysconf(_SC_OPEN_MAX);
+	/* the child of a threaded process may only make async-signal-safe
+	   calls until exec, so everything is prepared here. */
+	if(!restart_argv || find_program(restart_argv[0], path, sizeof path)) {
+		dolog("can't find %s to restart\n", restart_argv ? restart_argv[0] : "myself");
+		return;
+	}
+	sigemptyset(&none);
+	pid_t pid = fork();
+	if(pid == -1) {
+		dolog("fork failed: %s\n", strerror(errno));
+		return;
+	}
+	if(pid) {
+		dolog("started new process %d\n", (int) pid);
+		return;
+	}
+	/* most fds aren't close-on-exec, among them those of clients, which
+	   would otherwise stay open as long as the new process runs. */
+#ifdef SYS_close_range
+	if(syscall(SYS_close_range, 3, ~0U, 0))
+#endif
+	for(fd = 3; fd < max; fd++) close(fd);
+	pthread_sigmask(SIG_SETMASK, &none, 0);
+	execv(path, restart_argv);
+	_exit(127);
+}
+
+static void* statsthread(void *data) {
+	sigset_t *set = data;
+	int sig;
+	while(!sigwait(set, &sig)) {
+		if(sig == SIGUSR1) metrics_dump(2);
+		else if(sig == SIGUSR2) spawn_successor();
+		else if(userdb_reload()) alog_msg("reloading %s failed, keeping the previous users", auth_file);
+		else alog_msg("reloaded users from %s", auth_file);
+	}
+	return 0;
+}
+
+static void* metricsthread(void *data) {
+	metrics_serve((long) data);
+	metric_dec(M_THREADS);
+	return 0;
+}
+
+struct listener {
+	pthread_t pt;
+	struct server s;
+	int cpu; /* -1 if not pinned */
+};
+
+static struct listener *listeners;
+static unsigned n_listeners = 1;
+
+static void* acceptthread(void *data) {
+	struct listener *l = data;
+#ifdef __linux__
+	if(l->cpu != -1) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(l->cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+			dolog("failed to pin accept thread to cpu %d\n", l->cpu);
+	}
+#endif
+#if CONFIG_EPOLL
+	if(n_evworkers) evserve(&l->s);
+#endif
+	threadserve(&l->s);
+	return 0;
+}
+
+#if CONFIG_URING
+/* io_uring mode: each worker owns a ring with a multishot accept armed on
+   every listener, and drives handshakes and relays through it. received
+   data lands in buffers the kernel picks from a provided buffer ring, and
+   is sent on from there, so a buffer is only in use while data is in
+   flight. all sqes queued while processing a batch of completions are
+   submitted with a single io_uring_enter(), which also waits for the
+   next batch. */
+
+#define UR_ENTRIES 4096
+/* memory of the buffer ring of each worker, unless -B sets a budget */
+#define UR_BUFMEM (16*1024*1024)
+#define UR_MAXBUFS 32768
+/* how often rate limited connections are resumed */
+#define UR_TICK_MS 10
+
+/* the lower bits of the user_data of an sqe tell which operation it is,
+   the upper ones hold the connection (or listener) pointer. */
+enum urop {
+	UR_RECV0, UR_RECV1, /* recv on fd[i] */
+	UR_SEND0, UR_SEND1, /* send data received from fd[i] to fd[!i] */
+	UR_POLL, /* waiting for connect() of fd[1] to finish, or for a hangup
+	            of fd[0] during the lookup of the target */
+	UR_ACCEPT,
+	UR_IGNORE,
+	UR_TIMER, /* wakes the worker to resume rate limited connections, or
+	             with the worker as pointer, to resume resolved ones */
+	UR_OPMASK = 7,
+};
+
+struct urconn {
+	struct client client;
+	enum socksstate state;
+	int fd[2];
+	int bid[2]; /* buffer holding data from fd[i], or -1 */
+	unsigned len[2], off[2];
+	unsigned inflight; /* bitmask of pending ops */
+	unsigned starved; /* sides that ran out of buffers, or wait for resume[i] */
+	long long resume[2];
+	struct rltunnel *rl;
+	int dead;
+	struct hsbuf *hs; /* until relaying */
+	long long t_start; /* as in struct evconn */
+	unsigned long long bytes[2];
+	struct urconn *next_starved;
+	struct conntimer to;
+	struct adapt ad[2];
+	unsigned want[2]; /* asked for by the pending recv on fd[i] */
+	int pollside; /* the fd the pending UR_POLL is on */
+};
+
+struct urworker {
+	pthread_t pt;
+	struct uring r;
+	struct urconn *starved;
+	int returned; /* buffers were given back since the last batch */
+	int timer; /* a UR_TIMER is pending */
+	int stopped; /* accepts were cancelled for a handoff */
+	struct dnsqueue dnsq; /* lookups done for this worker */
+	int dnspoll; /* a poll on dnsq is pending */
+};
+
+static struct __kernel_timespec ur_tick = {.tv_nsec = UR_TICK_MS * 1000000L};
+
+static struct urworker *urworkers;
+static unsigned n_urworkers;
+
+static int ur_post(struct urworker *w, struct urconn *c, enum urop op, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(&w->r);
+	if(!sqe) return -1;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long) c | op;
+	switch(op) {
+		case UR_RECV0: case UR_RECV1:
+			sqe->opcode = IORING_OP_RECV;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = 0;
+			sqe->len = c->state != SS_5_RELAYING ? sizeof c->hs->buf - c->hs->len :
+			           (c->want[op - UR_RECV0] = read_size(&c->ad[op - UR_RECV0], c->rl, relay_bufsize));
+			break;
+		case UR_SEND0: case UR_SEND1: {
+			int i = op - UR_SEND0;
+			sqe->opcode = IORING_OP_SEND;
+			sqe->addr = (unsigned long) uring_buf(&w->r, c->bid[i]) + c->off[i];
+			sqe->len = c->len[i] - c->off[i];
+			break; }
+		case UR_POLL:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			c->pollside = fd == c->fd[1];
+			sqe->poll32_events = c->pollside ? POLLOUT : POLLRDHUP;
+			break;
+		default:
+			return -1;
+	}
+	c->inflight |= 1 << op;
+	return 0;
+}
+
+static void ur_starve(struct urworker *w, struct urconn *c, int side) {
+	if(!c->starved) {
+		c->next_starved = w->starved;
+		w->starved = c;
+	}
+	c->starved |= 1 << side;
+}
+
+static void ur_buf_return(struct urworker *w, struct urconn *c, int side) {
+	if(c->bid[side] == -1) return;
+	uring_buf_return(&w->r, c->bid[side]);
+	c->bid[side] = -1;
+	w->returned = 1;
+}
+
+static void ur_finish(struct urworker *w, struct urconn *c) {
+	int i;
+	ct_cancel(&c->to);
+	if(c->state == SS_5_RELAYING) {
+		metric_dec(M_TUNNELS_ACTIVE);
+		count_fastopen(c->fd[0], c->fd[1]);
+		if(CONFIG_LOG) alog_close(&c->client, c->bytes[0], c->bytes[1], now_us() - c->t_start, EC_SUCCESS);
+	}
+	for(i=0;i<2;i++) {
+		if(c->fd[i] != -1) close(c->fd[i]);
+		ur_buf_return(w, c, i);
+	}
+	if(c->fd[0] != -1) admit_release(&c->client);
+	/* a lookup in progress is freed once it's done */
+	if(c->hs && c->hs->job) c->hs->job->arg = 0;
+	free(c->hs);
+	rl_detach(c->rl);
+	free(c);
+}
+
+/* pending ops keep using c, so they're cancelled and the connection is
+   freed once the last of them completed. */
+static void ur_close(struct urworker *w, struct urconn *c) {
+	unsigned op;
+	if(!c->dead) {
+		c->dead = 1;
+		for(op=0; op<UR_ACCEPT; op++) if(c->inflight & (1 << op)) {
+			struct io_uring_sqe *sqe = uring_sqe(&w->r);
+			if(!sqe) break;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (unsigned long) c | op;
+			sqe->user_data = UR_IGNORE;
+		}
+	}
+	if(!c->inflight && !c->starved) ur_finish(w, c);
+}
+
+static void ur_arm_accept(struct urworker *w, struct server *s) {
+	struct io_uring_sqe *sqe = uring_sqe(&w->r);
+	if(!sqe) return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = s->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (unsigned long) s | UR_ACCEPT;
+}
+
+/* cancels the accepts on all listeners once they were handed over. */
+static void ur_stop_accept(struct urworker *w) {
+	unsigned i;
+	for(i=0; i<n_listeners; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(&w->r);
+		if(!sqe) return; /* tried again after the next batch */
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long) &listeners[i].s | UR_ACCEPT;
+		sqe->user_data = UR_IGNORE;
+	}
+	w->stopped = 1;
+	__atomic_sub_fetch(&accepting, 1, __ATOMIC_SEQ_CST);
+}
+
+static void ur_accepted(struct urworker *w, struct server *s, struct io_uring_cqe *cqe) {
+	struct urconn *c;
+	/* multishot accept stops on errors, then it has to be re-armed */
+	if(!(cqe->flags & IORING_CQE_F_MORE) && !w->stopped) ur_arm_accept(w, s);
+	if(cqe->res == -ECANCELED) return;
+	if(cqe->res < 0) {
+		/* no backoff here, the re-armed accept only completes once
+		   there's a client again */
+		metric_inc(M_REJECTED);
+		if(!admit_accept_failed(-cqe->res))
+			dolog("failed to accept connection\n");
+		return;
+	}
+	metric_inc(M_ACCEPTED);
+	struct client client = {.fd = cqe->res};
+	socklen_t l = sizeof client.addr;
+	if(getpeername(client.fd, (void*) &client.addr, &l)) {
+		close(client.fd);
+		return;
+	}
+	if(admit_client(&client)) return;
+	tune_accepted(client.fd);
+	if(!(c = calloc(1, sizeof *c)) || !(c->hs = malloc(sizeof *c->hs))) {
+		free(c);
+		admit_release(&client);
+		admit_reject(client.fd);
+		dolog("rejecting connection due to OOM\n");
+		return;
+	}
+	c->hs->len = c->hs->outlen = 0;
+	c->hs->job = 0;
+	c->client = client;
+	c->fd[0] = client.fd;
+	c->fd[1] = -1;
+	c->bid[0] = c->bid[1] = -1;
+	c->state = SS_1_CONNECTED;
+	ct_arm(&c->to, CT_HANDSHAKE, &c->client, -1);
+	if(ur_post(w, c, UR_RECV0, c->fd[0]))
+		ur_close(w, c);
+}
+
+/* waits for the connect() of fd to the target to finish. */
+static void ur_connecting(struct urworker *w, struct urconn *c, int fd) {
+	struct io_uring_sqe *sqe;
+	c->fd[1] = fd;
+	/* after a lookup, the connect timeout has been running since */
+	if(c->state == SS_4_CONNECTING) {
+		ct_set_remote(&c->to, fd);
+		if(ct_fired(&c->to)) shutdown(fd, SHUT_RDWR);
+	} else ct_arm(&c->to, CT_CONNECT, &c->client, fd);
+	c->state = SS_4_CONNECTING;
+	c->t_start = now_us();
+	if(!(c->inflight & (1 << UR_POLL))) {
+		if(!ur_post(w, c, UR_POLL, c->fd[1])) return;
+	} else if((sqe = uring_sqe(&w->r))) {
+		/* still polling fd[0] from the lookup, fd[1] is polled once
+		   that's cancelled. */
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (unsigned long) c | UR_POLL;
+		sqe->user_data = UR_IGNORE;
+		return;
+	}
+	if(!optimistic) send_error(c->fd[0], EC_GENERAL_FAILURE);
+	ur_close(w, c);
+}
+
+static void ur_handshake(struct urworker *w, struct urconn *c, char *buf, int n) {
+	struct hsbuf *hs = c->hs;
+	/* the recv was limited to the free space of hs->buf */
+	memcpy(hs->buf + hs->len, buf, n);
+	hs->len += n;
+	int ret = handshake_feed(&c->client, &c->state, hs, &hs->pending, &c->to);
+	if(ret == -2) {
+		if(ur_post(w, c, UR_RECV0, c->fd[0])) goto fail;
+		return;
+	}
+	if(ret == -3) {
+		/* as in ev_handshake() */
+		c->state = SS_4_CONNECTING;
+		c->t_start = now_us();
+		ct_arm(&c->to, CT_CONNECT, &c->client, -1);
+		hs->job->arg = c;
+		resolver_submit(&w->dnsq, hs->job);
+		if(ur_post(w, c, UR_POLL, c->fd[0])) goto fail;
+		return;
+	}
+	if(ret < 0) goto fail;
+#if CONFIG_UDP
+	if(c->state == SS_6_UDP_ASSOCIATED) {
+		/* no operation is pending on fd[0] after a handshake message */
+		if(udp_handoff(&c->client, ret)) close(ret);
+		else c->fd[0] = -1;
+		goto fail;
+	}
+#endif
+	ur_connecting(w, c, ret);
+	return;
+fail:
+	ur_close(w, c);
+}
+
+/* as ev_resolved() */
+static void ur_resolved(struct urworker *w) {
+	struct dnsjob *j, *next;
+	w->dnspoll = 0;
+	for(j = dnsqueue_take(&w->dnsq); j; j = next) {
+		struct urconn *c = j->arg;
+		next = j->next;
+		if(c) {
+			struct hsbuf *hs = c->hs;
+			hs->job = 0;
+			metric_observe(H_DNS, now_us() - c->t_start);
+			hs->synlen = hs->len;
+			int ret = connect_resolved(&c->client, j->host, j->port, j->err, &j->res, &hs->pending, hs->buf, &hs->synlen);
+			if(ret < 0) {
+				metric_inc(M_HS_FAILURE - ret);
+				if(!optimistic) send_error(c->fd[0], -ret);
+				ur_close(w, c);
+			} else
+				ur_connecting(w, c, ret);
+		}
+		free(j);
+	}
+}
+
+static void ur_poll_resolved(struct urworker *w) {
+	struct io_uring_sqe *sqe = uring_sqe(&w->r);
+	if(!sqe) return; /* tried again after the next batch */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->dnsq.fd[0];
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = (unsigned long) w | UR_TIMER;
+	w->dnspoll = 1;
+}
+
+static void ur_connected(struct urworker *w, struct urconn *c) {
+	int err = 0;
+	socklen_t l = sizeof err;
+	if(getsockopt(c->fd[1], SOL_SOCKET, SO_ERROR, &err, &l)) err = errno;
+	if(err) {
+		/* as in ev_connected() */
+		ct_set_remote(&c->to, -1);
+		close(c->fd[1]);
+		errno = ct_fired(&c->to) ? ETIMEDOUT : err;
+		if(!ct_fired(&c->to) && (c->fd[1] = connect_next(&c->hs->pending, 0, 0)) != -1) {
+			ct_set_remote(&c->to, c->fd[1]);
+			if(ct_fired(&c->to)) shutdown(c->fd[1], SHUT_RDWR);
+			if(ur_post(w, c, UR_POLL, c->fd[1])) goto fail;
+			return;
+		}
+		err = errno_to_ec(errno);
+		metric_inc(M_HS_FAILURE + err);
+		if(CONFIG_LOG) alog_close(&c->client, 0, 0, now_us() - c->t_start, err);
+		if(!optimistic) send_error(c->fd[0], err);
+		goto fail;
+	}
+	if(!optimistic) send_error(c->fd[0], EC_SUCCESS);
+	long long t = now_us();
+	metric_observe(H_CONNECT, t - c->t_start);
+	c->t_start = t;
+	if(send_early_data(c->fd[1], c->hs, &c->bytes[0]) ||
+	   rl_attach(&c->client, &c->rl)) goto fail;
+	metric_inc(M_TUNNELS);
+	metric_inc(M_TUNNELS_ACTIVE);
+	c->state = SS_5_RELAYING;
+	free(c->hs);
+	c->hs = 0;
+	ct_arm(&c->to, CT_IDLE, &c->client, c->fd[1]);
+	if(ur_post(w, c, UR_RECV0, c->fd[0]) || ur_post(w, c, UR_RECV1, c->fd[1]))
+		goto fail;
+	return;
+fail:
+	ur_close(w, c);
+}
+
+static void ur_complete(struct urworker *w, struct io_uring_cqe *cqe) {
+	enum urop op = cqe->user_data & UR_OPMASK;
+	struct urconn *c = (void*)(unsigned long)(cqe->user_data & ~(unsigned long long) UR_OPMASK);
+	int side;
+	switch(op) {
+		case UR_IGNORE:
+			return;
+		case UR_TIMER:
+			if(c) ur_resolved(w);
+			else w->timer = 0;
+			return;
+		case UR_ACCEPT:
+			ur_accepted(w, (void*) c, cqe);
+			return;
+		default:
+			break;
+	}
+	c->inflight &= ~(1 << op);
+	if(c->dead) {
+		if(cqe->flags & IORING_CQE_F_BUFFER) {
+			uring_buf_return(&w->r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			w->returned = 1;
+		}
+		goto fail;
+	}
+	switch(op) {
+		case UR_RECV0: case UR_RECV1:
+			side = op - UR_RECV0;
+			if(cqe->res == -ENOBUFS) {
+				/* retried once buffers are given back */
+				ur_starve(w, c, side);
+				return;
+			}
+			if(cqe->res <= 0) goto fail;
+			if(c->state != SS_5_RELAYING) {
+				unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				ur_handshake(w, c, uring_buf(&w->r, bid), cqe->res);
+				uring_buf_return(&w->r, bid);
+				w->returned = 1;
+				return;
+			}
+			c->bid[side] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			c->len[side] = cqe->res;
+			c->off[side] = 0;
+			adapt_update(&c->ad[side], cqe->res, c->want[side], relay_bufsize);
+			metric_add(side ? M_BYTES_DOWN : M_BYTES_UP, cqe->res);
+			c->bytes[side] += cqe->res;
+			ct_touch(&c->to);
+			if(c->rl) {
+				long long d = rl_charge(c->rl, side, cqe->res);
+				if(d) c->resume[side] = now_us() + d;
+			}
+			if(ur_post(w, c, UR_SEND0 + side, c->fd[!side])) goto fail;
+			return;
+		case UR_SEND0: case UR_SEND1:
+			side = op - UR_SEND0;
+			if(cqe->res <= 0) goto fail;
+			c->off[side] += cqe->res;
+			if(c->off[side] < c->len[side]) {
+				if(ur_post(w, c, op, c->fd[!side])) goto fail;
+				return;
+			}
+			ur_buf_return(w, c, side);
+			/* over the rate limit, the next recv waits */
+			if(c->resume[side]) ur_starve(w, c, side);
+			else if(ur_post(w, c, UR_RECV0 + side, c->fd[side])) goto fail;
+			return;
+		case UR_POLL:
+			if(c->pollside) {
+				ur_connected(w, c);
+				return;
+			}
+			/* the lookup is done and connect() started meanwhile */
+			if(cqe->res == -ECANCELED && c->fd[1] != -1) {
+				if(ur_post(w, c, UR_POLL, c->fd[1])) break;
+				return;
+			}
+			/* client hung up, or the lookup timed out */
+			if(c->hs->job && ct_fired(&c->to))
+				lookup_timedout(&c->client, c->hs->job);
+			break;
+		default:
+			return;
+	}
+fail:
+	ur_close(w, c);
+}
+
+/* posts the recvs of starved connections again once buffers were given
+   back, or their rate limit allows it. while connections wait for the
+   latter, a timer makes sure the worker wakes up. */
+static void ur_retry_starved(struct urworker *w) {
+	struct urconn *c = w->starved, *next;
+	int avail = w->returned, throttled = 0;
+	long long now = now_us();
+	w->starved = 0;
+	w->returned = 0;
+	for(; c; c = next) {
+		unsigned ready = 0, side;
+		next = c->next_starved;
+		if(c->dead) {
+			c->starved = 0;
+			ur_close(w, c);
+			continue;
+		}
+		for(side=0; side<2; side++) {
+			if(!(c->starved & (1 << side))) continue;
+			if(c->resume[side] ? now >= c->resume[side] : avail) {
+				c->starved &= ~(1 << side);
+				c->resume[side] = 0;
+				ready |= 1 << side;
+			} else if(c->resume[side])
+				throttled = 1;
+		}
+		if(c->starved) {
+			c->next_starved = w->starved;
+			w->starved = c;
+		}
+		for(side=0; side<2; side++)
+			if((ready & (1 << side)) && ur_post(w, c, UR_RECV0 + side, c->fd[side])) {
+				ur_close(w, c);
+				break;
+			}
+	}
+	if(throttled && !w->timer) {
+		struct io_uring_sqe *sqe = uring_sqe(&w->r);
+		if(!sqe) return;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (unsigned long) &ur_tick;
+		sqe->len = 1;
+		sqe->user_data = UR_TIMER;
+		w->timer = 1;
 	}
 }
+
+static void* urworker_thread(void *data) {
+	struct urworker *w = data;
+	struct io_uring_cqe *cqe;
+	unsigned i;
+	for(i=0; i<n_listeners; i++) ur_arm_accept(w, &listeners[i].s);
+	while(1) {
+		if(uring_submit(&w->r, 1)) {
+			perror("io_uring_enter");
+			usleep(FAILURE_TIMEOUT);
+		}
+		while((cqe = uring_cqe(&w->r))) {
+			struct io_uring_cqe copy = *cqe;
+			uring_cqe_seen(&w->r);
+			ur_complete(w, &copy);
+		}
+		if(w->starved) ur_retry_starved(w);
+		if(!w->dnspoll) ur_poll_resolved(w);
+		if(!w->stopped && __atomic_load_n(&draining, __ATOMIC_SEQ_CST))
+			ur_stop_accept(w);
+	}
+	return 0;
+}
+
+/* returns -1 if io_uring is not usable, so the caller can fall back. */
+static int urworkers_init(unsigned n) {
+	unsigned i, nbufs = 1;
+	/* the rings are the relay buffers of this mode, so the budget is
+	   split between them. the number of buffers must be a power of 2. */
+	size_t mem = relay_budget ? relay_budget / n : UR_BUFMEM;
+	while(nbufs < UR_MAXBUFS && nbufs * 2 * relay_bufsize <= mem) nbufs *= 2;
+	if(!(urworkers = calloc(n, sizeof *urworkers))) return -1;
+	for(i=0;i<n;i++) {
+		urworkers[i].r.fd = -1;
+		if(uring_init(&urworkers[i].r, UR_ENTRIES) ||
+		   uring_setup_bufs(&urworkers[i].r, nbufs, relay_bufsize))
+			goto fail;
+	}
+	n_urworkers = n;
+	return 0;
+fail:;
+	int e = errno;
+	while(i+1) uring_free(&urworkers[i--].r);
+	free(urworkers);
+	urworkers = 0;
+	errno = e;
+	return -1;
+}
+#endif
+
+/* how long a new process may take to confirm it took over, in ms */
+#define HANDOFF_TIMEOUT 10000
+
+static int metrics_fd = -1; /* only if listening on tcp */
+static pthread_t metrics_pt;
+static int metrics_running;
+
+/* the metrics listener was shut down for a new process, which then
+   failed to take over. listening again keeps the port, unless the new
+   process bound it meanwhile. */
+static void metrics_resume(void) {
+	if(metrics_running) pthread_join(metrics_pt, 0);
+	metrics_running = !listen(metrics_fd, SOMAXCONN) &&
+	                  !(errno = start_thread(&metrics_pt, metricsthread, (void*)(long) metrics_fd));
+	if(!metrics_running) dolog("metrics endpoint not available: %s\n", strerror(errno));
+}
+
+static void wake(int sig) {
+	(void) sig;
+}
+
+/* interrupts the accept loops, or the waits of the io_uring workers,
+   until all of them noticed that they are to stop. */
+static void stop_accepting(void) {
+	static const struct timespec ts = {0, 10000000};
+	unsigned i;
+	__atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&accepting, __ATOMIC_SEQ_CST)) {
+#if CONFIG_URING
+		for(i=0;i<n_urworkers;i++) pthread_kill(urworkers[i].pt, SIGURG);
+		if(!n_urworkers)
+#endif
+		for(i=0;i<n_listeners;i++) pthread_kill(listeners[i].pt, SIGURG);
+		nanosleep(&ts, 0);
+	}
+}
+
+/* hands the listeners over to a new process connecting to the -G socket,
+   then gives the clients of this one up to drain_timeout seconds to
+   finish. */
+static void* handoffthread(void *data) {
+	int lfd = (long) data, fds[HANDOFF_MAXFDS], conn;
+	long long deadline;
+	unsigned i;
+	for(i=0;i<n_listeners;i++) fds[i] = listeners[i].s.fd;
+	while(1) {
+		if((conn = handoff_accept(lfd)) == -1) {
+			usleep(FAILURE_TIMEOUT);
+			continue;
+		}
+		/* the new process needs the port to bind its own */
+		if(metrics_fd != -1) shutdown(metrics_fd, SHUT_RDWR);
+		if(!handoff_send(conn, fds, n_listeners, HANDOFF_TIMEOUT)) break;
+		dolog("new process failed to take over, still serving\n");
+		close(conn);
+		if(metrics_fd != -1) metrics_resume();
+	}
+	close(conn);
+	close(lfd);
+	stop_accepting();
+	dolog("listeners handed over, draining %u clients\n", admit_clients());
+	deadline = now_ms() + drain_timeout * 1000LL;
+	while(admit_clients() && now_ms() < deadline) usleep(100000);
+	dolog("exiting, %u clients left\n", admit_clients());
+	alog_flush();
+	exit(0);
+}
+
+/* serves the -G socket once all accept loops are started, then lets
+   the previous process know that this one took over. */
+static int handoff_start(int conn) {
+	struct sigaction sa = {.sa_handler = wake};
+	pthread_t pt;
+	int lfd;
+	/* without SA_RESTART, so that it interrupts a blocking accept() */
+	sigaction(SIGURG, &sa, 0);
+	if((lfd = handoff_listen(handoff_path)) == -1) return -1;
+	if((errno = start_thread(&pt, handoffthread, (void*)(long) lfd))) return -1;
+	if(conn != -1) handoff_ready(conn);
+	return 0;
+}
+
+static int usage(void) {
+	dprintf(2,
+		"MicroSocks SOCKS5 Server\n"
+		"------------------------\n"
+		"usage: microsocks -1 -q -i listenip -p port -u user -P pass -F users -G sock,drain -b ips -H -w ips -e n -r k -a -t n -d n,ttl,negttl -c ms -T hs,idle -f -o -U n -O n,ttl -m stats -B size,budget -R ip,user,tunnel,all -L tunnels,ip,handshakes -S opts -l log -j -X parent,spares,idle\n"
+		"all arguments are optional.\n"
+		"by default listenip is 0.0.0.0 and port 1080.\n\n"
+		"option -q disables logging.\n"
+		"option -l writes the log to a file, or to a unix stream socket if given\n"
+		" as unix:path, instead of stderr. it's written by a separate thread,\n"
+		" with one record per connect, tunnel close and udp association.\n"
+		"option -j formats log records as json lines instead of text.\n"
+		"option -b specifies which ips outgoing connections are bound to, as a\n"
+		" comma-separated list. connections use one of the family of the target,\n"
+		" taken in turn.\n"
+		"option -H picks the -b ip by a hash of the target instead.\n"
+		"option -e activates event mode: instead of one thread per client,\n"
+		" n worker threads serve all clients using epoll (linux only).\n"
+		"option -r opens k listening sockets with SO_REUSEPORT, each served\n"
+		" by its own accept thread, so the kernel spreads new connections.\n"
+		"option -a pins each accept thread to its own cpu (linux only).\n"
+		"option -t pre-spawns a pool of n client threads that are reused\n"
+		" for new connections. if all of them are busy, additional threads\n"
+		" are spawned on demand.\n"
+		"option -d caches up to n dns lookups for ttl seconds (default 60),\n"
+		" failed lookups for negttl seconds (default 5). e.g. -d 4096,300,10\n"
+		"option -c sets the timeout in milliseconds for connecting to a target.\n"
+		" all of its addresses are tried, with a new attempt started every\n"
+		" 250ms while earlier ones are still pending (happy eyeballs).\n"
+		"option -T sets the timeouts in seconds for clients to finish their\n"
+		" handshake (default 60) and for idle tunnels (default 900). 0 means\n"
+		" none. e.g. -T 10,300\n"
+		"option -f enables tcp fast open for clients and targets (linux only).\n"
+		"option -o reports success of a CONNECT right away instead of after\n"
+		" connecting, saving clients that pipeline their requests a round trip.\n"
+		" if the connection fails, the client is closed without an error reply.\n"
+		"option -U activates io_uring mode: n worker threads accept and serve\n"
+		" all clients through io_uring (linux 5.19+). if io_uring is not\n"
+		" available, the default backend is used instead.\n"
+		"option -m serves counters and latency histograms in the prometheus\n"
+		" text format on stats, which is either a path to a unix socket or\n"
+		" [ip:]port (loopback by default). e.g. -m 9100 or -m /run/msocks.sock\n"
+		"statistics are also printed to stderr when receiving SIGUSR1.\n"
+		"option -B sets the size of relay buffers in KB (default 16), which is\n"
+		" also the most data moved per syscall, and a budget in KB for all of\n"
+		" them together. once it is used up, tunnels wait for a buffer instead\n"
+		" of allocating more. e.g. -B 64,32768\n"
+		"option -R limits the bandwidth per direction in KB/s for each client ip,\n"
+		" authenticated user and tunnel, and for all of them together. 0 means\n"
+		" no limit. tunnels sharing a limit get an equal share, with small flows\n"
+		" going first. e.g. -R 1024,0,0,102400\n"
+		"option -S sets socket options for clients and targets, comma-separated:\n"
+		" rcvbuf=KB, sndbuf=KB, nodelay, notsent=KB (TCP_NOTSENT_LOWAT), quickack,\n"
+		" keepalive=idle[:intvl[:cnt]] in seconds, and adaptive, which adapts how\n"
+		" much is relayed at once to each tunnel, up to the -B buffer size, and\n"
+		" sockmap, which lets the kernel relay tunnels through a bpf sockmap\n"
+		" (linux 5.13+, needs CAP_BPF or CAP_NET_ADMIN).\n"
+		" e.g. -S nodelay,notsent=16,keepalive=60:10:6,adaptive\n"
+		"option -L limits the number of tunnels, of clients per ip and of clients\n"
+		" still in the handshake. 0 means no limit. clients beyond a limit get a\n"
+		" socks failure reply right away. e.g. -L 10000,64,512\n"
+		"option -w allows to specify a comma-separated whitelist of ip addresses\n"
+		" or cidr ranges, that may use the proxy without user/pass authentication.\n"
+		" e.g. -w 127.0.0.1,192.168.1.0/24,::1 or just -w 10.0.0.1\n"
+		" to allow access ONLY to those ips, choose an impossible to guess user/pw combo.\n"
+		"option -1 activates auth_once mode: once a specific ip address\n"
+		" authed successfully with user/pass, it is added to a whitelist\n"
+		" and may use the proxy without auth.\n"
+		" this is handy for programs like firefox that don't support\n"
+		" user/pass auth. for it to work you'd basically make one connection\n"
+		" with another program that supports it, and then you can use firefox too.\n"
+		"option -O limits the auth_once whitelist to n addresses (default 65536),\n"
+		" evicting the one that authed least recently. with ttl, addresses also\n"
+		" expire ttl seconds after their last successful auth. e.g. -O 1000,3600\n"
+		"option -G lets a new microsocks started with the same option take over\n"
+		" the listening sockets through the unix socket sock, after which this\n"
+		" one stops accepting and exits once its clients are gone, or after\n"
+		" drain seconds (default 300). SIGUSR2 starts the new one.\n"
+		"option -X forwards CONNECTs to the socks5 server [user:pass@]host:port,\n"
+		" with a pool of up to spares (default 16) connections ready for them,\n"
+		" which are closed after idle seconds (default 30) unused.\n"
+		" e.g. -X user:pass@10.0.0.1:1080,32,20\n"
+		"option -F reads additional users from a file with user:password or\n"
+		" user:$sha256$salt$hash lines, where hash is the hex sha256 of salt\n"
+		" followed by the password. it's read again on SIGHUP.\n"
+	);
+	return 1;
+}
+
+/* parses the comma-separated options of -S. */
+static int parse_tuning(char *spec) {
+	char *p, *v;
+	for(p = strtok(spec, ","); p; p = strtok(0, ",")) {
+		if((v = strchr(p, '='))) *v++ = 0;
+		if(!strcmp(p, "nodelay")) tune.nodelay = 1;
+		else if(!strcmp(p, "quickack")) tune.quickack = 1;
+		else if(!strcmp(p, "adaptive")) adaptive = 1;
+		else if(!strcmp(p, "sockmap")) offload = 1;
+		else if(v && !strcmp(p, "rcvbuf")) tune.rcvbuf = atoi(v) * 1024;
+		else if(v && !strcmp(p, "sndbuf")) tune.sndbuf = atoi(v) * 1024;
+		else if(v && !strcmp(p, "notsent")) tune.notsent_lowat = atoi(v) * 1024;
+		else if(v && !strcmp(p, "keepalive"))
+			sscanf(v, "%d:%d:%d", &tune.keepidle, &tune.keepintvl, &tune.keepcnt);
+		else return -1;
+	}
+	return 0;
+}
+
+/* prevent username and password from showing up in top. */
+static void zero_arg(char *s) {
+	size_t i, l = strlen(s);
+	for(i=0;i<l;i++) s[i] = 0;
+}
+
+int main(int argc, char** argv) {
+	int ch, pin = 0;
+	const char *listenip = "0.0.0.0";
+	char *p, *q;
+	unsigned port = 1080, evmode = 0, poolsize = 0, uringmode = 0, i;
+	unsigned dns_entries = 0, dns_ttl = 60, dns_negttl = 5;
+	unsigned authonce_max = 65536, authonce_ttl = 0;
+	const char *metrics_spec = 0, *log_dest = "-";
+	int log_json = 0;
+	unsigned bufsize_kb = 16, budget_kb = 0;
+	unsigned rate_ip = 0, rate_user = 0, rate_tunnel = 0, rate_global = 0;
+	unsigned max_tunnels = 0, max_per_ip = 0, max_handshakes = 0;
+	unsigned handshake_timeout = 60, idle_timeout = 15*60;
+	int inherited[HANDOFF_MAXFDS], n_inherited = 0, handoff_conn = -1;
+	char *upstream_spec = 0;
+	unsigned upstream_spares = 16, upstream_idle = 30;
+	/* kept for restarts with -G, as options get zeroed */
+	if((restart_argv = calloc(argc + 1, sizeof *restart_argv)))
+		for(i=0; i<(unsigned) argc; i++) restart_argv[i] = strdup(argv[i]);
+	while((ch = getopt(argc, argv, ":1afjoqHb:B:c:d:e:F:G:i:l:L:m:O:p:r:R:S:t:T:u:P:U:w:X:")) != -1) {
+		switch(ch) {
+			case 'w': /* fall-through */
+			case '1':
+				auth_ips = 1;
+				if(ch == '1') {
+					auth_once = 1;
+					break;
+				}
+				p = optarg;
+				while(1) {
+					union sockaddr_union ca;
+					char *slash, *end;
+					long prefix = -1;
+					if((q = strchr(p, ','))) *q = 0;
+					if((slash = strchr(p, '/'))) {
+						*slash = 0;
+						/* digits only, strtol would take signs and spaces */
+						end = slash + 1;
+						if(*end >= '0' && *end <= '9') prefix = strtol(end, &end, 10);
+						if(prefix < 0 || *end) goto bad_cidr;
+					}
+					if(resolve_sa(p, 0, &ca)) {
+						dprintf(2, "error: failed to resolve %s\n", p);
+						return 1;
+					}
+					if(slash) *slash = '/';
+					if(prefix > (SOCKADDR_UNION_AF(&ca) == AF_INET ? 32 : 128)) {
+					bad_cidr:
+						if(slash) *slash = '/';
+						dprintf(2, "error: invalid cidr prefix in %s\n", p);
+						return 1;
+					}
+					if(whitelist_add(&ca, prefix)) {
+						perror("whitelist_add");
+						return 1;
+					}
+					if(q) *(q++) = ',', p = q;
+					else break;
+				}
+				break;
+			case 'O':
+				sscanf(optarg, "%u,%u", &authonce_max, &authonce_ttl);
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 'l':
+				log_dest = optarg;
+				break;
+			case 'j':
+				log_json = 1;
+				break;
+			case 'e':
+				evmode = atoi(optarg);
+				break;
+			case 'r':
+				n_listeners = atoi(optarg);
+				if(!n_listeners) n_listeners = 1;
+				break;
+			case 'a':
+				pin = 1;
+				break;
+			case 'f':
+				fastopen = 1;
+				break;
+			case 'o':
+				optimistic = 1;
+				break;
+			case 'U':
+				uringmode = atoi(optarg);
+				break;
+			case 't':
+				poolsize = atoi(optarg);
+				break;
+			case 'c':
+				connect_timeout = atoi(optarg);
+				break;
+			case 'm':
+				metrics_spec = optarg;
+				break;
+			case 'B':
+				sscanf(optarg, "%u,%u", &bufsize_kb, &budget_kb);
+				break;
+			case 'R':
+				sscanf(optarg, "%u,%u,%u,%u", &rate_ip, &rate_user, &rate_tunnel, &rate_global);
+				break;
+			case 'S':
+				if(parse_tuning(optarg)) {
+					dprintf(2, "error: invalid -S option\n");
+					return 1;
+				}
+				break;
+			case 'T':
+				sscanf(optarg, "%u,%u", &handshake_timeout, &idle_timeout);
+				break;
+			case 'L':
+				sscanf(optarg, "%u,%u,%u", &max_tunnels, &max_per_ip, &max_handshakes);
+				break;
+			case 'd':
+				sscanf(optarg, "%u,%u,%u", &dns_entries, &dns_ttl, &dns_negttl);
+				break;
+			case 'b':
+				p = optarg;
+				while(1) {
+					union sockaddr_union sa;
+					if((q = strchr(p, ','))) *q = 0;
+					if(resolve_sa(p, 0, &sa) || srcpool_add(&sa)) {
+						dprintf(2, "error: failed to resolve %s\n", p);
+						return 1;
+					}
+					if(q) *(q++) = ',', p = q;
+					else break;
+				}
+				break;
+			case 'H':
+				srcpool_hash(1);
+				break;
+			case 'u':
+				auth_user = strdup(optarg);
+				zero_arg(optarg);
+				break;
+			case 'P':
+				auth_pass = strdup(optarg);
+				zero_arg(optarg);
+				break;
+			case 'F':
+				auth_file = optarg;
+				break;
+			case 'X':
+				upstream_spec = strdup(optarg);
+				zero_arg(optarg);
+				if((p = strchr(upstream_spec, ','))) {
+					*p = 0;
+					sscanf(p+1, "%u,%u", &upstream_spares, &upstream_idle);
+				}
+				break;
+			case 'G':
+				handoff_path = optarg;
+				if((p = strrchr(optarg, ','))) {
+					*p = 0;
+					drain_timeout = atoi(p+1);
+				}
+				break;
+			case 'i':
+				listenip = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case ':':
+				dprintf(2, "error: option -%c requires an operand\n", optopt);
+				/* fall through */
+			case '?':
+				return usage();
+		}
+	}
+	if((auth_user && !auth_pass) || (!auth_user && auth_pass)) {
+		dprintf(2, "error: user and pass must be used together\n");
+		return 1;
+	}
+	need_auth = auth_user || auth_file;
+	if(auth_ips && !need_auth) {
+		dprintf(2, "error: -1/-w options must be used together with user/pass or -F\n");
+		return 1;
+	}
+	if(handoff_path && n_listeners > HANDOFF_MAXFDS) {
+		dprintf(2, "error: -G can hand over at most %d listeners\n", HANDOFF_MAXFDS);
+		return 1;
+	}
+	if(uringmode && !CONFIG_URING) {
+		dprintf(2, "error: -U option is not supported by this build\n");
+		return 1;
+	}
+	if(!bufsize_kb || bufsize_kb > 64*1024) {
+		dprintf(2, "error: -B buffer size must be between 1 and 65536 KB\n");
+		return 1;
+	}
+	if(evmode && !CONFIG_EPOLL) {
+		dprintf(2, "error: -e option is not supported on this platform\n");
+		return 1;
+	}
+	if(upstream_spec && (evmode || uringmode)) {
+		dprintf(2, "error: -X can't be used with -e or -U\n");
+		return 1;
+	}
+	if(offload && !CONFIG_SOCKMAP) {
+		dprintf(2, "error: -S sockmap is not supported by this build\n");
+		return 1;
+	}
+	if(offload && (evmode || uringmode)) {
+		dprintf(2, "error: -S sockmap can't be used with -e or -U\n");
+		return 1;
+	}
+	if(need_auth && userdb_init(auth_file, auth_user, auth_pass))
+		return 1;
+	if(auth_once && authonce_init(authonce_max, authonce_ttl)) {
+		perror("authonce_init");
+		return 1;
+	}
+	if(dnscache_init(dns_entries, dns_ttl, dns_negttl)) {
+		perror("dnscache_init");
+		return 1;
+	}
+	relay_bufsize = (size_t) bufsize_kb * 1024;
+	relay_budget = (size_t) budget_kb * 1024;
+	if(bufpool_init(relay_bufsize, relay_budget)) {
+		perror("bufpool_init");
+		return 1;
+	}
+	ratelimit_init(rate_tunnel * 1024ULL, rate_ip * 1024ULL, rate_user * 1024ULL, rate_global * 1024ULL);
+	if(admit_init(max_tunnels, max_per_ip, max_handshakes)) {
+		perror("admit_init");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/* SIGUSR1, SIGHUP with -F and SIGUSR2 with -G are handled synchronously
+	   by a dedicated thread; they must be blocked before any other thread
+	   is created, as they inherit the mask. */
+	static sigset_t statsig;
+	pthread_t statspt;
+	sigemptyset(&statsig);
+	sigaddset(&statsig, SIGUSR1);
+	if(auth_file) sigaddset(&statsig, SIGHUP);
+	if(handoff_path) sigaddset(&statsig, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &statsig, 0);
+	metric_inc(M_THREADS); /* main thread */
+	if((errno = start_thread(&statspt, statsthread, &statsig))) {
+		perror("pthread_create");
+		return 1;
+	}
+	if(CONFIG_LOG && !quiet && alog_init(log_dest, log_json)) {
+		perror("alog_init");
+		return 1;
+	}
+	if(timeout_init(handshake_timeout * 1000, connect_timeout, idle_timeout * 1000)) {
+		perror("timeout_init");
+		return 1;
+	}
+	if(upstream_spec) {
+		if(upstream_init(upstream_spec, upstream_spares, upstream_idle * 1000,
+		                 connect_timeout ? connect_timeout : 10000, &tune)) {
+			perror("upstream_init");
+			return 1;
+		}
+		upstream = 1;
+	}
+	/* before binding the metrics port, which the previous process gives
+	   up when it hands over. */
+	if(handoff_path &&
+	   (n_inherited = handoff_receive(handoff_path, inherited, HANDOFF_MAXFDS, &handoff_conn)) == -1) {
+		perror("handoff_receive");
+		return 1;
+	}
+	if(metrics_spec) {
+		int mfd = metrics_listen(metrics_spec);
+		if(mfd == -1) {
+			perror("metrics_listen");
+			return 1;
+		}
+		if(!strchr(metrics_spec, '/')) metrics_fd = mfd;
+		if((errno = start_thread(&metrics_pt, metricsthread, (void*)(long) mfd))) {
+			perror("pthread_create");
+			return 1;
+		}
+		metrics_running = 1;
+	}
+	if(n_inherited) {
+		dolog("took over %d listeners\n", n_inherited);
+		n_listeners = n_inherited;
+	}
+	listeners = calloc(n_listeners, sizeof *listeners);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if(!listeners) {
+		perror("calloc");
+		return 1;
+	}
+	for(i=0;i<n_listeners;i++) {
+		if(n_inherited) listeners[i].s.fd = inherited[i];
+		else if(server_setup(&listeners[i].s, listenip, port,
+		                (n_listeners > 1 ? SERVER_REUSEPORT : 0) |
+		                (fastopen ? SERVER_FASTOPEN : 0), &tune)) {
+			perror("server_setup");
+			return 1;
+		}
+		listeners[i].cpu = pin && ncpu > 0 ? i % ncpu : -1;
+	}
+	server = &listeners[0].s;
+#if CONFIG_URING
+	if(uringmode && urworkers_init(uringmode)) {
+		dolog("io_uring not available (%s), using default backend\n", strerror(errno));
+		uringmode = 0;
+	}
+	if(uringmode) {
+		dolog("relay engine: io_uring\n");
+		if(resolver_init(RESOLVER_THREADS)) {
+			perror("resolver_init");
+			return 1;
+		}
+		for(i=0;i<n_urworkers;i++) if(dnsqueue_init(&urworkers[i].dnsq)) {
+			perror("pipe");
+			return 1;
+		}
+		for(i=1;i<n_urworkers;i++) {
+			if((errno = start_thread(&urworkers[i].pt, urworker_thread, &urworkers[i]))) {
+				perror("pthread_create");
+				return 1;
+			}
+		}
+		urworkers[0].pt = pthread_self();
+		accepting = n_urworkers;
+		if(handoff_path && handoff_start(handoff_conn)) {
+			perror("handoff_start");
+			return 1;
+		}
+		urworker_thread(&urworkers[0]);
+	}
+#endif
+#if CONFIG_SOCKMAP
+	if(offload && sockmap_init(max_tunnels ? 2 * max_tunnels : SOCKMAP_SIZE)) {
+		dolog("sockmap not available (%s), relaying in userspace\n", strerror(errno));
+		offload = 0;
+	}
+#endif
+	dolog("relay engine: %s%s\n", relay_engine_names[relay_engine], offload ? ", offloaded to sockmap" : "");
+#if CONFIG_EPOLL
+	if(evmode && evworkers_start(evmode)) {
+		perror("evworkers_start");
+		return 1;
+	}
+#endif
+	if(poolsize && pool_start(poolsize)) {
+		perror("pool_start");
+		return 1;
+	}
+	/* the first listener is served by the main thread itself */
+	for(i=1;i<n_listeners;i++) {
+		if((errno = start_thread(&listeners[i].pt, acceptthread, &listeners[i]))) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	listeners[0].pt = pthread_self();
+	accepting = n_listeners;
+	if(handoff_path && handoff_start(handoff_conn)) {
+		perror("handoff_start");
+		return 1;
+	}
+	acceptthread(&listeners[0]);
+	return 0;
+
+}
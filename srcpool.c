@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include "srcpool.h"
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+struct source {
+	union sockaddr_union addr;
+	unsigned long long used, failed;
+};
+
+/* sources of each family, by index in sources */
+struct family {
+	unsigned n, next;
+	unsigned char idx[SRCPOOL_MAX];
+};
+
+static struct source sources[SRCPOOL_MAX];
+static unsigned n_sources;
+static struct family families[2]; /* ipv4, ipv6 */
+static int hashed;
+
+static struct family *family_of(int af) {
+	return af == AF_INET ? &families[0] : af == AF_INET6 ? &families[1] : 0;
+}
+
+int srcpool_add(const union sockaddr_union *addr) {
+	struct family *f = family_of(SOCKADDR_UNION_AF(addr));
+	if(!f || n_sources == SRCPOOL_MAX) return -1;
+	sources[n_sources].addr = *addr;
+	/* bind() is to pick a free port */
+	if(f == &families[0]) sources[n_sources].addr.v4.sin_port = 0;
+	else sources[n_sources].addr.v6.sin6_port = 0;
+	f->idx[f->n++] = n_sources++;
+	return 0;
+}
+
+void srcpool_hash(int on) {
+	hashed = on;
+}
+
+int srcpool_family(void) {
+	return n_sources ? SOCKADDR_UNION_AF(&sources[0].addr) : AF_UNSPEC;
+}
+
+static unsigned hash_dest(const union sockaddr_union *dest) {
+	const unsigned char *p = SOCKADDR_UNION_ADDRESS(dest);
+	size_t i, n = SOCKADDR_UNION_AF(dest) == AF_INET ? 4 : 16;
+	unsigned short port = SOCKADDR_UNION_PORT(dest);
+	unsigned h = 2166136261u;
+	for(i=0;i<n;i++) h = (h ^ p[i]) * 16777619u;
+	h = (h ^ (port & 0xff)) * 16777619u;
+	return (h ^ (port >> 8)) * 16777619u;
+}
+
+int srcpool_bind(int fd, const union sockaddr_union *dest) {
+	struct family *f = family_of(SOCKADDR_UNION_AF(dest));
+	struct source *s;
+	unsigned i;
+	if(!f || !f->n) return 0;
+	if(f->n == 1) i = 0;
+	else if(hashed) i = hash_dest(dest) % f->n;
+	else i = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED) % f->n;
+	s = &sources[f->idx[i]];
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	/* otherwise bind() reserves a port for this source alone, and the
+	   ports run out after some 28000 connections */
+	int yes = 1;
+	setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+#endif
+	__atomic_fetch_add(&s->used, 1, __ATOMIC_RELAXED);
+	if(bindtoip(fd, &s->addr)) {
+		__atomic_fetch_add(&s->failed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+void srcpool_dump(int fd) {
+	char buf[INET6_ADDRSTRLEN];
+	unsigned i;
+	if(!n_sources) return;
+	dprintf(fd, "# HELP microsocks_source_connections_total Outgoing sockets bound to each -b address.\n"
+		"# TYPE microsocks_source_connections_total counter\n");
+	for(i=0;i<n_sources;i++) {
+		inet_ntop(SOCKADDR_UNION_AF(&sources[i].addr), SOCKADDR_UNION_ADDRESS(&sources[i].addr), buf, sizeof buf);
+		dprintf(fd, "microsocks_source_connections_total{source=\"%s\"} %llu\n",
+		        buf, __atomic_load_n(&sources[i].used, __ATOMIC_RELAXED));
+	}
+	dprintf(fd, "# HELP microsocks_source_bind_failures_total Failed binds to each -b address.\n"
+		"# TYPE microsocks_source_bind_failures_total counter\n");
+	for(i=0;i<n_sources;i++) {
+		inet_ntop(SOCKADDR_UNION_AF(&sources[i].addr), SOCKADDR_UNION_ADDRESS(&sources[i].addr), buf, sizeof buf);
+		dprintf(fd, "microsocks_source_bind_failures_total{source=\"%s\"} %llu\n",
+		        buf, __atomic_load_n(&sources[i].failed, __ATOMIC_RELAXED));
+	}
+}
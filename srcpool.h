@@ -0,0 +1,28 @@
+#ifndef SRCPOOL_H
+#define SRCPOOL_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "srcpool.c"
+
+/* outbound source addresses given with -b, of either family. every
+   connection to a target is bound to one of the family of the target,
+   picked round-robin, or with hashing by the target address, so each
+   target keeps seeing the same source. the port is left to connect(),
+   so the same one can be used towards different targets. */
+
+#define SRCPOOL_MAX 64
+
+/* returns -1 if there are SRCPOOL_MAX addresses already, or addr isn't
+   an ip address. */
+int srcpool_add(const union sockaddr_union *addr);
+void srcpool_hash(int on);
+/* family of the first address, AF_UNSPEC without any */
+int srcpool_family(void);
+/* binds fd, to be connected to dest, to a source of its family. it's
+   left unbound if there is none. returns -1 if bind() failed. */
+int srcpool_bind(int fd, const union sockaddr_union *dest);
+/* writes the per-source counters in the prometheus text format. */
+void srcpool_dump(int fd);
+
+#endif
@@ -0,0 +1,197 @@
+#include "timeout.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/* each level has 64 slots, which span 64 ticks of the level below. with
+   10ms ticks that's 640ms, 41s, 44min and 46h, longer timeouts are cut
+   to the latter. timers are moved down a level whenever the lower one
+   wrapped around, and run from the slots of level 0. */
+#define TICK_MS 10
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS 4
+#define MAX_TICKS ((1ULL << (LEVELS * LEVEL_BITS)) - 1)
+
+#ifdef __APPLE__
+#define WHEEL_CLOCK CLOCK_REALTIME /* no pthread_condattr_setclock() */
+#else
+#define WHEEL_CLOCK CLOCK_MONOTONIC
+#endif
+
+static struct conntimer *wheel[LEVELS][LEVEL_SIZE];
+static unsigned long long wheel_tick; /* the next tick to run */
+static unsigned long long wake_tick; /* when the wheel thread wakes up */
+static unsigned long long limits[CT_COUNT]; /* in ticks */
+static unsigned armed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+unsigned long long ct_now;
+
+static const char *kind_names[CT_COUNT] = {
+	[CT_HANDSHAKE] = "handshake", [CT_CONNECT] = "connect", [CT_IDLE] = "idle",
+};
+
+static unsigned long long ticks(void) {
+	struct timespec ts;
+	clock_gettime(WHEEL_CLOCK, &ts);
+	return (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+static void link_timer(struct conntimer *t) {
+	unsigned long long d;
+	struct conntimer **slot;
+	unsigned l;
+	if(t->expires < wheel_tick) t->expires = wheel_tick;
+	d = t->expires - wheel_tick;
+	if(d > MAX_TICKS) t->expires = wheel_tick + (d = MAX_TICKS);
+	for(l=0; l<LEVELS-1 && d >> ((l+1)*LEVEL_BITS); l++);
+	slot = &wheel[l][(t->expires >> (l*LEVEL_BITS)) & LEVEL_MASK];
+	if((t->next = *slot)) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void unlink_timer(struct conntimer *t) {
+	if(t->next) t->next->pprev = t->pprev;
+	*t->pprev = t->next;
+	t->pprev = 0;
+}
+
+/* relinks the timers of the current slot of level l, returns its index. */
+static unsigned cascade(unsigned l) {
+	unsigned idx = (wheel_tick >> (l*LEVEL_BITS)) & LEVEL_MASK;
+	struct conntimer *t = wheel[l][idx], *next;
+	wheel[l][idx] = 0;
+	for(; t; t = next) {
+		next = t->next;
+		link_timer(t);
+	}
+	return idx;
+}
+
+static void expire(struct conntimer *t) {
+	if(t->kind == CT_IDLE) {
+		unsigned long long due = __atomic_load_n(&t->active, __ATOMIC_RELAXED) + limits[CT_IDLE];
+		if(due > wheel_tick) {
+			/* there was traffic meanwhile */
+			t->expires = due;
+			link_timer(t);
+			return;
+		}
+	}
+	armed--;
+	__atomic_store_n(&t->fired, 1, __ATOMIC_RELAXED);
+	metric_inc(M_TIMEOUTS + t->kind);
+	alog_timeout(t->client, kind_names[t->kind]);
+	/* a failed connect is still reported to the client. while the target
+	   is looked up, there's only the client to wake the worker with. */
+	if(t->kind != CT_CONNECT) shutdown(t->client->fd, SHUT_RDWR);
+	else if(t->remote == -1) shutdown(t->client->fd, SHUT_RD);
+	if(t->remote != -1) shutdown(t->remote, SHUT_RDWR);
+}
+
+static void run(unsigned long long now) {
+	struct conntimer *t;
+	unsigned idx, l;
+	for(; wheel_tick <= now; wheel_tick++) {
+		idx = wheel_tick & LEVEL_MASK;
+		if(!idx) for(l=1; l<LEVELS && !cascade(l); l++);
+		while((t = wheel[0][idx])) {
+			unlink_timer(t);
+			expire(t);
+		}
+	}
+}
+
+/* the next tick with timers due, or the next cascade. */
+static unsigned long long next_wake(void) {
+	unsigned i, idx = wheel_tick & LEVEL_MASK;
+	if(!armed) return -1ULL;
+	for(i=idx; i<LEVEL_SIZE; i++)
+		if(wheel[0][i]) return wheel_tick + (i - idx);
+	return (wheel_tick | LEVEL_MASK) + 1;
+}
+
+static void* wheel_thread(void *data) {
+	struct timespec ts;
+	pthread_mutex_lock(&lock);
+	while(1) {
+		unsigned long long now = ticks();
+		run(now);
+		__atomic_store_n(&ct_now, now, __ATOMIC_RELAXED);
+		wake_tick = next_wake();
+		if(wake_tick == -1ULL) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		ts.tv_sec = wake_tick * TICK_MS / 1000;
+		ts.tv_nsec = wake_tick * TICK_MS % 1000 * 1000000;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	}
+	return 0;
+}
+
+int timeout_init(unsigned handshake, unsigned connect, unsigned idle) {
+	pthread_condattr_t attr;
+	pthread_t pt;
+	limits[CT_HANDSHAKE] = (handshake + TICK_MS - 1) / TICK_MS;
+	limits[CT_CONNECT] = (connect + TICK_MS - 1) / TICK_MS;
+	limits[CT_IDLE] = (idle + TICK_MS - 1) / TICK_MS;
+	if(!limits[CT_HANDSHAKE] && !limits[CT_CONNECT] && !limits[CT_IDLE]) return 0;
+	pthread_condattr_init(&attr);
+#ifndef __APPLE__
+	pthread_condattr_setclock(&attr, WHEEL_CLOCK);
+#endif
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+	wheel_tick = ct_now = ticks();
+	wake_tick = -1ULL;
+	if((errno = pthread_create(&pt, 0, wheel_thread, 0))) return -1;
+	pthread_detach(pt);
+	metric_inc(M_THREADS);
+	return 0;
+}
+
+void ct_arm(struct conntimer *t, enum ctkind kind, const struct client *client, int remote) {
+	unsigned long long now;
+	if(!limits[kind]) {
+		ct_cancel(t);
+		return;
+	}
+	now = ticks();
+	pthread_mutex_lock(&lock);
+	if(t->pprev) unlink_timer(t);
+	else if(!armed++) wheel_tick = now; /* nothing to run in between */
+	t->kind = kind;
+	t->client = client;
+	t->remote = remote;
+	t->fired = 0;
+	t->active = now;
+	t->expires = now + limits[kind];
+	link_timer(t);
+	if(t->expires < wake_tick) pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void ct_cancel(struct conntimer *t) {
+	/* even if t isn't linked anymore, it may be expiring right now, and
+	   taking the lock waits for that to finish */
+	if(!t->client) return; /* never armed */
+	pthread_mutex_lock(&lock);
+	if(t->pprev) {
+		unlink_timer(t);
+		armed--;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void ct_set_remote(struct conntimer *t, int remote) {
+	pthread_mutex_lock(&lock);
+	t->remote = remote;
+	pthread_mutex_unlock(&lock);
+}
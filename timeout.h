@@ -0,0 +1,52 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "timeout.c"
+
+/* timeouts of all connections are kept in one hierarchical timer wheel,
+   driven by a thread of its own. arming and cancelling take a mutex and
+   are O(1). when a timeout expires, the client socket and the target
+   socket are shut down, which wakes whichever thread or worker serves the
+   connection, in every mode, to tear it down as on a hangup. a connect
+   timeout only shuts down the target socket, so the failure can still be
+   reported, or without one the reading side of the client socket. */
+
+enum ctkind {
+	CT_HANDSHAKE, /* until the client sent its request */
+	CT_CONNECT, /* until the target connection is up */
+	CT_IDLE, /* since the last data relayed */
+	CT_COUNT,
+};
+
+struct conntimer {
+	struct conntimer *next, **pprev; /* pprev is 0 unless armed */
+	unsigned long long expires, active; /* in ticks */
+	const struct client *client;
+	int remote;
+	unsigned char kind, fired;
+};
+
+/* sets the timeouts in ms, 0 meaning none, and starts the wheel thread.
+   returns 0, or -1 with errno set. */
+int timeout_init(unsigned handshake, unsigned connect, unsigned idle);
+
+/* (re)arms t, which must be zeroed initially, for kind. remote is the
+   target fd to shut down along with the client, or -1. if there's no
+   timeout for kind, t is cancelled instead. */
+void ct_arm(struct conntimer *t, enum ctkind kind, const struct client *client, int remote);
+/* must be called before any of the fds t refers to are closed. */
+void ct_cancel(struct conntimer *t);
+/* changes the target fd, keeping the expiry. */
+void ct_set_remote(struct conntimer *t, int remote);
+/* whether t expired. */
+#define ct_fired(T) __atomic_load_n(&(T)->fired, __ATOMIC_RELAXED)
+
+/* idle timeouts are re-armed lazily: relays only note the time of their
+   last transfer, from a clock the wheel thread keeps, and the wheel
+   checks it once the timeout comes due. */
+extern unsigned long long ct_now;
+#define ct_touch(T) __atomic_store_n(&(T)->active, __atomic_load_n(&ct_now, __ATOMIC_RELAXED), __ATOMIC_RELAXED)
+
+#endif
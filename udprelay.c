@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include "udprelay.h"
+#if CONFIG_UDP
+#include "dnscache.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "srcpool.h"
+#include "socks5.h"
+#include "timeout.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+
+/* datagrams are received and sent in batches with recvmmsg/sendmmsg.
+   every socks header is parsed or built in place: datagrams from targets
+   are received behind enough room for the header, so that header and
+   payload go out as one contiguous datagram without copying.
+
+   targets the client sent to are remembered in a small nat table, only
+   they may send datagrams back. entries expire after UDP_NAT_TTL seconds
+   without traffic, the whole association ends with its tcp connection.
+
+   host names that aren't in the dns cache are looked up by the resolver
+   pool, meanwhile their datagrams are held back and other traffic of the
+   association keeps flowing. */
+
+#ifndef UDP_SLOT
+#define UDP_SLOT 4608 /* biggest datagram relayed, including socks header */
+#endif
+#ifndef UDP_NAT_TTL
+#define UDP_NAT_TTL 120
+#endif
+#define UDP_BATCH 16
+#define UDP_HDRMAX 22 /* reply header with an ipv6 address */
+#define UDP_POLL_MS 10000
+#define UDP_PENDING 16 /* datagrams held back for lookups, more are dropped */
+#define NAT_SLOTS 512 /* power of 2, at most half of it is used */
+/* socket buffers to absorb bursts, capped by net.core.[rw]mem_max */
+#define UDP_SOCKBUF (1024*1024)
+
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+#ifdef UDP_SEGMENT
+/* runs of equally sized datagrams to the client are sent with a single
+   segmentation offload send, until the kernel refuses it once. segments
+   are kept small enough for an ethernet mtu. */
+#define GSO_SEGMAX 1452
+#define GSO_MAX 65000
+static int gso_ok = 1;
+#endif
+
+struct natentry {
+	union sockaddr_union addr;
+	time_t last; /* 0: free slot */
+};
+
+/* a datagram waiting for the lookup of its target */
+struct udpjob {
+	struct dnsjob job;
+	size_t len;
+	unsigned char data[UDP_SLOT];
+};
+
+struct udprelay {
+	int tcpfd, cfd, ofd[2]; /* ofd: ipv4 and ipv6 sockets to targets */
+	union sockaddr_union client;
+	int client_known;
+	int dnsq_ok; /* dnsq is set up on the first lookup */
+	unsigned pending; /* jobs with the resolver pool */
+	struct dnsqueue dnsq;
+	unsigned nnat;
+	struct natentry nat[NAT_SLOTS];
+	struct mmsghdr msgs[UDP_BATCH], out[2][UDP_BATCH];
+	struct iovec iov[UDP_BATCH], oiov[UDP_BATCH];
+	union sockaddr_union names[UDP_BATCH], dests[UDP_BATCH];
+#ifdef UDP_SEGMENT
+	char ctl[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+	unsigned char buf[UDP_BATCH][UDP_SLOT];
+};
+
+static time_t now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static int same_ip(const union sockaddr_union *a, const union sockaddr_union *b) {
+	if(SOCKADDR_UNION_AF(a) != SOCKADDR_UNION_AF(b)) return 0;
+	if(SOCKADDR_UNION_AF(a) == AF_INET)
+		return a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+	return !memcmp(&a->v6.sin6_addr, &b->v6.sin6_addr, 16);
+}
+
+static int same_addr(const union sockaddr_union *a, const union sockaddr_union *b) {
+	return same_ip(a, b) && SOCKADDR_UNION_PORT(a) == SOCKADDR_UNION_PORT(b);
+}
+
+static unsigned hash_addr(const union sockaddr_union *a) {
+	const unsigned char *p = SOCKADDR_UNION_ADDRESS(a);
+	unsigned i, n = SOCKADDR_UNION_AF(a) == AF_INET ? 4 : 16;
+	unsigned h = 2166136261u ^ SOCKADDR_UNION_PORT(a);
+	for(i=0;i<n;i++) h = (h ^ p[i]) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+/* returns the slot of addr, or the free slot where it belongs */
+static unsigned nat_find(struct udprelay *r, const union sockaddr_union *addr) {
+	unsigned i = hash_addr(addr) & (NAT_SLOTS - 1);
+	while(r->nat[i].last && !same_addr(&r->nat[i].addr, addr))
+		i = (i + 1) & (NAT_SLOTS - 1);
+	return i;
+}
+
+/* backward shift deletion, keeps probe chains intact without tombstones */
+static void nat_delete(struct udprelay *r, unsigned i) {
+	unsigned j = i;
+	while(1) {
+		j = (j + 1) & (NAT_SLOTS - 1);
+		if(!r->nat[j].last) break;
+		unsigned h = hash_addr(&r->nat[j].addr) & (NAT_SLOTS - 1);
+		if((j > i && (h <= i || h > j)) || (j < i && (h <= i && h > j))) {
+			r->nat[i] = r->nat[j];
+			i = j;
+		}
+	}
+	r->nat[i].last = 0;
+	r->nnat--;
+}
+
+static void nat_sweep(struct udprelay *r, time_t now) {
+	unsigned i = 0;
+	while(i < NAT_SLOTS) {
+		/* deletion may shift the next entry into slot i, look again */
+		if(r->nat[i].last && now - r->nat[i].last >= UDP_NAT_TTL)
+			nat_delete(r, i);
+		else
+			i++;
+	}
+}
+
+static int nat_add(struct udprelay *r, const union sockaddr_union *addr, time_t now) {
+	unsigned i = nat_find(r, addr);
+	if(!r->nat[i].last) {
+		if(r->nnat >= NAT_SLOTS / 2) {
+			nat_sweep(r, now);
+			if(r->nnat >= NAT_SLOTS / 2) return -1;
+			i = nat_find(r, addr);
+		}
+		r->nat[i].addr = *addr;
+		r->nnat++;
+	}
+	r->nat[i].last = now;
+	return 0;
+}
+
+static int nat_match(struct udprelay *r, const union sockaddr_union *addr, time_t now) {
+	unsigned i = nat_find(r, addr);
+	if(!r->nat[i].last || now - r->nat[i].last >= UDP_NAT_TTL) return 0;
+	r->nat[i].last = now;
+	return 1;
+}
+
+static int udp_socket(int af) {
+	int fd = socket(af, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0), sz = UDP_SOCKBUF;
+	if(fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz);
+	return fd;
+}
+
+int udp_open(int tcpfd, const union sockaddr_union *client,
+             const union sockaddr_union *declared, union sockaddr_union *relayaddr) {
+	union sockaddr_union local;
+	socklen_t l = sizeof local;
+	int fd;
+	if(getsockname(tcpfd, (void*) &local, &l)) return -1;
+	if(SOCKADDR_UNION_AF(&local) == AF_INET) local.v4.sin_port = 0;
+	else local.v6.sin6_port = 0;
+	if((fd = udp_socket(SOCKADDR_UNION_AF(&local))) == -1) return -1;
+	l = sizeof *relayaddr;
+	if(bind(fd, (void*) &local, SOCKADDR_UNION_LENGTH(&local)) ||
+	   getsockname(fd, (void*) relayaddr, &l))
+		goto fail;
+	/* the kernel drops datagrams from anywhere else on a connected socket */
+	if(SOCKADDR_UNION_PORT(declared) && same_ip(declared, client) &&
+	   connect(fd, (void*) declared, SOCKADDR_UNION_LENGTH(declared)))
+		goto fail;
+	return fd;
+fail:;
+	int e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+}
+
+static int from_client(struct udprelay *r, union sockaddr_union *src) {
+	if(r->client_known) return same_addr(src, &r->client);
+	if(!same_ip(src, &r->client)) return 0;
+	/* the first datagram from the client's ip fixes its port */
+	if(connect(r->cfd, (void*) src, SOCKADDR_UNION_LENGTH(src))) return 0;
+	r->client = *src;
+	r->client_known = 1;
+	return 1;
+}
+
+/* prefer the family of the -b address, like tcp does */
+static void pick_addr(union sockaddr_union *dst, const struct dnsresult *res) {
+	unsigned i;
+	for(i=0; i<res->n; i++)
+		if(SOCKADDR_UNION_AF(&res->addr[i]) == srcpool_family()) break;
+	*dst = res->addr[i < res->n ? i : 0];
+}
+
+/* hands the lookup of name to the resolver pool, along with a copy of
+   the n bytes of payload to send once it's done. returns -2, or -1 if the
+   datagram is to be dropped. */
+static int hold(struct udprelay *r, const char *name, unsigned short port,
+                const unsigned char *data, size_t n) {
+	struct udpjob *u;
+	if(r->pending >= UDP_PENDING) return -1;
+	if(!r->dnsq_ok) {
+		if(resolver_init(RESOLVER_THREADS) || dnsqueue_init(&r->dnsq)) return -1;
+		r->dnsq_ok = 1;
+	}
+	if(!(u = malloc(sizeof *u))) return -1;
+	strcpy(u->job.host, name);
+	u->job.port = port;
+	u->job.arg = r;
+	u->len = n;
+	memcpy(u->data, data, n);
+	resolver_submit(&r->dnsq, &u->job);
+	r->pending++;
+	return -2;
+}
+
+/* parses the socks header of a datagram from the client into dst.
+   returns the header length, -1 if the datagram is to be dropped, or -2
+   if it's held back until its target is looked up. */
+static int parse_header(struct udprelay *r, unsigned char *p, size_t n, union sockaddr_union *dst) {
+	struct dnsresult res;
+	struct s5udp h;
+	char name[256];
+	int err;
+	/* fragments are not supported, rfc 1928 allows to drop them */
+	if(s5_udp(p, n, &h) != S5_DONE || h.frag) return -1;
+	memset(dst, 0, sizeof *dst);
+	switch(h.addr.type) {
+		case S5_IPV4:
+			dst->v4.sin_family = AF_INET;
+			memcpy(&dst->v4.sin_addr, h.addr.p, 4);
+			dst->v4.sin_port = htons(h.addr.port);
+			break;
+		case S5_IPV6:
+			dst->v6.sin6_family = AF_INET6;
+			memcpy(&dst->v6.sin6_addr, h.addr.p, 16);
+			dst->v6.sin6_port = htons(h.addr.port);
+			break;
+		default:
+			memcpy(name, h.addr.p, h.addr.len);
+			name[h.addr.len] = 0;
+			if(!dns_cached(name, h.addr.port, &res, &err))
+				return hold(r, name, h.addr.port, p + h.len, n - h.len);
+			if(err || !res.n) return -1;
+			pick_addr(dst, &res);
+	}
+	return h.len;
+}
+
+/* builds the header for a datagram from src right in front of data,
+   returns its length. */
+static int build_header(unsigned char *data, const union sockaddr_union *src) {
+	unsigned char *p;
+	if(SOCKADDR_UNION_AF(src) == AF_INET) {
+		p = data - 10;
+		p[3] = 1;
+		memcpy(p+4, &src->v4.sin_addr, 4);
+		memcpy(p+8, &src->v4.sin_port, 2);
+	} else {
+		p = data - 22;
+		p[3] = 4;
+		memcpy(p+4, &src->v6.sin6_addr, 16);
+		memcpy(p+20, &src->v6.sin6_port, 2);
+	}
+	p[0] = p[1] = p[2] = 0;
+	return data - p;
+}
+
+/* there's one per family, so with hashing it's always the same source. */
+static int target_socket(int af) {
+	union sockaddr_union any = {.v4.sin_family = af};
+	int fd = udp_socket(af);
+	if(fd == -1) return -1;
+	if(srcpool_bind(fd, &any)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* sends as many of the n messages as the socket takes right now,
+   the rest is dropped like on any congested link. err gets the errno
+   of the send that stopped short, or 0. */
+static unsigned send_batch(int fd, struct mmsghdr *msgs, unsigned n, int *err) {
+	unsigned sent = 0;
+	*err = 0;
+	while(sent < n) {
+		int ret = sendmmsg(fd, msgs + sent, n - sent, MSG_DONTWAIT);
+		if(ret <= 0) {
+			if(ret < 0) *err = errno;
+			break;
+		}
+		sent += ret;
+	}
+	return sent;
+}
+
+static void prepare_recv(struct udprelay *r, size_t off) {
+	unsigned i;
+	for(i=0;i<UDP_BATCH;i++) {
+		r->iov[i].iov_base = r->buf[i] + off;
+		r->iov[i].iov_len = UDP_SLOT - off;
+		r->msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &r->names[i], .msg_namelen = sizeof r->names[i],
+			.msg_iov = &r->iov[i], .msg_iovlen = 1,
+		};
+	}
+}
+
+static void relay_up(struct udprelay *r, time_t now) {
+	unsigned i, k, cnt[2] = {0, 0}, sent = 0, held = 0;
+	long long bytes = 0;
+	int n, hl, err;
+	prepare_recv(r, 0);
+	if((n = recvmmsg(r->cfd, r->msgs, UDP_BATCH, MSG_DONTWAIT, 0)) <= 0) return;
+	for(i=0;i<(unsigned) n;i++) {
+		struct msghdr *h = &r->msgs[i].msg_hdr;
+		union sockaddr_union *dst = &r->dests[i];
+		size_t len = r->msgs[i].msg_len;
+		if((h->msg_flags & MSG_TRUNC) || !from_client(r, &r->names[i]))
+			continue;
+		if((hl = parse_header(r, r->buf[i], len, dst)) < 0) {
+			held += hl == -2;
+			continue;
+		}
+		k = SOCKADDR_UNION_AF(dst) == AF_INET6;
+		if(r->ofd[k] == -1 && (r->ofd[k] = target_socket(SOCKADDR_UNION_AF(dst))) == -1)
+			continue;
+		if(nat_add(r, dst, now)) continue;
+		r->oiov[i].iov_base = r->buf[i] + hl;
+		r->oiov[i].iov_len = len - hl;
+		r->out[k][cnt[k]++].msg_hdr = (struct msghdr) {
+			.msg_name = dst, .msg_namelen = SOCKADDR_UNION_LENGTH(dst),
+			.msg_iov = &r->oiov[i], .msg_iovlen = 1,
+		};
+		bytes += len - hl;
+	}
+	for(k=0;k<2;k++) if(cnt[k]) sent += send_batch(r->ofd[k], r->out[k], cnt[k], &err);
+	metric_add(M_UDP_DATAGRAMS_UP, sent);
+	metric_add(M_UDP_DROPPED, n - sent - held);
+	metric_add(M_BYTES_UP, bytes);
+}
+
+/* sends the datagrams whose lookups are done */
+static void relay_resolved(struct udprelay *r, time_t now) {
+	struct dnsjob *j, *next;
+	unsigned sent = 0, dropped = 0;
+	long long bytes = 0;
+	for(j = dnsqueue_take(&r->dnsq); j; j = next) {
+		struct udpjob *u = (void*) j;
+		union sockaddr_union dst;
+		int k;
+		next = j->next;
+		r->pending--;
+		if(j->err || !j->res.n) {
+			dropped++;
+			free(u);
+			continue;
+		}
+		pick_addr(&dst, &j->res);
+		k = SOCKADDR_UNION_AF(&dst) == AF_INET6;
+		if((r->ofd[k] == -1 && (r->ofd[k] = target_socket(SOCKADDR_UNION_AF(&dst))) == -1) ||
+		   nat_add(r, &dst, now) ||
+		   sendto(r->ofd[k], u->data, u->len, MSG_DONTWAIT, (void*) &dst, SOCKADDR_UNION_LENGTH(&dst)) < 0) {
+			dropped++;
+		} else {
+			sent++;
+			bytes += u->len;
+		}
+		free(u);
+	}
+	metric_add(M_UDP_DATAGRAMS_UP, sent);
+	metric_add(M_UDP_DROPPED, dropped);
+	metric_add(M_BYTES_UP, bytes);
+}
+
+/* waits for the lookups still running, the jobs point to dnsq. */
+static void drop_lookups(struct udprelay *r) {
+	struct dnsjob *j, *next;
+	while(r->pending) {
+		struct pollfd pfd = {.fd = r->dnsq.fd[0], .events = POLLIN};
+		if(poll(&pfd, 1, -1) == -1 && errno != EINTR) return;
+		for(j = dnsqueue_take(&r->dnsq); j; j = next) {
+			next = j->next;
+			free(j);
+			r->pending--;
+			metric_inc(M_UDP_DROPPED);
+		}
+	}
+	dnsqueue_free(&r->dnsq);
+}
+
+/* sends the datagrams in oiov[first..n) to the client, returns how many
+   made it. */
+static unsigned send_down(struct udprelay *r, unsigned first, unsigned n) {
+	unsigned i = first, nm = 0, sent, done = 0;
+	int err;
+	while(i < n) {
+		unsigned j = i + 1;
+		struct msghdr *h = &r->out[0][nm].msg_hdr;
+#ifdef UDP_SEGMENT
+		size_t l = r->oiov[i].iov_len, total = l;
+		if(__atomic_load_n(&gso_ok, __ATOMIC_RELAXED) && l <= GSO_SEGMAX) {
+			/* all segments but the last must have the same size */
+			while(j < n && r->oiov[j].iov_len == l && total + l <= GSO_MAX)
+				total += r->oiov[j++].iov_len;
+			if(j < n && r->oiov[j].iov_len < l && total + r->oiov[j].iov_len <= GSO_MAX)
+				total += r->oiov[j++].iov_len;
+		}
+#endif
+		*h = (struct msghdr) {.msg_iov = &r->oiov[i], .msg_iovlen = j - i};
+#ifdef UDP_SEGMENT
+		if(j - i > 1) {
+			uint16_t seg = l;
+			h->msg_control = r->ctl[nm];
+			h->msg_controllen = sizeof r->ctl[nm];
+			struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+			cm->cmsg_level = IPPROTO_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof seg);
+			memcpy(CMSG_DATA(cm), &seg, sizeof seg);
+		}
+#endif
+		nm++;
+		i = j;
+	}
+	sent = send_batch(r->cfd, r->out[0], nm, &err);
+	for(i=0;i<sent;i++) done += r->out[0][i].msg_hdr.msg_iovlen;
+#ifdef UDP_SEGMENT
+	if(sent < nm && r->out[0][sent].msg_hdr.msg_iovlen > 1 &&
+	   err && err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS) {
+		/* offload not supported, send the rest one by one */
+		__atomic_store_n(&gso_ok, 0, __ATOMIC_RELAXED);
+		done += send_down(r, r->out[0][sent].msg_hdr.msg_iov - r->oiov, n);
+	}
+#endif
+	return done;
+}
+
+static void relay_down(struct udprelay *r, int k, time_t now) {
+	unsigned i, cnt = 0, sent = 0;
+	long long bytes = 0;
+	int n;
+	prepare_recv(r, UDP_HDRMAX);
+	if((n = recvmmsg(r->ofd[k], r->msgs, UDP_BATCH, MSG_DONTWAIT, 0)) <= 0) return;
+	for(i=0;i<(unsigned) n && r->client_known;i++) {
+		size_t len = r->msgs[i].msg_len;
+		if((r->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || !nat_match(r, &r->names[i], now))
+			continue;
+		int hl = build_header(r->buf[i] + UDP_HDRMAX, &r->names[i]);
+		r->oiov[cnt].iov_base = r->buf[i] + UDP_HDRMAX - hl;
+		r->oiov[cnt].iov_len = hl + len;
+		cnt++;
+		bytes += len;
+	}
+	if(cnt) sent = send_down(r, 0, cnt);
+	metric_add(M_UDP_DATAGRAMS_DOWN, sent);
+	metric_add(M_UDP_DROPPED, n - sent);
+	metric_add(M_BYTES_DOWN, bytes);
+}
+
+void udp_relay(int tcpfd, int udpfd, const union sockaddr_union *client, struct conntimer *to) {
+	struct udprelay *r = calloc(1, sizeof *r);
+	socklen_t l = sizeof r->client;
+	int k;
+	if(!r) {
+		close(udpfd);
+		return;
+	}
+	r->tcpfd = tcpfd;
+	r->cfd = udpfd;
+	r->ofd[0] = r->ofd[1] = -1;
+	r->client = *client;
+	if(!getpeername(udpfd, (void*) &r->client, &l)) r->client_known = 1;
+	time_t now = now_sec(), next_sweep = now + UDP_NAT_TTL;
+	while(1) {
+		struct pollfd fds[5] = {
+			{.fd = tcpfd, .events = POLLIN},
+			{.fd = r->cfd, .events = POLLIN},
+			{.fd = r->ofd[0], .events = POLLIN},
+			{.fd = r->ofd[1], .events = POLLIN},
+			{.fd = r->dnsq_ok ? r->dnsq.fd[0] : -1, .events = POLLIN},
+		};
+		int n = poll(fds, 5, UDP_POLL_MS);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		now = now_sec();
+		if(fds[0].revents) {
+			/* the client isn't supposed to send anything here */
+			char buf[256];
+			ssize_t m = recv(tcpfd, buf, sizeof buf, MSG_DONTWAIT);
+			if(!m || (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				break;
+		}
+		/* errors are reported by the following recv too, which clears them */
+		if(fds[1].revents) {
+			relay_up(r, now);
+			ct_touch(to);
+		}
+		for(k=0;k<2;k++) if(fds[2+k].revents) {
+			relay_down(r, k, now);
+			ct_touch(to);
+		}
+		if(fds[4].revents) relay_resolved(r, now);
+		if(now >= next_sweep) {
+			nat_sweep(r, now);
+			next_sweep = now + UDP_NAT_TTL;
+		}
+	}
+	close(r->cfd);
+	for(k=0;k<2;k++) if(r->ofd[k] != -1) close(r->ofd[k]);
+	if(r->dnsq_ok) drop_lookups(r);
+	free(r);
+}
+#endif
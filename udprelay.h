@@ -0,0 +1,33 @@
+#ifndef UDPRELAY_H
+#define UDPRELAY_H
+
+#include "server.h"
+
+#pragma RcB2 DEP "udprelay.c"
+
+#ifndef CONFIG_UDP
+#ifdef __linux__
+#define CONFIG_UDP 1
+#else
+#define CONFIG_UDP 0
+#endif
+#endif
+
+/* opens the socket of a UDP ASSOCIATE request on the local address of the
+   client's tcp connection tcpfd. declared is the address the client said
+   it'll send from; if it matches the client and has a port, only datagrams
+   from there are accepted, otherwise the first datagram from the client's
+   ip decides. relayaddr receives the address to report to the client.
+   returns the fd or -1. */
+int udp_open(int tcpfd, const union sockaddr_union *client,
+             const union sockaddr_union *declared, union sockaddr_union *relayaddr);
+
+struct conntimer;
+
+/* relays datagrams between the client and any targets until the tcp
+   connection is closed, as the idle timeout to does as well. to is
+   touched whenever datagrams are relayed. outgoing sockets are bound to
+   a -b source of their family. closes udpfd. */
+void udp_relay(int tcpfd, int udpfd, const union sockaddr_union *client, struct conntimer *to);
+
+#endif
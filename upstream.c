@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include "upstream.h"
+#include "metrics.h"
+#include "srcpool.h"
+#include "accesslog.h"
+#include "socks5.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifdef __APPLE__
+#define POOL_CLOCK CLOCK_REALTIME /* no pthread_condattr_setclock() */
+#else
+#define POOL_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* socks reply codes used here */
+#define REP_GENERAL_FAILURE 1
+#define REP_TTL_EXPIRED 6
+/* how long to wait before trying again when the parent can't be reached */
+#define RETRY_MS 1000
+
+struct spare {
+	int fd;
+	long long born; /* ms */
+};
+
+static union sockaddr_union parent;
+static unsigned char auth[3 + 2*255]; /* username/password message */
+static size_t auth_len;
+static unsigned max_spares, max_idle, timeout_ms;
+static const struct socktune *tune;
+
+/* the oldest spare is at the bottom, connections are taken from the top
+   as the freshest are least likely to have been dropped by the parent. */
+static struct spare *spares;
+static unsigned n_spares, want = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(POOL_CLOCK, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void set_timeouts(int fd, unsigned ms) {
+	struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+static int send_all(int fd, const void *buf, size_t n) {
+	const char *p = buf;
+	while(n) {
+		ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+		if(w == -1 && errno == EINTR) continue;
+		if(w <= 0) return -1;
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+/* returns -1 with errno set, or 0 for eof. */
+static int recv_all(int fd, void *buf, size_t n) {
+	char *p = buf;
+	while(n) {
+		ssize_t r = recv(fd, p, n, 0);
+		if(r == -1 && errno == EINTR) continue;
+		if(r <= 0) {
+			if(!r) errno = 0;
+			return -1;
+		}
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* connects to the parent and goes through greeting and authentication.
+   timeouts stay set, until the reply to the request came in. */
+static int dial(void) {
+	unsigned char greeting[3] = {5, 1, auth_len ? 2 : 0}, reply[2];
+	int fd = socket(SOCKADDR_UNION_AF(&parent), SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(fd == -1) return -1;
+	if(tune) socktune_apply(fd, tune);
+	set_timeouts(fd, timeout_ms);
+	if(srcpool_bind(fd, &parent) ||
+	   connect(fd, (void*) &parent, SOCKADDR_UNION_LENGTH(&parent)) ||
+	   send_all(fd, greeting, sizeof greeting) ||
+	   recv_all(fd, reply, 2) || reply[0] != 5 || reply[1] != greeting[2])
+		goto fail;
+	if(auth_len && (send_all(fd, auth, auth_len) ||
+	   recv_all(fd, reply, 2) || reply[1] != 0))
+		goto fail;
+	return fd;
+fail:;
+	int e = errno;
+	close(fd);
+	errno = e ? e : ECONNREFUSED;
+	return -1;
+}
+
+/* socket timeouts show up as EAGAIN, or EINPROGRESS for connect(). */
+static int fail_code(int err) {
+	if(err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS || err == ETIMEDOUT)
+		return -REP_TTL_EXPIRED;
+	return -REP_GENERAL_FAILURE;
+}
+
+/* a spare the parent closed, or sent something on, is readable. */
+static int alive(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static int take(void) {
+	struct spare s;
+	while(1) {
+		pthread_mutex_lock(&lock);
+		if(!n_spares) {
+			/* ran dry: the refill thread makes up for it */
+			if(want < max_spares) want = want * 2 < max_spares ? want * 2 : max_spares;
+			pthread_cond_signal(&cond);
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		s = spares[--n_spares];
+		metric_dec(M_UPSTREAM_SPARES);
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&lock);
+		if(alive(s.fd)) return s.fd;
+		close(s.fd);
+	}
+}
+
+static void* refill_thread(void *arg) {
+	struct timespec ts;
+	int failing = 0, down = 0;
+	pthread_mutex_lock(&lock);
+	while(1) {
+		long long t = now_ms(), wake = -1;
+		while(n_spares && t - spares[0].born >= max_idle) {
+			close(spares[0].fd);
+			memmove(spares, spares + 1, --n_spares * sizeof *spares);
+			metric_dec(M_UPSTREAM_SPARES);
+			metric_inc(M_UPSTREAM_EXPIRED);
+			/* one wasn't needed for max_idle, so fewer will do */
+			if(want > 1) want--;
+		}
+		if(n_spares < want && !failing) {
+			pthread_mutex_unlock(&lock);
+			int fd = dial();
+			/* only changes are logged, not every retry */
+			if(fd == -1 && !down) alog_msg("upstream: can't reach the parent: %s", strerror(errno));
+			else if(fd != -1 && down) alog_msg("upstream: the parent is reachable again");
+			down = fd == -1;
+			pthread_mutex_lock(&lock);
+			if(fd != -1) {
+				spares[n_spares++] = (struct spare) {.fd = fd, .born = now_ms()};
+				metric_inc(M_UPSTREAM_SPARES);
+				continue;
+			}
+			failing = 1;
+			wake = now_ms() + RETRY_MS;
+		} else if(failing) {
+			failing = 0;
+			continue;
+		}
+		if(n_spares && (wake == -1 || spares[0].born + max_idle < wake))
+			wake = spares[0].born + max_idle;
+		if(wake == -1) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		ts.tv_sec = wake / 1000;
+		ts.tv_nsec = wake % 1000 * 1000000;
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	}
+	return 0;
+}
+
+int upstream_init(const char *spec, unsigned spares_max, unsigned idle,
+                  unsigned timeout, const struct socktune *t) {
+	char host[256], *p;
+	const char *at = strrchr(spec, '@'), *hp = at ? at + 1 : spec;
+	pthread_condattr_t attr;
+	pthread_t pt;
+	size_t l;
+	if(at) {
+		const char *colon = memchr(spec, ':', at - spec);
+		size_t ul = colon ? colon - spec : 0, pl = colon ? at - colon - 1 : 0;
+		if(!colon || !ul || ul > 255 || pl > 255) {
+			errno = EINVAL;
+			return -1;
+		}
+		auth[0] = 1;
+		auth[1] = ul;
+		memcpy(auth + 2, spec, ul);
+		auth[2 + ul] = pl;
+		memcpy(auth + 3 + ul, colon + 1, pl);
+		auth_len = 3 + ul + pl;
+	}
+	if((l = strlen(hp)) >= sizeof host) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, hp, l + 1);
+	if(!(p = strrchr(host, ':'))) {
+		errno = EINVAL;
+		return -1;
+	}
+	*p++ = 0;
+	if(host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+	if(resolve_sa(host, atoi(p), &parent)) {
+		errno = EINVAL;
+		return -1;
+	}
+	max_spares = spares_max ? spares_max : 1;
+	max_idle = idle;
+	timeout_ms = timeout;
+	tune = t;
+	if(!(spares = calloc(max_spares, sizeof *spares))) return -1;
+	pthread_condattr_init(&attr);
+#ifndef __APPLE__
+	pthread_condattr_setclock(&attr, POOL_CLOCK);
+#endif
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if((errno = pthread_create(&pt, 0, refill_thread, 0))) return -1;
+	pthread_detach(pt);
+	metric_inc(M_THREADS);
+	return 0;
+}
+
+int upstream_connect(const unsigned char *req, size_t len) {
+	unsigned char rep[4 + 1 + 255 + 2];
+	struct s5request r;
+	enum s5status st;
+	size_t got = 4 + 1 + 2; /* the shortest reply */
+	int fd, spare, retried = 0;
+	while(1) {
+		spare = (fd = take()) != -1;
+		metric_inc(spare ? M_UPSTREAM_HITS : M_UPSTREAM_MISSES);
+		if(!spare && (fd = dial()) == -1)
+			return fail_code(errno);
+		if(!send_all(fd, req, len) && !recv_all(fd, rep, got)) break;
+		int e = errno;
+		close(fd);
+		/* the parent may have dropped the spare just now, a fresh
+		   connection gets another try. */
+		if(!spare || retried++ || fail_code(e) == -REP_TTL_EXPIRED)
+			return fail_code(e);
+	}
+	/* read no further than the reply, the rest belongs to the tunnel.
+	   the bound address the parent reports is of no use here. */
+	while((st = s5_reply(rep, got, &r)) == S5_NEED_MORE) {
+		if(recv_all(fd, rep + got, r.len - got)) break;
+		got = r.len;
+	}
+	if(st != S5_DONE || r.cmd != 0) {
+		close(fd);
+		/* only a complete refusal has a code worth passing on, a
+		   cut short or malformed reply must not look like success. */
+		return st == S5_DONE && r.cmd <= 8 ? -(int) r.cmd : -REP_GENERAL_FAILURE;
+	}
+	set_timeouts(fd, 0);
+	return fd;
+}
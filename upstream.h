@@ -0,0 +1,26 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stddef.h>
+#include "server.h"
+
+#pragma RcB2 DEP "upstream.c"
+
+/* forwarding of CONNECT requests to a parent socks5 server. a pool of
+   spare connections to it, already past the greeting and authentication,
+   leaves only the round trip of the request itself to a new tunnel. the
+   pool doubles its size whenever it ran dry, up to max_spares, and
+   shrinks by one whenever a spare reached max_idle ms unused. */
+
+/* spec is [user:pass@]host:port. timeout_ms limits connecting to the
+   parent and waiting for its replies. returns -1 if host can't be
+   resolved or the refill thread can't be started. */
+int upstream_init(const char *spec, unsigned max_spares, unsigned max_idle,
+                  unsigned timeout_ms, const struct socktune *tune);
+
+/* sends the socks5 request req of len bytes to the parent. returns the
+   connection, in blocking mode, once the parent replied success, or
+   minus its reply code. */
+int upstream_connect(const unsigned char *req, size_t len);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#if CONFIG_URING
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define LOAD_ACQ(X) __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define STORE_REL(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, 0, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n) {
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+void uring_free(struct uring *r) {
+	if(r->bufs) munmap(r->bufs, (size_t)(r->br_mask + 1) * r->bufsize);
+	if(r->br) munmap(r->br, (r->br_mask + 1) * sizeof(struct io_uring_buf));
+	if(r->sqes) munmap(r->sqes, r->sqes_sz);
+	if(r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_sz);
+	if(r->sq_ptr) munmap(r->sq_ptr, r->sq_sz);
+	if(r->fd != -1) close(r->fd);
+	memset(r, 0, sizeof *r);
+	r->fd = -1;
+}
+
+int uring_init(struct uring *r, unsigned entries) {
+	struct io_uring_params p;
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+	if((r->fd = sys_setup(entries, &p)) == -1) return -1;
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_sz > r->sq_sz) r->sq_sz = r->cq_sz;
+		r->cq_sz = r->sq_sz;
+	}
+	r->sq_ptr = mmap(0, r->sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = 0;
+		goto fail;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else {
+		r->cq_ptr = mmap(0, r->cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = 0;
+			goto fail;
+		}
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(0, r->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED) {
+		r->sqes = 0;
+		goto fail;
+	}
+	char *sq = r->sq_ptr, *cq = r->cq_ptr;
+	r->sq_head = (void*)(sq + p.sq_off.head);
+	r->sq_tail = (void*)(sq + p.sq_off.tail);
+	r->sq_mask = (void*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (void*)(sq + p.sq_off.array);
+	r->cq_head = (void*)(cq + p.cq_off.head);
+	r->cq_tail = (void*)(cq + p.cq_off.tail);
+	r->cq_mask = (void*)(cq + p.cq_off.ring_mask);
+	r->cqes = (void*)(cq + p.cq_off.cqes);
+	r->sq_local_tail = *r->sq_tail;
+	return 0;
+fail:;
+	int e = errno;
+	uring_free(r);
+	errno = e;
+	return -1;
+}
+
+int uring_setup_bufs(struct uring *r, unsigned count, unsigned size) {
+	struct io_uring_buf_reg reg;
+	size_t ringsz = count * sizeof(struct io_uring_buf);
+	unsigned i;
+	r->br = mmap(0, ringsz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(r->br == MAP_FAILED) {
+		r->br = 0;
+		return -1;
+	}
+	r->br_mask = count - 1;
+	r->bufsize = size;
+	/* buffers are only touched by the kernel once data arrives, so
+	   anonymous memory keeps the footprint low while tunnels are idle. */
+	r->bufs = mmap(0, (size_t) count * size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(r->bufs == MAP_FAILED) {
+		r->bufs = 0;
+		return -1;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (unsigned long) r->br;
+	reg.ring_entries = count;
+	reg.bgid = 0;
+	if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) return -1;
+	for(i=0;i<count;i++) uring_buf_return(r, i);
+	return 0;
+}
+
+void uring_buf_return(struct uring *r, unsigned short bid) {
+	struct io_uring_buf *b = &r->br->bufs[r->br_tail & r->br_mask];
+	b->addr = (unsigned long) uring_buf(r, bid);
+	b->len = r->bufsize;
+	b->bid = bid;
+	STORE_REL(r->br->tail, ++r->br_tail);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+	unsigned head = LOAD_ACQ(*r->sq_head);
+	if(r->sq_local_tail - head > *r->sq_mask) {
+		uring_submit(r, 0);
+		head = LOAD_ACQ(*r->sq_head);
+		if(r->sq_local_tail - head > *r->sq_mask) return 0;
+	}
+	unsigned idx = r->sq_local_tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	r->sq_array[idx] = idx;
+	r->sq_local_tail++;
+	r->to_submit++;
+	STORE_REL(*r->sq_tail, r->sq_local_tail);
+	return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned wait) {
+	int ret;
+	do ret = sys_enter(r->fd, r->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	while(ret == -1 && errno == EINTR && !wait);
+	if(ret >= 0) {
+		r->to_submit -= (unsigned) ret < r->to_submit ? (unsigned) ret : r->to_submit;
+		return 0;
+	}
+	/* the wait was interrupted before anything was submitted, the
+	   caller gets to look at why. */
+	return errno == EINTR ? 0 : -1;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *r) {
+	unsigned head = *r->cq_head;
+	if(head == LOAD_ACQ(*r->cq_tail)) return 0;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+	STORE_REL(*r->cq_head, *r->cq_head + 1);
+}
+#endif
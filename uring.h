@@ -0,0 +1,66 @@
+#ifndef URING_H
+#define URING_H
+
+/* minimal io_uring wrapper using the raw syscalls, so liburing is not
+   needed. requires kernel headers of linux 5.19 or newer at build time
+   (multishot accept, provided buffer rings); at runtime uring_init()
+   simply fails on kernels lacking support. */
+
+#ifndef CONFIG_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_ACCEPT_MULTISHOT
+#define CONFIG_URING 1
+#endif
+#endif
+#endif
+#ifndef CONFIG_URING
+#define CONFIG_URING 0
+#endif
+#endif
+
+#if CONFIG_URING
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#pragma RcB2 DEP "uring.c"
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_local_tail, to_submit;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+	/* provided buffer ring, buffer group 0 */
+	struct io_uring_buf_ring *br;
+	unsigned br_mask, bufsize;
+	unsigned short br_tail;
+	char *bufs;
+};
+
+/* returns 0 on success, or -1 with errno set. */
+int uring_init(struct uring *r, unsigned entries);
+/* registers count (a power of 2) buffers of size bytes as buffer group 0. */
+int uring_setup_bufs(struct uring *r, unsigned count, unsigned size);
+void uring_free(struct uring *r);
+
+/* returns a zeroed sqe, submitting queued ones first if the ring is full. */
+struct io_uring_sqe *uring_sqe(struct uring *r);
+/* submits all queued sqes and waits for at least wait completions. a
+   signal ends the wait early. */
+int uring_submit(struct uring *r, unsigned wait);
+/* returns the next completion or NULL, uring_cqe_seen() releases it. */
+struct io_uring_cqe *uring_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#define uring_buf(R, BID) ((R)->bufs + (size_t) (BID) * (R)->bufsize)
+/* gives a buffer picked by the kernel back to the buffer ring. */
+void uring_buf_return(struct uring *r, unsigned short bid);
+
+#endif
+
+#endif
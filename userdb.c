@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include "userdb.h"
+#include "sblist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SALT_MAX 64
+#define HASH_LEN 32
+#define ROUNDS_MAX 10000000
+
+struct entry {
+	const char *name; /* interned, NULL for an empty slot */
+	unsigned char ulen, saltlen;
+	unsigned rounds;
+	unsigned char salt[SALT_MAX];
+	unsigned char hash[HASH_LEN];
+};
+
+struct table {
+	size_t mask;
+	unsigned rounds; /* the most of any entry, spent on unknown users */
+	struct entry e[];
+};
+
+/* readers announce themselves in the counter of the table slot they use,
+   and check that it's still the active one afterwards. so a reload only
+   has to wait for the counter of the old slot to drain before freeing
+   it, while readers never wait at all. */
+static struct table *tables[2];
+static unsigned active, readers[2];
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *db_file, *db_user, *db_pass;
+
+/* sha256, fips 180-4 */
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void sha_block(uint32_t *h, const unsigned char *p) {
+	uint32_t w[64], s[8], t1, t2;
+	unsigned i;
+	for(i=0;i<16;i++)
+		w[i] = (uint32_t) p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+	for(;i<64;i++)
+		w[i] = w[i-16] + (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+		       w[i-7] + (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+	memcpy(s, h, sizeof s);
+	for(i=0;i<64;i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha_k[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s+1, s, 7 * sizeof *s);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for(i=0;i<8;i++) h[i] += s[i];
+}
+
+/* hash of a followed by b, which is all that's ever needed here. */
+static void sha256(const void *a, size_t alen, const void *b, size_t blen, unsigned char *out) {
+	uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	unsigned char buf[128];
+	uint64_t bits = (uint64_t) (alen + blen) * 8;
+	size_t n = 0, i;
+	const unsigned char *src[2] = {a, b};
+	size_t len[2] = {alen, blen};
+	for(i=0;i<2;i++) while(len[i]) {
+		size_t k = 64 - n < len[i] ? 64 - n : len[i];
+		memcpy(buf + n, src[i], k);
+		src[i] += k;
+		len[i] -= k;
+		if((n += k) == 64) {
+			sha_block(h, buf);
+			n = 0;
+		}
+	}
+	buf[n++] = 0x80;
+	if(n > 56) {
+		memset(buf + n, 0, 64 - n);
+		sha_block(h, buf);
+		n = 0;
+	}
+	memset(buf + n, 0, 56 - n);
+	for(i=0;i<8;i++) buf[56+i] = bits >> (56 - 8*i);
+	sha_block(h, buf);
+	for(i=0;i<8;i++) {
+		out[4*i] = h[i] >> 24;
+		out[4*i+1] = h[i] >> 16;
+		out[4*i+2] = h[i] >> 8;
+		out[4*i+3] = h[i];
+	}
+}
+
+/* the salted hash, where each further round hashes the previous one
+   followed by the password again. */
+static void hash_pass(const struct entry *e, const void *pass, size_t plen, unsigned char *out) {
+	unsigned i;
+	sha256(e->salt, e->saltlen, pass, plen, out);
+	for(i=1; i<e->rounds; i++) sha256(out, HASH_LEN, pass, plen, out);
+}
+
+static size_t hash_name(const unsigned char *p, size_t n) {
+	size_t h = 2166136261u;
+	while(n--) h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+/* usernames are interned so that client->user remains valid after the
+   table it was found in is gone. only reloads add to it, under
+   reload_lock. */
+struct name {
+	struct name *next;
+	char s[];
+};
+static struct name *names[1024];
+
+static const char *intern(const char *s, size_t n) {
+	struct name **b = &names[hash_name((const void*) s, n) % 1024], *p;
+	for(p = *b; p; p = p->next)
+		if(!strncmp(p->s, s, n) && !p->s[n]) return p->s;
+	if(!(p = malloc(sizeof *p + n + 1))) return 0;
+	memcpy(p->s, s, n);
+	p->s[n] = 0;
+	p->next = *b;
+	*b = p;
+	return p->s;
+}
+
+static void random_salt(unsigned char *salt, size_t n) {
+	static unsigned long long x;
+	int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+	if(fd != -1) {
+		ssize_t r = read(fd, salt, n);
+		close(fd);
+		if(r == (ssize_t) n) return;
+	}
+	/* not meant to be secret, just distinct */
+	if(!x) x = time(0) ^ getpid();
+	while(n--) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		salt[n] = x >> 56;
+	}
+}
+
+static int unhex(const char *s, unsigned char *out, size_t n) {
+	size_t i;
+	for(i=0;i<2*n;i++) {
+		int c = s[i], v = c >= '0' && c <= '9' ? c - '0' :
+		        c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+		        c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if(v == -1) return -1;
+		if(i & 1) out[i/2] |= v;
+		else out[i/2] = v << 4;
+	}
+	return s[2*n] ? -1 : 0;
+}
+
+/* fills e from a user and a password, or from a $sha256$[rounds$]salt$hash
+   specification if hashed. */
+static int make_entry(struct entry *e, const char *user, const char *pass, int hashed) {
+	size_t ulen = strlen(user), plen = strlen(pass);
+	const char *salt, *hash;
+	unsigned long rounds;
+	char *end;
+	if(!ulen || ulen > 255 || !(e->name = intern(user, ulen))) return -1;
+	e->ulen = ulen;
+	e->rounds = 1;
+	if(!hashed) {
+		/* only kept in memory, a single round will do */
+		if(plen > 255) return -1;
+		e->saltlen = 16;
+		random_salt(e->salt, e->saltlen);
+		hash_pass(e, pass, plen, e->hash);
+		return 0;
+	}
+	salt = pass + 8;
+	if(!(hash = strchr(salt, '$'))) return -1;
+	if(strchr(hash + 1, '$')) {
+		/* three fields, the first one is the number of rounds */
+		if(*salt < '1' || *salt > '9') return -1;
+		rounds = strtoul(salt, &end, 10);
+		if(end != hash || rounds > ROUNDS_MAX) return -1;
+		e->rounds = rounds;
+		salt = hash + 1;
+		hash = strchr(salt, '$');
+	}
+	if(hash - salt > SALT_MAX) return -1;
+	e->saltlen = hash - salt;
+	memcpy(e->salt, salt, e->saltlen);
+	return unhex(hash + 1, e->hash, HASH_LEN);
+}
+
+static struct entry *lookup(struct table *t, const unsigned char *user, size_t ulen) {
+	size_t i = hash_name(user, ulen) & t->mask;
+	for(; t->e[i].name; i = (i + 1) & t->mask)
+		if(t->e[i].ulen == ulen && !memcmp(t->e[i].name, user, ulen)) return &t->e[i];
+	return 0;
+}
+
+static struct table *build(sblist *entries) {
+	size_t n = 4, i;
+	struct table *t;
+	while(n < 2 * sblist_getsize(entries)) n *= 2;
+	if(!(t = calloc(1, sizeof *t + n * sizeof t->e[0]))) return 0;
+	t->mask = n - 1;
+	for(i=0; i<sblist_getsize(entries); i++) {
+		struct entry *e = sblist_get(entries, i), *d;
+		/* the last line for a user wins */
+		if(!(d = lookup(t, (const void*) e->name, e->ulen))) {
+			d = &t->e[hash_name((const void*) e->name, e->ulen) & t->mask];
+			while(d->name) d = &t->e[(d - t->e + 1) & t->mask];
+		}
+		*d = *e;
+		if(e->rounds > t->rounds) t->rounds = e->rounds;
+	}
+	return t;
+}
+
+static int load_file(const char *file, sblist *entries) {
+	FILE *f = fopen(file, "r");
+	char *line = 0, *pass;
+	size_t cap = 0;
+	ssize_t l;
+	unsigned lineno = 0;
+	int ret = 0;
+	if(!f) {
+		dprintf(2, "error: %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	while((l = getline(&line, &cap, f)) != -1) {
+		struct entry e;
+		lineno++;
+		while(l && (line[l-1] == '\n' || line[l-1] == '\r')) line[--l] = 0;
+		if(!l || line[0] == '#') continue;
+		if(!(pass = strchr(line, ':'))) goto bad;
+		*pass++ = 0;
+		if(make_entry(&e, line, pass, !strncmp(pass, "$sha256$", 8)) || !sblist_add(entries, &e)) goto bad;
+		continue;
+	bad:
+		dprintf(2, "error: %s:%u: invalid entry\n", file, lineno);
+		ret = -1;
+		break;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static void drain(unsigned slot) {
+	static const struct timespec ts = {0, 1000000};
+	while(__atomic_load_n(&readers[slot], __ATOMIC_SEQ_CST)) nanosleep(&ts, 0);
+}
+
+static int load(void) {
+	sblist *entries = sblist_new(sizeof(struct entry), 64);
+	struct entry e;
+	struct table *t = 0;
+	unsigned old, next;
+	int ret = -1;
+	if(!entries) return -1;
+	pthread_mutex_lock(&reload_lock);
+	if(db_user && (make_entry(&e, db_user, db_pass, 0) || !sblist_add(entries, &e))) goto out;
+	if(db_file && load_file(db_file, entries)) goto out;
+	if(!(t = build(entries))) goto out;
+	old = active;
+	next = !old;
+	/* readers may still be on the unused slot until they saw the
+	   previous switch */
+	drain(next);
+	tables[next] = t;
+	__atomic_store_n(&active, next, __ATOMIC_SEQ_CST);
+	drain(old);
+	free(tables[old]);
+	tables[old] = 0;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&reload_lock);
+	sblist_free(entries);
+	return ret;
+}
+
+int userdb_init(const char *file, const char *user, const char *pass) {
+	db_file = file;
+	db_user = user;
+	db_pass = pass;
+	return load();
+}
+
+int userdb_reload(void) {
+	return load();
+}
+
+int userdb_check(const unsigned char *user, size_t ulen,
+                 const unsigned char *pass, size_t plen, const char **name) {
+	struct entry dummy = {.rounds = 1};
+	unsigned char hash[HASH_LEN], diff = 0;
+	const struct entry *e;
+	unsigned slot;
+	size_t i;
+	while(1) {
+		slot = __atomic_load_n(&active, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&readers[slot], 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&active, __ATOMIC_SEQ_CST) == slot) break;
+		__atomic_fetch_sub(&readers[slot], 1, __ATOMIC_SEQ_CST);
+	}
+	/* unknown users get hashed all the same, so that the reply takes as
+	   long as for a wrong password */
+	if(!tables[slot] || !(e = lookup(tables[slot], user, ulen))) {
+		if(tables[slot]) dummy.rounds = tables[slot]->rounds;
+		e = &dummy;
+		diff = 1;
+	}
+	hash_pass(e, pass, plen, hash);
+	for(i=0;i<HASH_LEN;i++) diff |= hash[i] ^ e->hash[i];
+	if(!diff) *name = e->name;
+	__atomic_fetch_sub(&readers[slot], 1, __ATOMIC_SEQ_CST);
+	return diff ? -1 : 0;
+}
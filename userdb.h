@@ -0,0 +1,25 @@
+#ifndef USERDB_H
+#define USERDB_H
+
+#include <stddef.h>
+
+#pragma RcB2 DEP "userdb.c"
+
+/* the users allowed to authenticate, from the -u/-P pair and from a
+   file with one user:password or user:$sha256$[rounds$]salt$hash line
+   each, where hash is the hex sha256 of salt followed by the password,
+   hashed again with the password appended for each further round. all of
+   them are kept in an immutable hash table with salted hashes, which
+   userdb_reload() replaces without ever blocking userdb_check(). */
+
+/* loads the users. file or user may be NULL. returns -1 if the file
+   can't be read or has a malformed line, after printing why. */
+int userdb_init(const char *file, const char *user, const char *pass);
+/* reads the file again. on error the current users are kept. */
+int userdb_reload(void);
+/* checks a username/password pair. on success, *name is set to the
+   username, which stays valid for good. */
+int userdb_check(const unsigned char *user, size_t ulen,
+                 const unsigned char *pass, size_t plen, const char **name);
+
+#endif